@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <inttypes.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -6,21 +7,38 @@
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <poll.h>
 #include <unistd.h>
 #include <time.h>
+#include <signal.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/random.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
 #include <string>
+#include <string_view>
 #include <vector>
 // proj
 #include "hashtable.h"
 #include "zset.h"
 #include "list.h"
 #include "heap.h"
+#include "wheel.h"
 #include "thread_pool.h"
 #include "common.h"
+#include "uring.h"
+#include "bufpool.h"
+#include "slab.h"
+#include "snapshot.h"
+#include "aof.h"
+#include "repl.h"
 
 
 static void msg(const char *msg) {
@@ -39,6 +57,27 @@ static uint64_t get_monotonic_usec() {
     return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
 }
 
+static int64_t get_unix_msec() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return int64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000000;
+}
+
+static bool write_all(int fd, const char *data, size_t n) {
+    while (n > 0) {
+        ssize_t rv = write(fd, data, n);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        data += rv;
+        n -= (size_t)rv;
+    }
+    return true;
+}
+
 static void fd_set_nb(int fd) {
     errno = 0;
     int flags = fcntl(fd, F_GETFL, 0);
@@ -57,41 +96,187 @@ static void fd_set_nb(int fd) {
 }
 
 struct Conn;
+struct FreeJob;
 
-// global variables
-static struct {
+// per-reactor state. each reactor thread owns one shard of the keyspace,
+// its own listening socket and its own connections.
+static thread_local struct {
     HMap db;
     // a map of all client connections, keyed by fd
     std::vector<Conn *> fd2conn;
     // timers for idle connections
     DList idle_list;
     // timers for TTLs
+#ifdef TTL_WHEEL
+    TimerWheel wheel;
+#else
     std::vector<HeapItem> heap;
-    // the thread pool
-    TheadPool tp;
+#endif
+    // the active expiry budget, see process_timers()
+    uint64_t expire_budget_us = 0;
+    // the cached clock, see clock_refresh()
+    uint64_t now_us = 0;
+    uint64_t clock_reads = 0;
+    uint64_t clock_cached = 0;
+    // the values to free in the background, see lazyfree_add()
+    FreeJob *free_job = NULL;
+    // the write commands of this iteration, see aof_feed()
+    std::string aof_buf;
+    // the AOF offsets of the last submitted and synced commands
+    uint64_t aof_seq = 0;
+    uint64_t aof_synced = 0;
+    // the connections whose replies wait for the AOF, see aof_hold()
+    std::vector<Conn *> aof_waiters;
+    // the epoll instance watching the listening fd and all connections
+    int epfd = -1;
+    // the index of this reactor in g_shards
+    size_t shard_id = 0;
+    // the io_uring engine, see uring_run()
+    URing ring;
+    URingBufs bufs;
+    uint64_t inbox_cnt = 0;
+    // the arguments of the current request, they point into Conn::rbuf.
+    // reused across requests to avoid allocations.
+    std::vector<std::string_view> args;
+    // the response being generated, reused as well
+    std::string out;
+    // free connection buffers
+    BufPool bufpool;
 } g_data;
 
-const size_t k_max_msg = 4096;
+// the thread pool, shared by all reactors
+static TheadPool g_tp;
+// the values handed to the thread pool and not yet freed, all reactors
+static std::atomic<uint64_t> g_lazyfree_bytes{0};
+static std::atomic<uint64_t> g_lazyfree_keys{0};
+
+// the event loop reads the clock once after each wait, and everything
+// in the same iteration uses that time. TTL commands can opt out.
+static bool g_precise_ttl = false;
+// the cost of a clock read, measured at startup
+static double g_clock_read_ns = 0;
+
+static uint64_t clock_refresh() {
+    g_data.now_us = get_monotonic_usec();
+    g_data.clock_reads++;
+    return g_data.now_us;
+}
+
+static uint64_t clock_now_us() {
+    g_data.clock_cached++;
+    return g_data.now_us;
+}
+
+static uint64_t clock_ttl_us() {
+    return g_precise_ttl ? clock_refresh() : clock_now_us();
+}
+
+static void clock_calibrate() {
+    const int k_reads = 100000;
+    uint64_t t0 = get_monotonic_usec();
+    for (int i = 0; i < k_reads; ++i) {
+        volatile uint64_t now = get_monotonic_usec();
+        (void)now;
+    }
+    uint64_t t1 = get_monotonic_usec();
+    g_clock_read_ns = (double)(t1 - t0) * 1000 / k_reads;
+}
+
+// a request forwarded to the shard owning the key, or the reply to it
+struct ShardMsg {
+    size_t from = 0;        // the shard owning the connection
+    Conn *conn = NULL;      // only dereferenced by the `from` shard
+    bool is_reply = false;
+    bool is_pause = false;  // see snapshot_pause()
+    bool is_repl = false;   // see repl_apply()
+    FullSync *sync = NULL;  // see repl_sync_fork()
+    uint64_t aof_seq = 0;   // a held reply, see aof_release()
+    std::vector<std::string> cmd;
+    std::string out;
+    std::string repl;       // the requests from the primary, no replies
+};
+
+// the cross-shard mailbox of a reactor
+struct Shard {
+    pthread_mutex_t mu;
+    std::vector<ShardMsg> inbox;
+    int efd = -1;           // eventfd, wakes up the owning reactor
+    // the keyspace of the reactor, for SAVE and BGSAVE
+    HMap *db = NULL;
+#ifndef TTL_WHEEL
+    std::vector<HeapItem> *heap = NULL;
+#endif
+    // the replies to forwarded requests that wait for the AOF
+    std::vector<ShardMsg> aof_held;
+};
+
+static std::vector<Shard *> g_shards;
+
+// use io_uring instead of epoll + read()/write()
+static bool g_use_uring = false;
+
+// the limit of a single request or response, see --max-msg
+static size_t g_max_msg = (size_t)512 << 20;
+
+// the TCP port of the clients, see --port
+static uint16_t g_port = 1234;
+// the minimum free space for a read
+const size_t k_read_chunk = 4096;
+// responses this large are queued as is instead of copied into wbuf
+const size_t k_out_chunk_min = 16 * 1024;
+// stop executing pipelined requests and flush above this much output
+const size_t k_out_flush_at = 1024 * 1024;
+// the max number of iovecs per writev()/sendmsg()
+const size_t k_max_iov = 16;
 
 enum {
     STATE_REQ = 0,
     STATE_RES = 1,
     STATE_END = 2,  // mark the connection for deletion
+    STATE_WAIT = 3, // waiting for replies from other shards
+};
+
+// a large response in the output queue, it follows wbuf[0, pos)
+struct OutChunk {
+    size_t pos = 0;
+    std::string data;
 };
 
 struct Conn {
     int fd = -1;
     uint32_t state = 0;     // either STATE_REQ or STATE_RES
-    // buffer for reading
+    uint32_t events = 0;    // the events currently registered in epoll
+    uint32_t uops = 0;      // io_uring operations in flight (UOP_*)
+    // buffer for reading, the unconsumed data is [rbuf_head, rbuf_size).
+    // both buffers come from g_data.bufpool and are given back when empty.
+    uint8_t *rbuf = NULL;
+    size_t rbuf_cap = 0;
+    size_t rbuf_head = 0;
     size_t rbuf_size = 0;
-    uint8_t rbuf[4 + k_max_msg];
-    // buffer for writing
+    // the output queue: the responses of all pipelined requests are
+    // appended to wbuf, except for large ones which are kept in wchunks.
+    uint8_t *wbuf = NULL;
+    size_t wbuf_cap = 0;
     size_t wbuf_size = 0;
     size_t wbuf_sent = 0;
-    uint8_t wbuf[4 + k_max_msg];
+    std::vector<OutChunk> wchunks;
+    size_t wchunk_head = 0;     // the first chunk not fully sent
+    size_t wchunk_sent = 0;     // bytes sent of the head chunk
+    size_t wchunk_bytes = 0;
+    // the sendmsg() arguments of the io_uring engine
+    struct iovec wiov[k_max_iov];
+    struct msghdr wmsg;
     uint64_t idle_start = 0;
     // timer
     DList idle_list;
+    // replies still expected from other shards, and the partial output
+    uint32_t pending = 0;
+    std::string wait_out;
+    bool hangup = false;    // closed by the client while waiting
+    // in g_data.aof_waiters, until the AOF is synced up to aof_seq
+    bool aof_held = false;
+    bool aof_wrote = false;     // executed a write since the last reply
+    uint64_t aof_seq = 0;   // 0 until the commit, see aof_commit()
 };
 
 static void conn_put(std::vector<Conn *> &fd2conn, struct Conn *conn) {
@@ -101,6 +286,218 @@ static void conn_put(std::vector<Conn *> &fd2conn, struct Conn *conn) {
     fd2conn[conn->fd] = conn;
 }
 
+static bool conn_out_empty(Conn *conn) {
+    return conn->wbuf_size == 0 && conn->wchunks.empty();
+}
+
+static size_t conn_out_size(Conn *conn) {
+    return conn->wbuf_size + conn->wchunk_bytes;
+}
+
+// gather the unsent output in order, returns the number of iovecs.
+static size_t conn_out_iov(Conn *conn, struct iovec *iov, size_t max) {
+    size_t n = 0;
+    size_t pos = conn->wbuf_sent;
+    size_t i = conn->wchunk_head;
+    for (; i < conn->wchunks.size() && n + 2 <= max; ++i) {
+        OutChunk &chunk = conn->wchunks[i];
+        if (pos < chunk.pos) {
+            iov[n++] = {&conn->wbuf[pos], chunk.pos - pos};
+        }
+        size_t skip = (i == conn->wchunk_head) ? conn->wchunk_sent : 0;
+        iov[n++] = {&chunk.data[skip], chunk.data.size() - skip};
+        pos = chunk.pos;
+    }
+    if (i == conn->wchunks.size() && pos < conn->wbuf_size && n < max) {
+        iov[n++] = {&conn->wbuf[pos], conn->wbuf_size - pos};
+    }
+    return n;
+}
+
+// consume `n` bytes of output, returns true if the queue is drained.
+static bool conn_out_advance(Conn *conn, size_t n) {
+    while (n) {
+        OutChunk *chunk = NULL;
+        if (conn->wchunk_head < conn->wchunks.size()) {
+            chunk = &conn->wchunks[conn->wchunk_head];
+        }
+        if (chunk && conn->wbuf_sent == chunk->pos) {
+            size_t k = std::min(n, chunk->data.size() - conn->wchunk_sent);
+            conn->wchunk_sent += k;
+            n -= k;
+            if (conn->wchunk_sent == chunk->data.size()) {
+                std::string().swap(chunk->data);  // free it early
+                conn->wchunk_head++;
+                conn->wchunk_sent = 0;
+            }
+        } else {
+            size_t end = chunk ? chunk->pos : conn->wbuf_size;
+            size_t k = std::min(n, end - conn->wbuf_sent);
+            conn->wbuf_sent += k;
+            n -= k;
+        }
+    }
+    assert(conn->wbuf_sent <= conn->wbuf_size);
+    if (conn->wbuf_sent < conn->wbuf_size
+        || conn->wchunk_head < conn->wchunks.size())
+    {
+        return false;
+    }
+    conn->wbuf_size = conn->wbuf_sent = 0;
+    conn->wchunks.clear();
+    conn->wchunk_head = conn->wchunk_sent = conn->wchunk_bytes = 0;
+    return true;
+}
+
+// io_uring operations, stored in the low bits of the SQE user_data
+enum {
+    UOP_RECV = 1,
+    UOP_SEND = 2,
+    UOP_ACCEPT = 3,
+    UOP_INBOX = 4,
+    UOP_MASK = 7,
+    // not an operation: the recv in flight writes into rbuf
+    UOP_RECV_RBUF = 8,
+};
+
+static io_uring_sqe *uring_sqe() {
+    io_uring_sqe *sqe = uring_get_sqe(&g_data.ring);
+    if (!sqe) {
+        die("io_uring SQ full");
+    }
+    return sqe;
+}
+
+// grow a pooled buffer to at least `need` bytes, keeping the first `keep`.
+static bool buf_reserve(uint8_t **buf, size_t *cap, size_t keep, size_t need) {
+    if (need <= *cap) {
+        return true;
+    }
+    size_t ncap = need;
+    uint8_t *nbuf = bufpool_get(&g_data.bufpool, &ncap);
+    if (!nbuf) {
+        return false;
+    }
+    if (keep) {
+        memcpy(nbuf, *buf, keep);
+    }
+    bufpool_put(&g_data.bufpool, *buf, *cap);
+    *buf = nbuf;
+    *cap = ncap;
+    return true;
+}
+
+static void buf_release(uint8_t **buf, size_t *cap) {
+    bufpool_put(&g_data.bufpool, *buf, *cap);
+    *buf = NULL;
+    *cap = 0;
+}
+
+static bool rbuf_reserve(Conn *conn);
+
+// read into a provided buffer picked by the kernel when data arrives.
+// with `select` off, read directly into the free space of rbuf.
+static void uring_queue_recv(Conn *conn, bool select) {
+    assert(!(conn->uops & UOP_RECV));
+    io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    if (select) {
+        sqe->len = g_data.bufs.buf_size;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = g_data.bufs.bgid;
+    } else {
+        if (!rbuf_reserve(conn)) {
+            die("out of memory");
+        }
+        sqe->addr = (uint64_t)&conn->rbuf[conn->rbuf_size];
+        sqe->len = (uint32_t)(conn->rbuf_cap - conn->rbuf_size);
+        conn->uops |= UOP_RECV_RBUF;
+    }
+    sqe->user_data = (uint64_t)conn | UOP_RECV;
+    conn->uops |= UOP_RECV;
+}
+
+static void uring_queue_send(Conn *conn) {
+    if (conn->uops & UOP_SEND) {
+        return;
+    }
+    io_uring_sqe *sqe = uring_sqe();
+    size_t niov = conn_out_iov(conn, conn->wiov, k_max_iov);
+    assert(niov > 0);
+    sqe->fd = conn->fd;
+    if (niov == 1) {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (uint64_t)conn->wiov[0].iov_base;
+        sqe->len = (uint32_t)conn->wiov[0].iov_len;
+    } else {
+        // both stay valid in Conn until the completion
+        conn->wmsg = {};
+        conn->wmsg.msg_iov = conn->wiov;
+        conn->wmsg.msg_iovlen = niov;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr = (uint64_t)&conn->wmsg;
+        sqe->len = 1;
+    }
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)conn | UOP_SEND;
+    conn->uops |= UOP_SEND;
+}
+
+// the io_uring counterpart of the epoll registration
+static void uring_conn_arm(Conn *conn) {
+    if (conn->state == STATE_REQ && !(conn->uops & UOP_RECV)) {
+        uring_queue_recv(conn, true);
+    }
+    // STATE_RES: the send was queued by state_res()
+}
+
+// the events we want from epoll, derived from the connection state
+static uint32_t conn_want_events(Conn *conn) {
+    switch (conn->state) {
+    case STATE_REQ:
+        return EPOLLIN;
+    case STATE_RES:
+        return EPOLLOUT;
+    default:
+        return 0;   // STATE_WAIT: nothing to do until the replies arrive
+    }
+}
+
+static void conn_watch(Conn *conn) {
+    if (g_use_uring) {
+        return uring_conn_arm(conn);
+    }
+    struct epoll_event ev = {};
+    ev.events = conn_want_events(conn);
+    ev.data.fd = conn->fd;
+    if (epoll_ctl(g_data.epfd, EPOLL_CTL_ADD, conn->fd, &ev)) {
+        die("epoll_ctl(ADD)");
+    }
+    conn->events = ev.events;
+}
+
+// only call into the kernel when the connection flips
+// between STATE_REQ and STATE_RES.
+static void conn_rewatch(Conn *conn) {
+    if (g_use_uring) {
+        return uring_conn_arm(conn);
+    }
+    uint32_t want = conn_want_events(conn);
+    if (want == conn->events) {
+        return;
+    }
+    struct epoll_event ev = {};
+    ev.events = want;
+    ev.data.fd = conn->fd;
+    if (epoll_ctl(g_data.epfd, EPOLL_CTL_MOD, conn->fd, &ev)) {
+        die("epoll_ctl(MOD)");
+    }
+    conn->events = want;
+}
+
+static int32_t conn_new(int connfd);
+
 static int32_t accept_new_conn(int fd) {
     // accept
     struct sockaddr_in client_addr = {};
@@ -111,82 +508,136 @@ static int32_t accept_new_conn(int fd) {
         return -1;  // error
     }
 
+    return conn_new(connfd);
+}
+
+static int32_t conn_new(int connfd) {
     // set the new connection fd to nonblocking mode
     fd_set_nb(connfd);
     // creating the struct Conn
-    struct Conn *conn = (struct Conn *)malloc(sizeof(struct Conn));
-    if (!conn) {
-        close(connfd);
-        return -1;
-    }
+    struct Conn *conn = new (slab_alloc(sizeof(Conn))) Conn();
     conn->fd = connfd;
     conn->state = STATE_REQ;
-    conn->rbuf_size = 0;
-    conn->wbuf_size = 0;
-    conn->wbuf_sent = 0;
-    conn->idle_start = get_monotonic_usec();
+    conn->idle_start = clock_now_us();
     dlist_insert_before(&g_data.idle_list, &conn->idle_list);
     conn_put(g_data.fd2conn, conn);
+    conn_watch(conn);
     return 0;
 }
 
 static void state_req(Conn *conn);
 static void state_res(Conn *conn);
 
-const size_t k_max_args = 1024;
-
-static int32_t parse_req(
-    const uint8_t *data, size_t len, std::vector<std::string> &out)
-{
-    if (len < 4) {
-        return -1;
-    }
-    uint32_t n = 0;
-    memcpy(&n, &data[0], 4);
-    if (n > k_max_args) {
-        return -1;
-    }
-
-    size_t pos = 4;
-    while (n--) {
-        if (pos + 4 > len) {
-            return -1;
-        }
-        uint32_t sz = 0;
-        memcpy(&sz, &data[pos], 4);
-        if (pos + 4 + sz > len) {
-            return -1;
-        }
-        out.push_back(std::string((char *)&data[pos + 4], sz));
-        pos += 4 + sz;
-    }
-
-    if (pos != len) {
-        return -1;  // trailing garbage
-    }
-    return 0;
-}
-
 enum {
     T_STR = 0,
     T_ZSET = 1,
 };
 
-// the structure for the key
+// the encodings of T_STR values
+enum {
+    ENC_INT = 0,    // an int64, the text is its canonical form
+    ENC_EMBED = 1,  // inlined after the key
+    ENC_RAW = 2,    // a separate allocation
+};
+
+// the structure for the key. a single variable-length allocation:
+// the header, the key, then `vcap` bytes of room for an inline value.
 struct Entry {
     struct HNode node;
-    std::string key;
-    std::string val;
-    uint32_t type = 0;
-    ZSet *zset = NULL;
     // for TTLs
-    size_t heap_idx = -1;
+#ifdef TTL_WHEEL
+    WTimer ttl;
+#else
+    size_t heap_idx;
+#endif
+    uint32_t klen;
+    uint32_t vcap;
+    uint8_t type;
+    uint8_t enc;
+    uint32_t vlen;      // ENC_EMBED, ENC_RAW
+    union {
+        int64_t ival;   // ENC_INT
+        char *vptr;     // ENC_RAW
+        ZSet *zset;     // T_ZSET
+    };
+    char data[0];
+};
+
+// values up to this size are inlined into the entry
+const size_t k_max_embed = 64;
+
+static Entry *entry_new(
+    std::string_view key, uint64_t hcode, uint8_t type, size_t vcap)
+{
+    // the size class is rounded up, the slack becomes room for the value
+    size_t sz = slab_good_size(sizeof(Entry) + key.size() + vcap);
+    Entry *ent = (Entry *)slab_alloc(sz);
+    assert(ent);    // not a good idea in real projects
+    ent->node = HNode{};
+    ent->node.hcode = hcode;
+#ifdef TTL_WHEEL
+    ent->ttl = WTimer{};
+#else
+    ent->heap_idx = -1;
+#endif
+    ent->klen = (uint32_t)key.size();
+    ent->vcap = (uint32_t)(sz - sizeof(Entry) - key.size());
+    ent->type = type;
+    ent->enc = ENC_INT;
+    ent->vlen = 0;
+    ent->ival = 0;
+    memcpy(ent->data, key.data(), key.size());
+    return ent;
+}
+
+static std::string_view entry_key(Entry *ent) {
+    return std::string_view(ent->data, ent->klen);
+}
+
+// a helper structure for the hashtable lookup
+struct LookupKey {
+    HNode node;
+    std::string_view key;
 };
 
-static bool entry_eq(HNode *lhs, HNode *rhs) {
-    struct Entry *le = container_of(lhs, struct Entry, node);
-    struct Entry *re = container_of(rhs, struct Entry, node);
-    return lhs->hcode == rhs->hcode && le->key == re->key;
+static bool entry_eq(HNode *node, HNode *key) {
+    struct Entry *ent = container_of(node, struct Entry, node);
+    struct LookupKey *lk = container_of(key, struct LookupKey, node);
+    return node->hcode == key->hcode && entry_key(ent) == lk->key;
+}
+
+static void lookup_key_init(LookupKey *lk, std::string_view key) {
+    lk->key = key;
+    lk->node.hcode = str_hash((uint8_t *)key.data(), key.size());
+}
+
+static uint64_t entry_expire_at(Entry *ent);
+static void entry_del(Entry *ent);
+
+static bool hnode_same(HNode *lhs, HNode *rhs) {
+    return lhs == rhs;
+}
+
+static bool entry_expired(Entry *ent, uint64_t now_us) {
+    return entry_expire_at(ent) <= now_us;
+}
+
+// look up a key. an expired key that the timers haven't reached yet
+// is deleted here, so that it's never visible.
+static Entry *entry_lookup(LookupKey *key) {
+    HNode *node = hm_lookup(&g_data.db, &key->node, &entry_eq);
+    if (!node) {
+        return NULL;
+    }
+    Entry *ent = container_of(node, Entry, node);
+    if (entry_expire_at(ent) != (uint64_t)-1
+        && entry_expired(ent, clock_ttl_us()))
+    {
+        hm_pop(&g_data.db, &ent->node, &hnode_same);
+        entry_del(ent);
+        return NULL;
+    }
+    return ent;
 }
 
 enum {
@@ -194,6 +645,7 @@ enum {
     ERR_2BIG = 2,
     ERR_TYPE = 3,
     ERR_ARG = 4,
+    ERR_READONLY = 5,
 };
 
 static void out_nil(std::string &out) {
@@ -207,10 +659,6 @@ static void out_str(std::string &out, const char *s, size_t size) {
     out.append(s, len);
 }
 
-static void out_str(std::string &out, const std::string &val) {
-    return out_str(out, val.data(), val.size());
-}
-
 static void out_int(std::string &out, int64_t val) {
     out.push_back(SER_INT);
     out.append((char *)&val, 8);
@@ -239,45 +687,153 @@ static void out_update_arr(std::string &out, uint32_t n) {
     memcpy(&out[1], &n, 4);
 }
 
-static void do_get(std::vector<std::string> &cmd, std::string &out) {
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+// the arguments are not NUL-terminated, copy them to the stack
+// before handing them to strtoll()/strtod().
+const size_t k_max_num_len = 64;
 
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!node) {
-        return out_nil(out);
+static bool str2int(std::string_view s, int64_t &out) {
+    char buf[k_max_num_len];
+    if (s.size() >= sizeof(buf)) {
+        return false;
     }
+    memcpy(buf, s.data(), s.size());
+    buf[s.size()] = '\0';
 
-    Entry *ent = container_of(node, Entry, node);
+    char *endp = NULL;
+    out = strtoll(buf, &endp, 10);
+    return endp == buf + s.size();
+}
+
+// only the canonical form, so that the text can be reproduced:
+// "12" but not "012", "+12" or " 12".
+static bool str2int_exact(std::string_view s, int64_t &out) {
+    if (s.empty() || s.size() > 20 || !str2int(s, out)) {
+        return false;
+    }
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%" PRId64, out);
+    return (size_t)n == s.size() && 0 == memcmp(buf, s.data(), s.size());
+}
+
+static void entry_set_str(Entry *ent, std::string_view val) {
+    assert(ent->type == T_STR);
+    if (ent->enc == ENC_RAW) {
+        free(ent->vptr);
+    }
+    int64_t ival = 0;
+    if (str2int_exact(val, ival)) {
+        ent->enc = ENC_INT;
+        ent->ival = ival;
+    } else if (val.size() <= ent->vcap) {
+        ent->enc = ENC_EMBED;
+        ent->vlen = (uint32_t)val.size();
+        memcpy(&ent->data[ent->klen], val.data(), val.size());
+    } else {
+        ent->enc = ENC_RAW;
+        ent->vlen = (uint32_t)val.size();
+        ent->vptr = (char *)malloc(val.size());
+        assert(ent->vptr);
+        memcpy(ent->vptr, val.data(), val.size());
+    }
+}
+
+// the value of a string, an integer is formatted into `buf`
+static std::string_view entry_str(Entry *ent, char buf[32]) {
+    switch (ent->enc) {
+    case ENC_INT:
+        return std::string_view(
+            buf, (size_t)snprintf(buf, 32, "%" PRId64, ent->ival));
+    case ENC_EMBED:
+        return std::string_view(&ent->data[ent->klen], ent->vlen);
+    default:
+        return std::string_view(ent->vptr, ent->vlen);
+    }
+}
+
+static void out_entry_str(std::string &out, Entry *ent) {
+    char buf[32];
+    std::string_view val = entry_str(ent, buf);
+    return out_str(out, val.data(), val.size());
+}
+
+static bool cmd_is(std::string_view word, const char *cmd) {
+    return word.size() == strlen(cmd)
+        && 0 == strncasecmp(word.data(), cmd, word.size());
+}
+
+static void do_get(std::vector<std::string_view> &cmd, std::string &out) {
+    LookupKey key;
+    lookup_key_init(&key, cmd[1]);
+
+    Entry *ent = entry_lookup(&key);
+    if (!ent) {
+        return out_nil(out);
+    }
     if (ent->type != T_STR) {
         return out_err(out, ERR_TYPE, "expect string type");
     }
-    return out_str(out, ent->val);
+    return out_entry_str(out, ent);
+}
+
+static Entry *entry_new_str(LookupKey *key, std::string_view val) {
+    int64_t ival = 0;
+    size_t vcap = val.size();
+    if (vcap > k_max_embed || str2int_exact(val, ival)) {
+        vcap = 0;
+    }
+    Entry *ent = entry_new(key->key, key->node.hcode, T_STR, vcap);
+    entry_set_str(ent, val);
+    return ent;
 }
 
-static void do_set(std::vector<std::string> &cmd, std::string &out) {
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+static void do_set(std::vector<std::string_view> &cmd, std::string &out) {
+    LookupKey key;
+    lookup_key_init(&key, cmd[1]);
 
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (node) {
-        Entry *ent = container_of(node, Entry, node);
+    Entry *ent = entry_lookup(&key);
+    if (ent) {
         if (ent->type != T_STR) {
             return out_err(out, ERR_TYPE, "expect string type");
         }
-        ent->val.swap(cmd[2]);
+        entry_set_str(ent, cmd[2]);
     } else {
-        Entry *ent = new Entry();
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        ent->val.swap(cmd[2]);
+        ent = entry_new_str(&key, cmd[2]);
         hm_insert(&g_data.db, &ent->node);
     }
     return out_nil(out);
 }
 
+#ifdef TTL_WHEEL
+
+// set or remove the TTL
+static void entry_set_ttl(Entry *ent, int64_t ttl_ms) {
+    if (ttl_ms < 0) {
+        tw_del(&g_data.wheel, &ent->ttl);
+    } else {
+        uint64_t now_ms = clock_ttl_us() / 1000;
+        tw_add(&g_data.wheel, &ent->ttl, now_ms + (uint64_t)ttl_ms);
+    }
+}
+
+// the expiry time in us, -1 if no TTL
+static uint64_t entry_expire_at(Entry *ent) {
+    return tw_armed(&ent->ttl) ? ent->ttl.expire_ms * 1000 : (uint64_t)-1;
+}
+
+// no TTL expires before this
+static uint64_t ttl_next_us() {
+    uint64_t next_ms = tw_next_ms(&g_data.wheel);
+    return next_ms == (uint64_t)-1 ? next_ms : next_ms * 1000;
+}
+
+// remove a key from the timers if it has expired
+static Entry *ttl_pop_expired(uint64_t now_us) {
+    WTimer *timer = tw_pop(&g_data.wheel, now_us / 1000);
+    return timer ? container_of(timer, Entry, ttl) : NULL;
+}
+
+#else
+
 // set or remove the TTL
 static void entry_set_ttl(Entry *ent, int64_t ttl_ms) {
     if (ttl_ms < 0 && ent->heap_idx != (size_t)-1) {
@@ -299,177 +855,430 @@ static void entry_set_ttl(Entry *ent, int64_t ttl_ms) {
             g_data.heap.push_back(item);
             pos = g_data.heap.size() - 1;
         }
-        g_data.heap[pos].val = get_monotonic_usec() + (uint64_t)ttl_ms * 1000;
+        g_data.heap[pos].val = clock_ttl_us() + (uint64_t)ttl_ms * 1000;
         heap_update(g_data.heap.data(), pos, g_data.heap.size());
     }
 }
 
-static bool str2int(const std::string &s, int64_t &out) {
-    char *endp = NULL;
-    out = strtoll(s.c_str(), &endp, 10);
-    return endp == s.c_str() + s.size();
+static uint64_t heap_expire_at(std::vector<HeapItem> &heap, Entry *ent) {
+    size_t pos = ent->heap_idx;
+    return pos == (size_t)-1 ? (uint64_t)-1 : heap[pos].val;
+}
+
+static uint64_t entry_expire_at(Entry *ent) {
+    return heap_expire_at(g_data.heap, ent);
+}
+
+static uint64_t ttl_next_us() {
+    return g_data.heap.empty() ? (uint64_t)-1 : g_data.heap[0].val;
+}
+
+static Entry *ttl_pop_expired(uint64_t now_us) {
+    if (g_data.heap.empty() || g_data.heap[0].val >= now_us) {
+        return NULL;
+    }
+    Entry *ent = container_of(g_data.heap[0].ref, Entry, heap_idx);
+    entry_set_ttl(ent, -1);
+    return ent;
 }
 
-static void do_expire(std::vector<std::string> &cmd, std::string &out) {
+#endif  // TTL_WHEEL
+
+static void do_expire(std::vector<std::string_view> &cmd, std::string &out) {
     int64_t ttl_ms = 0;
     if (!str2int(cmd[2], ttl_ms)) {
         return out_err(out, ERR_ARG, "expect int64");
     }
 
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    LookupKey key;
+    lookup_key_init(&key, cmd[1]);
 
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (node) {
-        Entry *ent = container_of(node, Entry, node);
+    Entry *ent = entry_lookup(&key);
+    if (ent) {
         entry_set_ttl(ent, ttl_ms);
     }
-    return out_int(out, node ? 1: 0);
+    return out_int(out, ent ? 1: 0);
 }
 
-static void do_ttl(std::vector<std::string> &cmd, std::string &out) {
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+// pexpireat key unix_ms, a deadline in the past expires the key at once
+static void do_pexpireat(
+    std::vector<std::string_view> &cmd, std::string &out)
+{
+    int64_t at_ms = 0;
+    if (!str2int(cmd[2], at_ms)) {
+        return out_err(out, ERR_ARG, "expect int64");
+    }
+
+    LookupKey key;
+    lookup_key_init(&key, cmd[1]);
 
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!node) {
+    Entry *ent = entry_lookup(&key);
+    if (ent) {
+        entry_set_ttl(ent, std::max(at_ms - get_unix_msec(), (int64_t)0));
+    }
+    return out_int(out, ent ? 1: 0);
+}
+
+static void do_ttl(std::vector<std::string_view> &cmd, std::string &out) {
+    LookupKey key;
+    lookup_key_init(&key, cmd[1]);
+
+    Entry *ent = entry_lookup(&key);
+    if (!ent) {
         return out_int(out, -2);
     }
 
-    Entry *ent = container_of(node, Entry, node);
-    if (ent->heap_idx == (size_t)-1) {
+    uint64_t expire_at = entry_expire_at(ent);
+    if (expire_at == (uint64_t)-1) {
         return out_int(out, -1);
     }
 
-    uint64_t expire_at = g_data.heap[ent->heap_idx].val;
-    uint64_t now_us = get_monotonic_usec();
+    uint64_t now_us = clock_ttl_us();
     return out_int(out, expire_at > now_us ? (expire_at - now_us) / 1000 : 0);
 }
 
 // deallocate the key immediately
 static void entry_destroy(Entry *ent) {
     switch (ent->type) {
+    case T_STR:
+        if (ent->enc == ENC_RAW) {
+            free(ent->vptr);
+        }
+        break;
     case T_ZSET:
         zset_dispose(ent->zset);
         delete ent->zset;
         break;
     }
-    delete ent;
-}
-
-static void entry_del_async(void *arg) {
-    entry_destroy((Entry *)arg);
+    slab_free(ent, sizeof(Entry) + ent->klen + ent->vcap);
 }
 
-// dispose the entry after it got detached from the key space
-static void entry_del(Entry *ent) {
-    entry_set_ttl(ent, -1);
-
-    const size_t k_large_container_size = 10000;
-    bool too_big = false;
+// the bytes allocated for the key and its value
+static size_t entry_mem_usage(Entry *ent) {
+    size_t n = sizeof(Entry) + ent->klen + ent->vcap;
     switch (ent->type) {
+    case T_STR:
+        if (ent->enc == ENC_RAW) {
+            n += ent->vlen;
+        }
+        break;
     case T_ZSET:
-        too_big = hm_size(&ent->zset->hmap) > k_large_container_size;
+        n += zset_mem_usage(ent->zset);
         break;
     }
+    return n;
+}
 
-    if (too_big) {
-        thread_pool_queue(&g_data.tp, &entry_del_async, ent);
-    } else {
-        entry_destroy(ent);
+// the allocator of this reactor
+static void memory_stats(std::string &out) {
+    SlabStats st;
+    slab_stats(&st);
+    out_arr(out, 14);
+    out_str(out, "keys", 4);
+    out_int(out, (int64_t)hm_size(&g_data.db));
+    out_str(out, "slab.pages", 10);
+    out_int(out, (int64_t)st.pages);
+    out_str(out, "slab.objs", 9);
+    out_int(out, (int64_t)st.objs);
+    out_str(out, "slab.obj_bytes", 14);
+    out_int(out, (int64_t)st.obj_bytes);
+    // the page bytes per live byte, including the free slots
+    out_str(out, "slab.fragmentation", 18);
+    out_dbl(out, st.obj_bytes ? (double)st.page_bytes / st.obj_bytes : 0);
+    // all reactors, estimated
+    out_str(out, "lazyfree.pending_bytes", 22);
+    out_int(out, (int64_t)g_lazyfree_bytes.load());
+    out_str(out, "lazyfree.pending_keys", 21);
+    out_int(out, (int64_t)g_lazyfree_keys.load());
+}
+
+// memory usage key
+// memory stats
+static void do_memory(std::vector<std::string_view> &cmd, std::string &out) {
+    if (cmd.size() == 2 && cmd_is(cmd[1], "stats")) {
+        return memory_stats(out);
+    }
+    if (cmd.size() != 3 || !cmd_is(cmd[1], "usage")) {
+        return out_err(out, ERR_ARG, "expect USAGE key or STATS");
     }
+
+    LookupKey key;
+    lookup_key_init(&key, cmd[2]);
+    Entry *ent = entry_lookup(&key);
+    if (!ent) {
+        return out_nil(out);
+    }
+    return out_int(out, (int64_t)entry_mem_usage(ent));
+}
+
+// debug pool: the background work queue, shared by all reactors
+static void debug_pool(std::string &out) {
+    out_arr(out, 12);
+    out_str(out, "pool.threads", 12);
+    out_int(out, (int64_t)g_tp.threads.size());
+    out_str(out, "pool.depth", 10);
+    out_int(out, (int64_t)thread_pool_depth(&g_tp));
+    out_str(out, "pool.peak", 9);
+    out_int(out, (int64_t)g_tp.peak.load());
+    out_str(out, "pool.queued", 11);
+    out_int(out, (int64_t)g_tp.nqueued.load());
+    out_str(out, "pool.done", 9);
+    out_int(out, (int64_t)g_tp.ndone.load());
+    out_str(out, "pool.full", 9);
+    out_int(out, (int64_t)g_tp.nfull.load());
 }
 
-static void do_del(std::vector<std::string> &cmd, std::string &out) {
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+static void debug_aof(std::string &out);
 
-    HNode *node = hm_pop(&g_data.db, &key.node, &entry_eq);
-    if (node) {
-        entry_del(container_of(node, Entry, node));
+// debug clock: the clock reads of this reactor, and the time saved by
+// using the cached time instead of reading the clock each time.
+static void do_debug(std::vector<std::string_view> &cmd, std::string &out) {
+    if (cmd.size() == 2 && cmd_is(cmd[1], "pool")) {
+        return debug_pool(out);
+    }
+    if (cmd.size() == 2 && cmd_is(cmd[1], "aof")) {
+        return debug_aof(out);
     }
-    return out_int(out, node ? 1 : 0);
+    if (cmd.size() != 2 || !cmd_is(cmd[1], "clock")) {
+        return out_err(out, ERR_ARG, "expect CLOCK, POOL or AOF");
+    }
+    out_arr(out, 8);
+    out_str(out, "clock.reads", 11);
+    out_int(out, (int64_t)g_data.clock_reads);
+    out_str(out, "clock.cached", 12);
+    out_int(out, (int64_t)g_data.clock_cached);
+    out_str(out, "clock.read_ns", 13);
+    out_dbl(out, g_clock_read_ns);
+    out_str(out, "clock.saved_us", 14);
+    out_dbl(out, g_data.clock_cached * g_clock_read_ns / 1000);
 }
 
-static void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg) {
-    if (tab->size == 0) {
-        return;
+// the work of entry_destroy(), roughly the number of free() calls.
+// a large string is unmapped page by page.
+static size_t entry_free_cost(Entry *ent) {
+    switch (ent->type) {
+    case T_STR:
+        return ent->enc == ENC_RAW ? 1 + ent->vlen / 4096 : 1;
+    case T_ZSET:
+        return ent->zset->is_list ? 2 : 2 + zset_size(ent->zset);
     }
-    for (size_t i = 0; i < tab->mask + 1; ++i) {
-        HNode *node = tab->tab[i];
-        while (node) {
-            f(node, arg);
-            node = node->next;
+    return 1;
+}
+
+// an O(1) estimate of entry_mem_usage(), which walks the zset
+static size_t entry_free_bytes(Entry *ent) {
+    size_t n = sizeof(Entry) + ent->klen + ent->vcap;
+    switch (ent->type) {
+    case T_STR:
+        if (ent->enc == ENC_RAW) {
+            n += ent->vlen;
+        }
+        break;
+    case T_ZSET:
+        n += sizeof(ZSet) + ent->zset->list_cap;
+        if (!ent->zset->is_list) {
+            // a node, a short name, and a slot in the hashtable
+            n += zset_size(ent->zset) * (sizeof(ZNode) + 16 + 16);
         }
+        break;
     }
+    return n;
 }
 
-static void cb_scan(HNode *node, void *arg) {
-    std::string &out = *(std::string *)arg;
-    out_str(out, container_of(node, Entry, node)->key);
-}
+// values that cost less than this are freed inline
+const size_t k_lazyfree_min_cost = 64;
+// a job is queued once it holds this much work
+const size_t k_lazyfree_job_cost = 1 << 16;
+
+// a batch of values detached from the keyspace, freed by the thread pool
+struct FreeJob {
+    std::vector<Entry *> ents;
+    HMap db;            // a whole keyspace, see FLUSHALL ASYNC
+    size_t cost = 0;
+    uint64_t bytes = 0;
+    uint64_t keys = 0;
+};
 
-static void do_keys(std::vector<std::string> &cmd, std::string &out) {
-    (void)cmd;
-    out_arr(out, (uint32_t)hm_size(&g_data.db));
-    h_scan(&g_data.db.ht1, &cb_scan, &out);
-    h_scan(&g_data.db.ht2, &cb_scan, &out);
+static void cb_destroy(HNode *node, void *) {
+    entry_destroy(container_of(node, Entry, node));
 }
 
-static bool str2dbl(const std::string &s, double &out) {
-    char *endp = NULL;
-    out = strtod(s.c_str(), &endp);
-    return endp == s.c_str() + s.size() && !isnan(out);
+static void lazyfree_run(void *arg) {
+    FreeJob *job = (FreeJob *)arg;
+    for (Entry *ent : job->ents) {
+        entry_destroy(ent);
+    }
+    hm_foreach(&job->db, &cb_destroy, NULL);
+    hm_destroy(&job->db);
+    g_lazyfree_bytes -= job->bytes;
+    g_lazyfree_keys -= job->keys;
+    delete job;
 }
 
-// zadd zset score name
-static void do_zadd(std::vector<std::string> &cmd, std::string &out) {
-    double score = 0;
+// hand the current batch to the thread pool. called when it's full
+// and at the end of each loop iteration.
+static void lazyfree_flush() {
+    FreeJob *job = g_data.free_job;
+    if (!job) {
+        return;
+    }
+    g_data.free_job = NULL;
+    g_lazyfree_bytes += job->bytes;
+    g_lazyfree_keys += job->keys;
+    // the event loop never waits for the pool: free it here if it's full
+    if (!thread_pool_try_queue(&g_tp, &lazyfree_run, job)) {
+        lazyfree_run(job);
+    }
+}
+
+static FreeJob *lazyfree_job() {
+    if (!g_data.free_job) {
+        g_data.free_job = new FreeJob();
+    }
+    return g_data.free_job;
+}
+
+static void lazyfree_add(Entry *ent, size_t cost) {
+    FreeJob *job = lazyfree_job();
+    job->ents.push_back(ent);
+    job->cost += cost;
+    job->bytes += entry_free_bytes(ent);
+    job->keys++;
+    if (job->cost >= k_lazyfree_job_cost) {
+        lazyfree_flush();
+    }
+}
+
+// dispose the entry after it got detached from the key space
+static void entry_del(Entry *ent) {
+    entry_set_ttl(ent, -1);
+
+    size_t cost = entry_free_cost(ent);
+    if (cost < k_lazyfree_min_cost) {
+        entry_destroy(ent);
+    } else {
+        lazyfree_add(ent, cost);
+    }
+}
+
+static void do_del(std::vector<std::string_view> &cmd, std::string &out) {
+    LookupKey key;
+    lookup_key_init(&key, cmd[1]);
+
+    HNode *node = hm_pop(&g_data.db, &key.node, &entry_eq);
+    bool deleted = false;
+    if (node) {
+        // an expired key is already gone
+        Entry *ent = container_of(node, Entry, node);
+        deleted = !entry_expired(ent, clock_ttl_us());
+        entry_del(ent);
+    }
+    return out_int(out, deleted ? 1 : 0);
+}
+
+struct ScanArg {
+    std::string *out = NULL;
+    uint64_t now_us = 0;
+    uint32_t n = 0;
+};
+
+static void cb_scan(HNode *node, void *arg) {
+    ScanArg *scan = (ScanArg *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    if (!entry_expired(ent, scan->now_us)) {
+        out_str(*scan->out, ent->data, ent->klen);
+        scan->n++;
+    }
+}
+
+static void do_keys(std::vector<std::string_view> &cmd, std::string &out) {
+    (void)cmd;
+    ScanArg scan;
+    scan.out = &out;
+    scan.now_us = clock_now_us();
+    out_arr(out, 0);    // the array length will be updated later
+    hm_foreach(&g_data.db, &cb_scan, &scan);
+    out_update_arr(out, scan.n);
+}
+
+// flushall [async|sync]
+static void do_flushall(std::vector<std::string_view> &cmd, std::string &out) {
+    bool async = cmd.size() == 1 || cmd_is(cmd[1], "async");
+    if (cmd.size() > 2 || (!async && !cmd_is(cmd[1], "sync"))) {
+        return out_err(out, ERR_ARG, "expect ASYNC or SYNC");
+    }
+
+    // drop the TTL timers, they point into the entries
+#ifdef TTL_WHEEL
+    tw_init(&g_data.wheel, g_data.wheel.now_ms);
+#else
+    g_data.heap.clear();
+#endif
+    if (async) {
+        // the job takes over the whole table
+        FreeJob *job = lazyfree_job();
+        assert(hm_size(&job->db) == 0);
+        job->db = g_data.db;
+        job->bytes += hm_mem_usage(&g_data.db)
+            + hm_size(&g_data.db) * (sizeof(Entry) + 16);
+        job->keys += hm_size(&g_data.db);
+        g_data.db = HMap{};
+        lazyfree_flush();
+    } else {
+        hm_foreach(&g_data.db, &cb_destroy, NULL);
+        hm_destroy(&g_data.db);
+    }
+    return out_nil(out);
+}
+
+static bool str2dbl(std::string_view s, double &out) {
+    char buf[k_max_num_len];
+    if (s.size() >= sizeof(buf)) {
+        return false;
+    }
+    memcpy(buf, s.data(), s.size());
+    buf[s.size()] = '\0';
+
+    char *endp = NULL;
+    out = strtod(buf, &endp);
+    return endp == buf + s.size() && !isnan(out);
+}
+
+// zadd zset score name
+static void do_zadd(std::vector<std::string_view> &cmd, std::string &out) {
+    double score = 0;
     if (!str2dbl(cmd[2], score)) {
         return out_err(out, ERR_ARG, "expect fp number");
     }
 
     // look up or create the zset
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
-
-    Entry *ent = NULL;
-    if (!hnode) {
-        ent = new Entry();
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        ent->type = T_ZSET;
+    LookupKey key;
+    lookup_key_init(&key, cmd[1]);
+    Entry *ent = entry_lookup(&key);
+    if (!ent) {
+        ent = entry_new(key.key, key.node.hcode, T_ZSET, 0);
         ent->zset = new ZSet();
         hm_insert(&g_data.db, &ent->node);
     } else {
-        ent = container_of(hnode, Entry, node);
         if (ent->type != T_ZSET) {
             return out_err(out, ERR_TYPE, "expect zset");
         }
     }
 
     // add or update the tuple
-    const std::string &name = cmd[3];
+    std::string_view name = cmd[3];
     bool added = zset_add(ent->zset, name.data(), name.size(), score);
     return out_int(out, (int64_t)added);
 }
 
-static bool expect_zset(std::string &out, std::string &s, Entry **ent) {
-    Entry key;
-    key.key.swap(s);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!hnode) {
+static bool expect_zset(std::string &out, std::string_view s, Entry **ent) {
+    LookupKey key;
+    lookup_key_init(&key, s);
+    *ent = entry_lookup(&key);
+    if (!*ent) {
         out_nil(out);
         return false;
     }
-
-    *ent = container_of(hnode, Entry, node);
     if ((*ent)->type != T_ZSET) {
         out_err(out, ERR_TYPE, "expect zset");
         return false;
@@ -478,40 +1287,54 @@ static bool expect_zset(std::string &out, std::string &s, Entry **ent) {
 }
 
 // zrem zset name
-static void do_zrem(std::vector<std::string> &cmd, std::string &out) {
+static void do_zrem(std::vector<std::string_view> &cmd, std::string &out) {
     Entry *ent = NULL;
     if (!expect_zset(out, cmd[1], &ent)) {
         return;
     }
 
-    const std::string &name = cmd[2];
-    ZNode *znode = zset_pop(ent->zset, name.data(), name.size());
-    if (znode) {
-        znode_del(znode);
-    }
-    return out_int(out, znode ? 1 : 0);
+    std::string_view name = cmd[2];
+    bool deleted = zset_del(ent->zset, name.data(), name.size());
+    return out_int(out, deleted ? 1 : 0);
 }
 
 // zscore zset name
-static void do_zscore(std::vector<std::string> &cmd, std::string &out) {
+static void do_zscore(std::vector<std::string_view> &cmd, std::string &out) {
     Entry *ent = NULL;
     if (!expect_zset(out, cmd[1], &ent)) {
         return;
     }
 
-    const std::string &name = cmd[2];
-    ZNode *znode = zset_lookup(ent->zset, name.data(), name.size());
-    return znode ? out_dbl(out, znode->score) : out_nil(out);
+    std::string_view name = cmd[2];
+    double score = 0;
+    if (!zset_score(ent->zset, name.data(), name.size(), &score)) {
+        return out_nil(out);
+    }
+    return out_dbl(out, score);
+}
+
+// like expect_zset(), but a missing key is an empty array
+static bool expect_zset_arr(
+    std::string &out, std::string_view s, Entry **ent)
+{
+    if (expect_zset(out, s, ent)) {
+        return true;
+    }
+    if (out[0] == SER_NIL) {
+        out.clear();
+        out_arr(out, 0);
+    }
+    return false;
 }
 
 // zquery zset score name offset limit
-static void do_zquery(std::vector<std::string> &cmd, std::string &out) {
+static void do_zquery(std::vector<std::string_view> &cmd, std::string &out) {
     // parse args
     double score = 0;
     if (!str2dbl(cmd[2], score)) {
         return out_err(out, ERR_ARG, "expect fp number");
     }
-    const std::string &name = cmd[3];
+    std::string_view name = cmd[3];
     int64_t offset = 0;
     int64_t limit = 0;
     if (!str2int(cmd[4], offset)) {
@@ -523,11 +1346,7 @@ static void do_zquery(std::vector<std::string> &cmd, std::string &out) {
 
     // get the zset
     Entry *ent = NULL;
-    if (!expect_zset(out, cmd[1], &ent)) {
-        if (out[0] == SER_NIL) {
-            out.clear();
-            out_arr(out, 0);
-        }
+    if (!expect_zset_arr(out, cmd[1], &ent)) {
         return;
     }
 
@@ -535,116 +1354,1127 @@ static void do_zquery(std::vector<std::string> &cmd, std::string &out) {
     if (limit <= 0) {
         return out_arr(out, 0);
     }
-    ZNode *znode = zset_query(
-        ent->zset, score, name.data(), name.size(), offset
-    );
+    ZIter it;
+    zset_query(ent->zset, score, name.data(), name.size(), offset, &it);
 
     // output
     out_arr(out, 0);    // the array length will be updated later
     uint32_t n = 0;
-    while (znode && (int64_t)n < limit) {
-        out_str(out, znode->name, znode->len);
-        out_dbl(out, znode->score);
-        znode = container_of(avl_offset(&znode->tree, +1), ZNode, tree);
+    while (it.valid && (int64_t)n < limit) {
+        out_str(out, it.name, it.len);
+        out_dbl(out, it.score);
+        zset_next(&it);
         n += 2;
     }
-    return out_update_arr(out, n);
+    return out_update_arr(out, n);
+}
+
+// output `n` tuples starting from the rank, in either direction
+static void out_zrange(
+    std::string &out, ZSet *zset, int64_t rank, int64_t n, bool rev)
+{
+    ZIter it;
+    zset_seek_rank(zset, rank, &it);
+
+    out_arr(out, 0);    // the array length will be updated later
+    uint32_t cnt = 0;
+    for (int64_t i = 0; it.valid && i < n; ++i) {
+        out_str(out, it.name, it.len);
+        out_dbl(out, it.score);
+        if (rev) {
+            zset_prev(&it);
+        } else {
+            zset_next(&it);
+        }
+        cnt += 2;
+    }
+    return out_update_arr(out, cnt);
+}
+
+static void zrank(
+    std::vector<std::string_view> &cmd, std::string &out, bool rev)
+{
+    Entry *ent = NULL;
+    if (!expect_zset(out, cmd[1], &ent)) {
+        return;
+    }
+
+    std::string_view name = cmd[2];
+    int64_t rank = zset_rank(ent->zset, name.data(), name.size());
+    if (rank < 0) {
+        return out_nil(out);
+    }
+    if (rev) {
+        rank = (int64_t)zset_size(ent->zset) - 1 - rank;
+    }
+    return out_int(out, rank);
+}
+
+// zrank zset name
+static void do_zrank(std::vector<std::string_view> &cmd, std::string &out) {
+    return zrank(cmd, out, false);
+}
+
+// zrevrank zset name
+static void do_zrevrank(
+    std::vector<std::string_view> &cmd, std::string &out)
+{
+    return zrank(cmd, out, true);
+}
+
+// a score interval. the bounds are inclusive unless prefixed with '('.
+struct ScoreRange {
+    double min = 0;
+    double max = 0;
+    bool min_excl = false;
+    bool max_excl = false;
+};
+
+static bool str2bound(std::string_view s, double &score, bool &excl) {
+    excl = !s.empty() && s[0] == '(';
+    if (excl) {
+        s.remove_prefix(1);
+    }
+    return str2dbl(s, score);
+}
+
+static bool str2range(
+    std::string_view min, std::string_view max, ScoreRange &range)
+{
+    return str2bound(min, range.min, range.min_excl)
+        && str2bound(max, range.max, range.max_excl);
+}
+
+// the ranks [lo, hi) of the tuples within the score range
+static void zset_range_ranks(
+    ZSet *zset, const ScoreRange &range, int64_t &lo, int64_t &hi)
+{
+    lo = zset_score_rank(zset, range.min, range.min_excl);
+    hi = zset_score_rank(zset, range.max, !range.max_excl);
+    hi = std::max(lo, hi);
+}
+
+// zcount zset min max
+static void do_zcount(std::vector<std::string_view> &cmd, std::string &out) {
+    ScoreRange range;
+    if (!str2range(cmd[2], cmd[3], range)) {
+        return out_err(out, ERR_ARG, "expect fp number");
+    }
+
+    Entry *ent = NULL;
+    if (!expect_zset(out, cmd[1], &ent)) {
+        if (out[0] == SER_NIL) {
+            out.clear();
+            out_int(out, 0);
+        }
+        return;
+    }
+
+    int64_t lo = 0, hi = 0;
+    zset_range_ranks(ent->zset, range, lo, hi);
+    return out_int(out, hi - lo);
+}
+
+// negative indexes count from the end
+static void zrange(
+    std::vector<std::string_view> &cmd, std::string &out, bool rev)
+{
+    int64_t start = 0;
+    int64_t stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+
+    Entry *ent = NULL;
+    if (!expect_zset_arr(out, cmd[1], &ent)) {
+        return;
+    }
+
+    int64_t size = (int64_t)zset_size(ent->zset);
+    if (start < 0) {
+        start += size;
+    }
+    if (stop < 0) {
+        stop += size;
+    }
+    start = std::max(start, (int64_t)0);
+    stop = std::min(stop, size - 1);
+    if (start > stop) {
+        return out_arr(out, 0);
+    }
+    int64_t rank = rev ? size - 1 - start : start;
+    return out_zrange(out, ent->zset, rank, stop - start + 1, rev);
+}
+
+// zrange zset start stop
+static void do_zrange(std::vector<std::string_view> &cmd, std::string &out) {
+    return zrange(cmd, out, false);
+}
+
+// zrevrange zset start stop
+static void do_zrevrange(
+    std::vector<std::string_view> &cmd, std::string &out)
+{
+    return zrange(cmd, out, true);
+}
+
+static void zrangebyscore(
+    std::vector<std::string_view> &cmd, std::string &out, bool rev)
+{
+    // parse args
+    ScoreRange range;
+    bool ok = rev
+        ? str2range(cmd[3], cmd[2], range)
+        : str2range(cmd[2], cmd[3], range);
+    if (!ok) {
+        return out_err(out, ERR_ARG, "expect fp number");
+    }
+    int64_t offset = 0;
+    int64_t count = -1;     // negative for no limit
+    if (cmd.size() == 7 && cmd_is(cmd[4], "limit")) {
+        if (!str2int(cmd[5], offset) || !str2int(cmd[6], count)) {
+            return out_err(out, ERR_ARG, "expect int");
+        }
+    } else if (cmd.size() != 4) {
+        return out_err(out, ERR_ARG, "syntax error");
+    }
+
+    // get the zset
+    Entry *ent = NULL;
+    if (!expect_zset_arr(out, cmd[1], &ent)) {
+        return;
+    }
+
+    // the ranks of the score range, then apply the limit
+    int64_t lo = 0, hi = 0;
+    zset_range_ranks(ent->zset, range, lo, hi);
+    if (offset < 0 || offset >= hi - lo || count == 0) {
+        return out_arr(out, 0);
+    }
+    int64_t n = hi - lo - offset;
+    if (count > 0 && count < n) {
+        n = count;
+    }
+    int64_t rank = rev ? hi - 1 - offset : lo + offset;
+    return out_zrange(out, ent->zset, rank, n, rev);
+}
+
+// zrangebyscore zset min max [limit offset count]
+static void do_zrangebyscore(
+    std::vector<std::string_view> &cmd, std::string &out)
+{
+    return zrangebyscore(cmd, out, false);
+}
+
+// zrevrangebyscore zset max min [limit offset count]
+static void do_zrevrangebyscore(
+    std::vector<std::string_view> &cmd, std::string &out)
+{
+    return zrangebyscore(cmd, out, true);
+}
+
+// the snapshot file, see --snapshot
+static const char *g_snap_path = "dump.snap";
+
+// SAVE and BGSAVE stop the other reactors between requests while the
+// keyspace is written or forked, so the snapshot is a single point in time.
+static struct {
+    pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    size_t paused = 0;      // the reactors waiting in snapshot_wait()
+    uint64_t epoch = 0;     // bumped to resume them
+    std::atomic<bool> busy{false};  // a save is running, one at a time
+    pthread_cond_t idle = PTHREAD_COND_INITIALIZER;     // busy is cleared
+    std::atomic<int64_t> last_save{0};  // unix time of the last success
+    // the BGSAVE child, reaped by the reactor that forked it
+    std::atomic<pid_t> child{-1};
+    std::atomic<size_t> owner{0};
+    std::atomic<bool> rewrite{false};   // the child rewrites the AOF
+    FullSync *sync = NULL;  // the child feeds a follower
+} g_save;
+
+static void shard_post(size_t to, ShardMsg &msg);
+static void aof_submit();
+
+static void snapshot_pause() {
+    for (size_t i = 0; i < g_shards.size(); ++i) {
+        if (i != g_data.shard_id) {
+            ShardMsg msg;
+            msg.from = g_data.shard_id;
+            msg.is_pause = true;
+            shard_post(i, msg);
+        }
+    }
+    pthread_mutex_lock(&g_save.mu);
+    while (g_save.paused + 1 < g_shards.size()) {
+        pthread_cond_wait(&g_save.cond, &g_save.mu);
+    }
+    pthread_mutex_unlock(&g_save.mu);
+}
+
+// the save is over, the next one may start
+static void snapshot_done() {
+    pthread_mutex_lock(&g_save.mu);
+    g_save.busy = false;
+    pthread_cond_broadcast(&g_save.idle);
+    pthread_mutex_unlock(&g_save.mu);
+}
+
+static void snapshot_resume() {
+    pthread_mutex_lock(&g_save.mu);
+    g_save.paused = 0;
+    g_save.epoch++;
+    pthread_cond_broadcast(&g_save.cond);
+    pthread_mutex_unlock(&g_save.mu);
+}
+
+// a paused reactor, called from shard_drain()
+static void snapshot_wait() {
+    aof_submit();   // see aof_rewrite_start()
+    pthread_mutex_lock(&g_save.mu);
+    uint64_t epoch = g_save.epoch;
+    g_save.paused++;
+    pthread_cond_broadcast(&g_save.cond);
+    while (epoch == g_save.epoch) {
+        pthread_cond_wait(&g_save.cond, &g_save.mu);
+    }
+    pthread_mutex_unlock(&g_save.mu);
+}
+
+// the expiry time of a key of any shard, they are all paused
+static uint64_t shard_expire_at(Shard *shard, Entry *ent) {
+#ifdef TTL_WHEEL
+    (void)shard;
+    return entry_expire_at(ent);
+#else
+    return heap_expire_at(*shard->heap, ent);
+#endif
+}
+
+struct DumpArg {
+    SnapWriter *w = NULL;
+    Shard *shard = NULL;
+    uint64_t now_us = 0;
+    int64_t now_ms = 0;     // unix time
+};
+
+static void cb_dump(HNode *node, void *arg) {
+    DumpArg *dump = (DumpArg *)arg;
+    SnapWriter *w = dump->w;
+    Entry *ent = container_of(node, Entry, node);
+    uint64_t expire_at = shard_expire_at(dump->shard, ent);
+    if (expire_at <= dump->now_us) {
+        return;     // expired but not yet deleted
+    }
+    int64_t expire_ms = -1;
+    if (expire_at != (uint64_t)-1) {
+        expire_ms = dump->now_ms + (int64_t)(expire_at - dump->now_us) / 1000;
+    }
+
+    snap_mark(w);
+    snap_put_u8(w, ent->type == T_ZSET ? SNAP_ZSET : SNAP_STR);
+    snap_put_u64(w, (uint64_t)expire_ms);
+    snap_put_str(w, ent->data, ent->klen);
+    switch (ent->type) {
+    case T_STR:
+        {
+            char buf[32];
+            std::string_view val = entry_str(ent, buf);
+            snap_put_str(w, val.data(), val.size());
+        }
+        break;
+    case T_ZSET:
+        snap_put_u32(w, (uint32_t)zset_size(ent->zset));
+        ZIter it;
+        for (zset_seek_rank(ent->zset, 0, &it); it.valid; zset_next(&it)) {
+            snap_put_dbl(w, it.score);
+            snap_put_str(w, it.name, it.len);
+        }
+        break;
+    }
+}
+
+// write the keyspace of all shards, which must be paused
+static bool snapshot_write() {
+    uint64_t nkeys = 0;
+    for (Shard *shard : g_shards) {
+        nkeys += hm_size(shard->db);
+    }
+    SnapWriter w;
+    if (!snap_create(&w, g_snap_path, nkeys)) {
+        return false;
+    }
+    DumpArg dump;
+    dump.w = &w;
+    dump.now_us = get_monotonic_usec();
+    dump.now_ms = get_unix_msec();
+    for (Shard *shard : g_shards) {
+        dump.shard = shard;
+        hm_foreach(shard->db, &cb_dump, &dump);
+    }
+    return snap_finish(&w);
+}
+
+// save: write the snapshot, all reactors are blocked meanwhile
+static void do_save(std::vector<std::string_view> &, std::string &out) {
+    if (g_save.busy.exchange(true)) {
+        return out_err(out, ERR_ARG, "a save is in progress");
+    }
+    snapshot_pause();
+    bool ok = snapshot_write();
+    snapshot_resume();
+    snapshot_done();
+    if (!ok) {
+        return out_err(out, ERR_ARG, "failed to write the snapshot");
+    }
+    g_save.last_save = get_unix_msec() / 1000;
+    return out_nil(out);
+}
+
+// bgsave: a forked child writes the copy-on-write keyspace
+static void do_bgsave(std::vector<std::string_view> &, std::string &out) {
+    if (g_save.busy.exchange(true)) {
+        return out_err(out, ERR_ARG, "a save is in progress");
+    }
+    snapshot_pause();
+    pid_t pid = fork();
+    if (pid == 0) {
+        // only this thread exists in the child
+        _exit(snapshot_write() ? 0 : 1);
+    }
+    snapshot_resume();
+    if (pid < 0) {
+        snapshot_done();
+        return out_err(out, ERR_ARG, "fork() failed");
+    }
+    g_save.child = pid;
+    g_save.owner = g_data.shard_id;
+    return out_nil(out);
+}
+
+// lastsave: the unix time of the last successful save
+static void do_lastsave(std::vector<std::string_view> &, std::string &out) {
+    return out_int(out, g_save.last_save);
+}
+
+
+// the replay of the AOF, see aof_load(). the file is mapped until every
+// shard has replayed its commands, listed by their offsets.
+static struct {
+    const uint8_t *data = NULL;
+    size_t size = 0;
+    std::vector<std::vector<uint64_t>> cmds;
+    std::atomic<size_t> nloading{0};
+    // the keyspace was loaded from the snapshot, it's not in the AOF yet
+    std::atomic<bool> rewrite{false};
+} g_aof_load;
+
+// debug aof: the bytes logged by all reactors, and the writes and syncs
+static void debug_aof(std::string &out) {
+    if (!g_aof_conf.path) {
+        return out_err(out, ERR_ARG, "AOF is disabled");
+    }
+    AofStats st;
+    aof_stats(&st);
+    out_arr(out, 14);
+    out_str(out, "aof.policy", 10);
+    const char *policy = g_aof_conf.policy == AOF_ALWAYS ? "always"
+        : g_aof_conf.policy == AOF_EVERYSEC ? "everysec" : "no";
+    out_str(out, policy, strlen(policy));
+    out_str(out, "aof.submitted", 13);
+    out_int(out, (int64_t)st.submitted);
+    out_str(out, "aof.synced", 10);
+    out_int(out, (int64_t)st.synced);
+    out_str(out, "aof.writes", 10);
+    out_int(out, (int64_t)st.nwrites);
+    out_str(out, "aof.fsyncs", 10);
+    out_int(out, (int64_t)st.nsyncs);
+    out_str(out, "aof.size", 8);
+    out_int(out, (int64_t)st.size);
+    out_str(out, "aof.rewrites", 12);
+    out_int(out, (int64_t)st.nrewrites);
+}
+
+// hand the commands of this iteration to the writer and the followers
+static void aof_submit() {
+    if (g_data.aof_buf.empty()) {
+        return;
+    }
+    if (g_repl_conf.listen_path) {
+        repl_feed(g_data.aof_buf);
+    }
+    if (g_aof_conf.path) {
+        g_data.aof_seq = aof_append(g_data.aof_buf);
+    }
+    g_data.aof_buf.clear();
+}
+
+// the commands executed by this reactor are not known to be on disk
+static bool aof_dirty() {
+    return !g_data.aof_buf.empty() || g_data.aof_seq > g_data.aof_synced;
+}
+
+struct RewriteArg {
+    std::string buf;
+    int fd = -1;
+    bool err = false;
+    Shard *shard = NULL;
+    uint64_t now_us = 0;
+    int64_t now_ms = 0;     // unix time
+};
+
+static void rewrite_flush(RewriteArg *rw) {
+    if (!rw->err && !write_all(rw->fd, rw->buf.data(), rw->buf.size())) {
+        rw->err = true;
+    }
+    rw->buf.clear();
+}
+
+// the commands that recreate a key
+static void cb_rewrite(HNode *node, void *arg) {
+    RewriteArg *rw = (RewriteArg *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    uint64_t expire_at = shard_expire_at(rw->shard, ent);
+    if (expire_at <= rw->now_us) {
+        return;     // expired but not yet deleted
+    }
+
+    std::string_view key(ent->data, ent->klen);
+    char buf[32];
+    switch (ent->type) {
+    case T_STR:
+        {
+            std::string_view args[3] = {"set", key, entry_str(ent, buf)};
+            aof_append_req(rw->buf, args, 3);
+        }
+        break;
+    case T_ZSET:
+        ZIter it;
+        for (zset_seek_rank(ent->zset, 0, &it); it.valid; zset_next(&it)) {
+            // %.17g round-trips through strtod()
+            int n = snprintf(buf, sizeof(buf), "%.17g", it.score);
+            std::string_view args[4] = {
+                "zadd", key, {buf, (size_t)n}, {it.name, it.len},
+            };
+            aof_append_req(rw->buf, args, 4);
+            if (rw->buf.size() >= k_snap_block) {
+                rewrite_flush(rw);
+            }
+        }
+        break;
+    }
+    if (expire_at != (uint64_t)-1) {
+        int64_t at_ms = rw->now_ms + (int64_t)(expire_at - rw->now_us) / 1000;
+        int n = snprintf(buf, sizeof(buf), "%" PRId64, at_ms);
+        std::string_view args[3] = {"pexpireat", key, {buf, (size_t)n}};
+        aof_append_req(rw->buf, args, 3);
+    }
+    if (rw->buf.size() >= k_snap_block) {
+        rewrite_flush(rw);
+    }
+}
+
+// in a child: the keyspace of all shards as commands
+static bool keyspace_write(int fd) {
+    RewriteArg rw;
+    rw.fd = fd;
+    rw.now_us = get_monotonic_usec();
+    rw.now_ms = get_unix_msec();
+    for (Shard *shard : g_shards) {
+        rw.shard = shard;
+        hm_foreach(shard->db, &cb_rewrite, &rw);
+    }
+    rewrite_flush(&rw);
+    return !rw.err;
+}
+
+// in the child: the keyspace in a temporary file
+static bool aof_rewrite_write() {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    int fd = open(aof_rewrite_path().c_str(), flags, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = keyspace_write(fd) && fsync(fd) == 0;
+    return (close(fd) == 0) && ok;
+}
+
+// fork a child to write the keyspace. the other reactors submit their
+// commands before pausing, so the commands after the fork are exactly
+// those submitted from now on, which are kept for the new file.
+static const char *aof_rewrite_start() {
+    if (g_save.busy.exchange(true)) {
+        return "a save is in progress";
+    }
+    snapshot_pause();
+    aof_submit();
+    aof_rewrite_begin();
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(aof_rewrite_write() ? 0 : 1);
+    }
+    snapshot_resume();
+    if (pid < 0) {
+        aof_rewrite_end(false);
+        return "fork() failed";
+    }
+    g_save.child = pid;
+    g_save.owner = g_data.shard_id;
+    g_save.rewrite = true;
+    return NULL;
+}
+
+// start a rewrite when the file has doubled since the last one, or
+// once the snapshot is loaded into a new AOF
+static void aof_auto_rewrite() {
+    if (g_aof_conf.path && g_data.shard_id == 0 && !g_save.busy
+        && (g_aof_load.rewrite || aof_rewrite_due())
+        && !aof_rewrite_start())
+    {
+        g_aof_load.rewrite = false;
+    }
+}
+
+// fork a child for a full sync, like BGSAVE. g_save.busy is held by
+// the serve thread.
+static void repl_sync_fork(FullSync *sync) {
+    snapshot_pause();
+    aof_submit();   // the cut follows the commands of this iteration
+    sync->cut = repl_offset();
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(repl_sync_write(sync->fd, sync->cut, &keyspace_write) ? 0 : 1);
+    }
+    snapshot_resume();
+    if (pid < 0) {
+        repl_sync_finish(sync, false);
+        snapshot_done();
+        return;
+    }
+    g_save.child = pid;
+    g_save.owner = g_data.shard_id;
+    g_save.sync = sync;
+}
+
+// on the primary: take g_save.busy for a full sync, waiting up to `ms`
+static bool repl_sync_claim(uint32_t ms) {
+    timespec ts = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += (long)(ms % 1000) * 1000000;
+    ts.tv_sec += ms / 1000 + ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+
+    pthread_mutex_lock(&g_save.mu);
+    bool busy = g_save.busy.exchange(true);
+    int rv = 0;
+    while (busy && rv != ETIMEDOUT) {
+        rv = pthread_cond_timedwait(&g_save.idle, &g_save.mu, &ts);
+        busy = g_save.busy.exchange(true);
+    }
+    pthread_mutex_unlock(&g_save.mu);
+    return !busy;
+}
+
+// on the primary: reactor 0 forks the full sync
+static void repl_sync_start(FullSync *sync) {
+    ShardMsg msg;
+    msg.sync = sync;
+    shard_post(0, msg);
+}
+
+// check whether the BGSAVE child of this reactor has finished
+static void snapshot_reap() {
+    if (g_save.child < 0 || g_save.owner != g_data.shard_id) {
+        return;
+    }
+    int status = 0;
+    if (waitpid(g_save.child, &status, WNOHANG) != g_save.child) {
+        return;
+    }
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    g_save.child = -1;
+    if (g_save.sync) {
+        repl_sync_finish(g_save.sync, ok);
+        g_save.sync = NULL;
+        snapshot_done();
+        return;
+    }
+    if (g_save.rewrite) {
+        g_save.rewrite = false;
+        return aof_rewrite_end(ok);     // snapshot_done() by the writer
+    }
+    if (ok) {
+        g_save.last_save = get_unix_msec() / 1000;
+    } else {
+        msg("background save failed");
+    }
+    snapshot_done();
+}
+
+// bgrewriteaof: compact the AOF in the background
+static void do_bgrewriteaof(std::vector<std::string_view> &, std::string &out) {
+    if (!g_aof_conf.path) {
+        return out_err(out, ERR_ARG, "AOF is disabled");
+    }
+    if (const char *err = aof_rewrite_start()) {
+        return out_err(out, ERR_ARG, err);
+    }
+    return out_nil(out);
+}
+
+// replicaof PATH | replicaof no one
+static void do_replicaof(std::vector<std::string_view> &cmd, std::string &out) {
+    if (cmd.size() == 3 && cmd_is(cmd[1], "no") && cmd_is(cmd[2], "one")) {
+        repl_stop();
+        return out_nil(out);
+    }
+    if (cmd.size() != 2 || cmd[1].empty()) {
+        return out_err(out, ERR_ARG, "expect PATH or NO ONE");
+    }
+    repl_start(cmd[1]);
+    return out_nil(out);
+}
+
+// role: the replication state of this server
+static void do_role(std::vector<std::string_view> &, std::string &out) {
+    ReplState st;
+    repl_state(&st);
+    if (st.following) {
+        out_arr(out, 12);
+        out_str(out, "role", 4);
+        out_str(out, "follower", 8);
+        out_str(out, "repl.primary", 12);
+        out_str(out, st.primary.data(), st.primary.size());
+        out_str(out, "repl.linked", 11);
+        out_int(out, st.linked ? 1 : 0);
+        out_str(out, "repl.offset", 11);
+        out_int(out, (int64_t)st.offset);
+    } else {
+        out_arr(out, 10);
+        out_str(out, "role", 4);
+        out_str(out, "primary", 7);
+        out_str(out, "repl.offset", 11);
+        out_int(out, (int64_t)st.offset);
+        out_str(out, "repl.followers", 14);
+        out_int(out, (int64_t)st.nfollowers);
+    }
+    out_str(out, "repl.full_syncs", 15);
+    out_int(out, (int64_t)st.nfull);
+    out_str(out, "repl.partial_syncs", 18);
+    out_int(out, (int64_t)st.npartial);
+}
+
+enum {
+    CMD_READONLY = 1,
+    CMD_WRITE = 2,
+    CMD_ALLSHARDS = 4,  // the whole keyspace, executed on every shard
+};
+
+typedef void (*cmd_handler_t)(std::vector<std::string_view> &, std::string &);
+
+struct Command {
+    const char *name;   // lowercase
+    int32_t arity;      // the number of arguments including the name,
+                        // -N means at least N
+    uint32_t flags;     // CMD_*
+    cmd_handler_t handler;
+    // the positions of the keys: first, last, step. 0 if no keys.
+    int32_t first_key;
+    int32_t last_key;
+    int32_t key_step;
+};
+
+static constexpr Command g_cmds[] = {
+    {"keys", 1, CMD_READONLY | CMD_ALLSHARDS, do_keys, 0, 0, 0},
+    {"get", 2, CMD_READONLY, do_get, 1, 1, 1},
+    {"set", 3, CMD_WRITE, do_set, 1, 1, 1},
+    {"del", 2, CMD_WRITE, do_del, 1, 1, 1},
+    {"unlink", 2, CMD_WRITE, do_del, 1, 1, 1},
+    {"pexpire", 3, CMD_WRITE, do_expire, 1, 1, 1},
+    {"pexpireat", 3, CMD_WRITE, do_pexpireat, 1, 1, 1},
+    {"pttl", 2, CMD_READONLY, do_ttl, 1, 1, 1},
+    {"zadd", 4, CMD_WRITE, do_zadd, 1, 1, 1},
+    {"zrem", 3, CMD_WRITE, do_zrem, 1, 1, 1},
+    {"zscore", 3, CMD_READONLY, do_zscore, 1, 1, 1},
+    {"zquery", 6, CMD_READONLY, do_zquery, 1, 1, 1},
+    {"zrank", 3, CMD_READONLY, do_zrank, 1, 1, 1},
+    {"zrevrank", 3, CMD_READONLY, do_zrevrank, 1, 1, 1},
+    {"zcount", 4, CMD_READONLY, do_zcount, 1, 1, 1},
+    {"zrange", 4, CMD_READONLY, do_zrange, 1, 1, 1},
+    {"zrevrange", 4, CMD_READONLY, do_zrevrange, 1, 1, 1},
+    {"zrangebyscore", -4, CMD_READONLY, do_zrangebyscore, 1, 1, 1},
+    {"zrevrangebyscore", -4, CMD_READONLY, do_zrevrangebyscore, 1, 1, 1},
+    {"memory", -2, CMD_READONLY, do_memory, 2, 2, 1},
+    {"debug", 2, CMD_READONLY, do_debug, 0, 0, 0},
+    {"flushall", -1, CMD_WRITE | CMD_ALLSHARDS, do_flushall, 0, 0, 0},
+    {"save", 1, CMD_READONLY, do_save, 0, 0, 0},
+    {"bgsave", 1, CMD_READONLY, do_bgsave, 0, 0, 0},
+    {"lastsave", 1, CMD_READONLY, do_lastsave, 0, 0, 0},
+    {"bgrewriteaof", 1, CMD_READONLY, do_bgrewriteaof, 0, 0, 0},
+    {"replicaof", -2, 0, do_replicaof, 0, 0, 0},
+    {"role", 1, CMD_READONLY, do_role, 0, 0, 0},
+};
+
+const size_t k_ncmds = sizeof(g_cmds) / sizeof(g_cmds[0]);
+const size_t k_cmd_slots = 128;
+static_assert(k_ncmds < 256 && k_ncmds * 2 <= k_cmd_slots, "too many cmds");
+
+// case-insensitive FNV-1a, command names are ASCII letters only
+static constexpr uint32_t cmd_hash(const char *s, size_t n, uint32_t seed) {
+    uint32_t h = seed;
+    for (size_t i = 0; i < n; ++i) {
+        h = (h ^ (uint8_t)(s[i] | 0x20)) * 0x01000193;
+    }
+    return h;
+}
+
+static constexpr size_t cstr_len(const char *s) {
+    size_t n = 0;
+    while (s[n]) {
+        n++;
+    }
+    return n;
+}
+
+// a collision-free hash of the command names: slots[hash % k_cmd_slots]
+// is the 1-based index into g_cmds, or 0 if empty.
+struct CmdIndex {
+    uint32_t seed = 0;
+    uint8_t slots[k_cmd_slots] = {};
+};
+
+// search for a seed without collisions, at compile time
+static constexpr CmdIndex cmd_index_build() {
+    for (uint32_t seed = 0x811C9DC5; ; ++seed) {
+        CmdIndex idx;
+        idx.seed = seed;
+        bool ok = true;
+        for (size_t i = 0; ok && i < k_ncmds; ++i) {
+            const char *name = g_cmds[i].name;
+            uint32_t h = cmd_hash(name, cstr_len(name), seed) % k_cmd_slots;
+            ok = (idx.slots[h] == 0);
+            idx.slots[h] = (uint8_t)(i + 1);
+        }
+        if (ok) {
+            return idx;
+        }
+    }
+}
+
+static constexpr CmdIndex g_cmd_index = cmd_index_build();
+
+// O(1): one hash and one comparison
+static const Command *cmd_lookup(std::string_view name) {
+    uint32_t h = cmd_hash(name.data(), name.size(), g_cmd_index.seed);
+    uint8_t i = g_cmd_index.slots[h % k_cmd_slots];
+    if (i == 0 || !cmd_is(name, g_cmds[i - 1].name)) {
+        return NULL;
+    }
+    return &g_cmds[i - 1];
+}
+
+// find the command and check the arguments, or output an error
+static const Command *cmd_check(
+    std::vector<std::string_view> &cmd, std::string &out)
+{
+    const Command *c = cmd.empty() ? NULL : cmd_lookup(cmd[0]);
+    if (!c) {
+        // cmd is not recognized
+        out_err(out, ERR_UNKNOWN, "Unknown cmd");
+        return NULL;
+    }
+    bool ok = c->arity >= 0
+        ? cmd.size() == (size_t)c->arity : cmd.size() >= (size_t)-c->arity;
+    if (!ok) {
+        out_err(out, ERR_ARG, "wrong number of arguments");
+        return NULL;
+    }
+    return c;
+}
+
+// log a write command that succeeded
+static void aof_feed(const Command *c, std::vector<std::string_view> &cmd) {
+    if (!g_aof_conf.path && !g_repl_conf.listen_path) {
+        return;
+    }
+    int64_t ttl_ms = 0;
+    if (c->handler == &do_expire && str2int(cmd[2], ttl_ms) && ttl_ms >= 0) {
+        // relative TTLs become deadlines, or they restart on replay
+        char buf[32];
+        int64_t at_ms = get_unix_msec() + ttl_ms;
+        int n = snprintf(buf, sizeof(buf), "%" PRId64, at_ms);
+        std::string_view args[3] = {"pexpireat", cmd[1], {buf, (size_t)n}};
+        return aof_append_req(g_data.aof_buf, args, 3);
+    }
+    aof_append_req(g_data.aof_buf, cmd.data(), cmd.size());
+}
+
+static void cmd_exec(
+    const Command *c, std::vector<std::string_view> &cmd, std::string &out)
+{
+    size_t start = out.size();
+    c->handler(cmd, out);
+    if ((c->flags & CMD_WRITE) && (uint8_t)out[start] != SER_ERR) {
+        aof_feed(c, cmd);
+    }
+}
+
+static void shard_post(size_t to, ShardMsg &msg) {
+    Shard *shard = g_shards[to];
+    pthread_mutex_lock(&shard->mu);
+    shard->inbox.push_back(std::move(msg));
+    pthread_mutex_unlock(&shard->mu);
+
+    uint64_t one = 1;
+    ssize_t rv = write(shard->efd, &one, sizeof(one));
+    (void)rv;   // EAGAIN means the counter is already non-zero
+}
+
+// the shard owning a key, by its str_hash().
+// the hash is mixed first so that the low bits used by HMap buckets
+// stay uniformly distributed within each shard.
+static size_t hash_shard(uint64_t h) {
+    h *= 0x9E3779B97F4A7C15ull;
+    return (size_t)((h >> 32) % g_shards.size());
+}
+
+static size_t key_shard(std::string_view key) {
+    return hash_shard(str_hash((uint8_t *)key.data(), key.size()));
+}
+
+static void shard_forward(
+    Conn *conn, size_t to, std::vector<std::string_view> &cmd)
+{
+    ShardMsg msg;
+    msg.from = g_data.shard_id;
+    msg.conn = conn;
+    // the arguments must outlive rbuf
+    msg.cmd.assign(cmd.begin(), cmd.end());
+    shard_post(to, msg);
+}
+
+// execute the command locally if this shard owns the key,
+// otherwise forward it and put the connection into STATE_WAIT.
+// returns true if `out` is ready.
+static bool shard_dispatch(
+    Conn *conn, std::vector<std::string_view> &cmd, std::string &out)
+{
+    const Command *c = cmd_check(cmd, out);
+    if (!c) {
+        return true;    // the error is in `out`
+    }
+    if ((c->flags & CMD_WRITE) && repl_following()) {
+        out_err(out, ERR_READONLY, "a follower is read-only");
+        return true;
+    }
+    if (c->flags & CMD_WRITE) {
+        conn->aof_wrote = true;     // see aof_hold()
+    }
+    if (g_shards.size() == 1) {
+        cmd_exec(c, cmd, out);
+        return true;
+    }
+
+    conn->wait_out.clear();
+    if (c->flags & CMD_ALLSHARDS) {
+        // every shard holds a part of the keyspace, merge them all
+        cmd_exec(c, cmd, conn->wait_out);
+        conn->pending = 0;
+        for (size_t i = 0; i < g_shards.size(); ++i) {
+            if (i != g_data.shard_id) {
+                shard_forward(conn, i, cmd);
+                conn->pending++;
+            }
+        }
+    } else {
+        // routed by the first key, multi-key commands must not span shards
+        size_t owner = g_data.shard_id;
+        if (c->first_key > 0 && (size_t)c->first_key < cmd.size()) {
+            owner = key_shard(cmd[c->first_key]);
+        }
+        if (owner == g_data.shard_id) {
+            cmd_exec(c, cmd, out);
+            return true;
+        }
+        shard_forward(conn, owner, cmd);
+        conn->pending = 1;
+    }
+    conn->state = STATE_WAIT;
+    return false;
+}
+
+// append the elements of the array `src` to the array `dst`
+static void out_merge_arr(std::string &dst, const std::string &src) {
+    assert(dst[0] == SER_ARR && src[0] == SER_ARR);
+    uint32_t n = 0, m = 0;
+    memcpy(&n, &dst[1], 4);
+    memcpy(&m, &src[1], 4);
+    dst.append(src, 1 + 4, std::string::npos);
+    out_update_arr(dst, n + m);
+}
+
+// append the response to the output queue, it's sent by conn_process().
+static void conn_respond(Conn *conn, std::string &out) {
+    assert(!(conn->uops & UOP_SEND));
+    if (out.size() > g_max_msg) {
+        out.clear();
+        out_err(out, ERR_2BIG, "response is too big");
+    }
+    bool copy = out.size() < k_out_chunk_min;
+    size_t need = conn->wbuf_size + 4 + (copy ? out.size() : 0);
+    if (!buf_reserve(&conn->wbuf, &conn->wbuf_cap, conn->wbuf_size, need)) {
+        msg("out of memory");
+        conn->state = STATE_END;
+        return;
+    }
+    uint32_t wlen = (uint32_t)out.size();
+    memcpy(&conn->wbuf[conn->wbuf_size], &wlen, 4);
+    conn->wbuf_size += 4;
+    if (copy) {
+        memcpy(&conn->wbuf[conn->wbuf_size], out.data(), out.size());
+        conn->wbuf_size += out.size();
+    } else {
+        // take over the string instead of copying it
+        conn->wchunks.emplace_back();
+        conn->wchunks.back().pos = conn->wbuf_size;
+        conn->wchunks.back().data.swap(out);
+        conn->wchunk_bytes += wlen;
+    }
+}
+
+// move the unconsumed data to the front of rbuf.
+// called once before each read instead of once per request.
+static void rbuf_compact(Conn *conn) {
+    if (conn->rbuf_head == 0) {
+        return;
+    }
+    size_t remain = conn->rbuf_size - conn->rbuf_head;
+    if (remain) {
+        memmove(conn->rbuf, &conn->rbuf[conn->rbuf_head], remain);
+    }
+    conn->rbuf_head = 0;
+    conn->rbuf_size = remain;
+}
+
+// make room for the next read: the rest of a partially received
+// request, or at least k_read_chunk bytes.
+static bool rbuf_reserve(Conn *conn) {
+    rbuf_compact(conn);
+    size_t need = conn->rbuf_size + k_read_chunk;
+    if (conn->rbuf_size >= 4) {
+        uint32_t len = 0;
+        memcpy(&len, &conn->rbuf[0], 4);
+        if (len <= g_max_msg && 4 + (size_t)len > need) {
+            need = 4 + (size_t)len;
+        }
+    }
+    return buf_reserve(&conn->rbuf, &conn->rbuf_cap, conn->rbuf_size, need);
 }
 
-static bool cmd_is(const std::string &word, const char *cmd) {
-    return 0 == strcasecmp(word.c_str(), cmd);
-}
-
-static void do_request(std::vector<std::string> &cmd, std::string &out) {
-    if (cmd.size() == 1 && cmd_is(cmd[0], "keys")) {
-        do_keys(cmd, out);
-    } else if (cmd.size() == 2 && cmd_is(cmd[0], "get")) {
-        do_get(cmd, out);
-    } else if (cmd.size() == 3 && cmd_is(cmd[0], "set")) {
-        do_set(cmd, out);
-    } else if (cmd.size() == 2 && cmd_is(cmd[0], "del")) {
-        do_del(cmd, out);
-    } else if (cmd.size() == 3 && cmd_is(cmd[0], "pexpire")) {
-        do_expire(cmd, out);
-    } else if (cmd.size() == 2 && cmd_is(cmd[0], "pttl")) {
-        do_ttl(cmd, out);
-    } else if (cmd.size() == 4 && cmd_is(cmd[0], "zadd")) {
-        do_zadd(cmd, out);
-    } else if (cmd.size() == 3 && cmd_is(cmd[0], "zrem")) {
-        do_zrem(cmd, out);
-    } else if (cmd.size() == 3 && cmd_is(cmd[0], "zscore")) {
-        do_zscore(cmd, out);
-    } else if (cmd.size() == 6 && cmd_is(cmd[0], "zquery")) {
-        do_zquery(cmd, out);
-    } else {
-        // cmd is not recognized
-        out_err(out, ERR_UNKNOWN, "Unknown cmd");
+// give the empty buffers back to the pool, so that idle connections
+// don't hold any. rbuf is kept while a recv is writing into it.
+static void conn_trim(Conn *conn) {
+    if (conn->rbuf_size == 0 && !(conn->uops & UOP_RECV_RBUF)) {
+        buf_release(&conn->rbuf, &conn->rbuf_cap);
+    }
+    if (conn->wbuf_size == 0) {
+        buf_release(&conn->wbuf, &conn->wbuf_cap);
     }
 }
 
 static bool try_one_request(Conn *conn) {
     // try to parse a request from the buffer
-    if (conn->rbuf_size < 4) {
+    uint8_t *req = &conn->rbuf[conn->rbuf_head];
+    size_t avail = conn->rbuf_size - conn->rbuf_head;
+    if (avail < 4) {
         // not enough data in the buffer. Will retry in the next iteration
         return false;
     }
     uint32_t len = 0;
-    memcpy(&len, &conn->rbuf[0], 4);
-    if (len > k_max_msg) {
+    memcpy(&len, &req[0], 4);
+    if (len > g_max_msg) {
         msg("too long");
         conn->state = STATE_END;
         return false;
     }
-    if (4 + len > conn->rbuf_size) {
+    if (4 + len > avail) {
         // not enough data in the buffer. Will retry in the next iteration
         return false;
     }
 
-    // parse the request
-    std::vector<std::string> cmd;
-    if (0 != parse_req(&conn->rbuf[4], len, cmd)) {
+    // parse the request, the arguments point into rbuf
+    std::vector<std::string_view> &cmd = g_data.args;
+    if (0 != parse_req(&req[4], len, cmd)) {
         msg("bad req");
         conn->state = STATE_END;
         return false;
     }
 
     // got one request, generate the response.
-    std::string out;
-    do_request(cmd, out);
-
-    // pack the response into the buffer
-    if (4 + out.size() > k_max_msg) {
-        out.clear();
-        out_err(out, ERR_2BIG, "response is too big");
+    std::string &out = g_data.out;
+    out.clear();
+    bool ready = shard_dispatch(conn, cmd, out);
+
+    // consume the request by advancing the cursor, `cmd` is invalidated.
+    conn->rbuf_head += 4 + len;
+    if (conn->rbuf_head == conn->rbuf_size) {
+        // drained, rewind for free
+        conn->rbuf_head = conn->rbuf_size = 0;
     }
-    uint32_t wlen = (uint32_t)out.size();
-    memcpy(&conn->wbuf[0], &wlen, 4);
-    memcpy(&conn->wbuf[4], out.data(), out.size());
-    conn->wbuf_size = 4 + wlen;
-
-    // remove the request from the buffer.
-    // note: frequent memmove is inefficient.
-    // note: need better handling for production code.
-    size_t remain = conn->rbuf_size - 4 - len;
-    if (remain) {
-        memmove(conn->rbuf, &conn->rbuf[4 + len], remain);
+
+    if (!ready) {
+        // the response will be sent when the other shards reply
+        return false;
     }
-    conn->rbuf_size = remain;
+    conn_respond(conn, out);
+
+    // continue the outer loop unless too much output is queued
+    return conn->state == STATE_REQ && conn_out_size(conn) < k_out_flush_at;
+}
 
-    // change state
-    conn->state = STATE_RES;
-    state_res(conn);
+// with `appendfsync always`, a connection that wrote gets no replies
+// until the write commands executed so far are on disk. resumed by
+// aof_commit(). the readers are not held.
+static bool aof_hold(Conn *conn) {
+    bool wrote = conn->aof_wrote || conn->aof_held;
+    if (g_aof_conf.policy != AOF_ALWAYS || !wrote || !aof_dirty()) {
+        conn->aof_wrote = false;
+        return false;
+    }
+    if (!conn->aof_held) {
+        conn->aof_held = true;
+        g_data.aof_waiters.push_back(conn);
+    }
+    conn->aof_seq = 0;  // the commands so far, known at the commit
+    return true;
+}
 
-    // continue the outer loop if the request was fully processed
-    return (conn->state == STATE_REQ);
+// execute the requests in rbuf and flush their responses together,
+// until blocked on the socket or out of complete requests.
+static void conn_process(Conn *conn) {
+    while (conn->state == STATE_REQ) {
+        while (try_one_request(conn)) {}
+        if (conn->state != STATE_REQ || conn_out_empty(conn)) {
+            break;
+        }
+        if (aof_hold(conn)) {
+            break;
+        }
+        conn->state = STATE_RES;
+        state_res(conn);
+    }
 }
 
 static bool try_fill_buffer(Conn *conn) {
     // try to fill the buffer
-    assert(conn->rbuf_size < sizeof(conn->rbuf));
+    if (!rbuf_reserve(conn)) {
+        msg("out of memory");
+        conn->state = STATE_END;
+        return false;
+    }
     ssize_t rv = 0;
     do {
-        size_t cap = sizeof(conn->rbuf) - conn->rbuf_size;
+        size_t cap = conn->rbuf_cap - conn->rbuf_size;
         rv = read(conn->fd, &conn->rbuf[conn->rbuf_size], cap);
     } while (rv < 0 && errno == EINTR);
     if (rv < 0 && errno == EAGAIN) {
@@ -657,7 +2487,7 @@ static bool try_fill_buffer(Conn *conn) {
         return false;
     }
     if (rv == 0) {
-        if (conn->rbuf_size > 0) {
+        if (conn->rbuf_size > conn->rbuf_head) {
             msg("unexpected EOF");
         } else {
             msg("EOF");
@@ -667,23 +2497,27 @@ static bool try_fill_buffer(Conn *conn) {
     }
 
     conn->rbuf_size += (size_t)rv;
-    assert(conn->rbuf_size <= sizeof(conn->rbuf));
+    assert(conn->rbuf_size <= conn->rbuf_cap);
 
     // Try to process requests one by one.
     // Why is there a loop? Please read the explanation of "pipelining".
+    // The responses are queued and flushed after the reads.
     while (try_one_request(conn)) {}
-    return (conn->state == STATE_REQ);
+    return conn->state == STATE_REQ && conn_out_size(conn) < k_out_flush_at;
 }
 
 static void state_req(Conn *conn) {
     while (try_fill_buffer(conn)) {}
+    conn_process(conn);
 }
 
 static bool try_flush_buffer(Conn *conn) {
+    // all queued responses in one syscall
+    struct iovec iov[k_max_iov];
+    size_t niov = conn_out_iov(conn, iov, k_max_iov);
     ssize_t rv = 0;
     do {
-        size_t remain = conn->wbuf_size - conn->wbuf_sent;
-        rv = write(conn->fd, &conn->wbuf[conn->wbuf_sent], remain);
+        rv = writev(conn->fd, iov, (int)niov);
     } while (rv < 0 && errno == EINTR);
     if (rv < 0 && errno == EAGAIN) {
         // got EAGAIN, stop.
@@ -694,35 +2528,47 @@ static bool try_flush_buffer(Conn *conn) {
         conn->state = STATE_END;
         return false;
     }
-    conn->wbuf_sent += (size_t)rv;
-    assert(conn->wbuf_sent <= conn->wbuf_size);
-    if (conn->wbuf_sent == conn->wbuf_size) {
-        // response was fully sent, change state back
+    if (conn_out_advance(conn, (size_t)rv)) {
+        // responses were fully sent, change state back
         conn->state = STATE_REQ;
-        conn->wbuf_sent = 0;
-        conn->wbuf_size = 0;
         return false;
     }
-    // still got some data in wbuf, could try to write again
+    // still got some data in the queue, could try to write again
     return true;
 }
 
 static void state_res(Conn *conn) {
+    if (g_use_uring) {
+        // completed in uring_on_send()
+        return uring_queue_send(conn);
+    }
     while (try_flush_buffer(conn)) {}
 }
 
-static void connection_io(Conn *conn) {
-    // waked up by poll, update the idle timer
-    // by moving conn to the end of the list.
-    conn->idle_start = get_monotonic_usec();
+// update the idle timer by moving conn to the end of the list.
+static void conn_touch(Conn *conn) {
+    conn->idle_start = clock_now_us();
     dlist_detach(&conn->idle_list);
     dlist_insert_before(&g_data.idle_list, &conn->idle_list);
+}
+
+static void connection_io(Conn *conn) {
+    // waked up by epoll
+    conn_touch(conn);
 
     // do the work
     if (conn->state == STATE_REQ) {
         state_req(conn);
     } else if (conn->state == STATE_RES) {
         state_res(conn);
+        // continue with the requests left in rbuf
+        conn_process(conn);
+    } else if (conn->state == STATE_WAIT) {
+        // only errors or hangups are reported, and they are level-
+        // triggered. stop watching, the connection is freed when the
+        // pending replies have arrived.
+        (void)epoll_ctl(g_data.epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        conn->hangup = true;
     } else {
         assert(0);  // not expected
     }
@@ -731,7 +2577,7 @@ static void connection_io(Conn *conn) {
 const uint64_t k_idle_timeout_ms = 5 * 1000;
 
 static uint32_t next_timer_ms() {
-    uint64_t now_us = get_monotonic_usec();
+    uint64_t now_us = clock_refresh();
     uint64_t next_us = (uint64_t)-1;
 
     // idle timers
@@ -741,8 +2587,12 @@ static uint32_t next_timer_ms() {
     }
 
     // ttl timers
-    if (!g_data.heap.empty() && g_data.heap[0].val < next_us) {
-        next_us = g_data.heap[0].val;
+    next_us = std::min(next_us, ttl_next_us());
+
+    // poll for the BGSAVE child
+    const uint64_t k_save_poll_us = 100 * 1000;
+    if (g_save.child >= 0 && g_save.owner == g_data.shard_id) {
+        next_us = std::min(next_us, now_us + k_save_poll_us);
     }
 
     if (next_us == (uint64_t)-1) {
@@ -756,20 +2606,234 @@ static uint32_t next_timer_ms() {
     return (uint32_t)((next_us - now_us) / 1000);
 }
 
+static void conn_free(Conn *conn) {
+    if (conn->aof_held) {
+        std::vector<Conn *> &v = g_data.aof_waiters;
+        v.erase(std::find(v.begin(), v.end(), conn));
+    }
+    (void)close(conn->fd);
+    buf_release(&conn->rbuf, &conn->rbuf_cap);
+    buf_release(&conn->wbuf, &conn->wbuf_cap);
+    conn->~Conn();
+    slab_free(conn, sizeof(Conn));
+}
+
 static void conn_done(Conn *conn) {
     g_data.fd2conn[conn->fd] = NULL;
-    (void)close(conn->fd);
     dlist_detach(&conn->idle_list);
-    free(conn);
+    conn->state = STATE_END;
+    if (g_use_uring) {
+        if (conn->uops) {
+            // complete the in-flight operations,
+            // the last completion frees the connection.
+            (void)shutdown(conn->fd, SHUT_RDWR);
+            return;
+        }
+    } else {
+        (void)epoll_ctl(g_data.epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    }
+    conn_free(conn);
 }
 
-static bool hnode_same(HNode *lhs, HNode *rhs) {
-    return lhs == rhs;
+// a reply for one of our connections arrived from another shard
+static void shard_on_reply(Conn *conn, std::string &out) {
+    assert(conn->state == STATE_WAIT && conn->pending > 0);
+    if (conn->wait_out.empty()) {
+        conn->wait_out.swap(out);
+    } else if (out[0] == SER_ARR) {
+        out_merge_arr(conn->wait_out, out);
+    }   // otherwise all shards reply the same
+    if (--conn->pending) {
+        return;
+    }
+    if (conn->hangup) {
+        conn_done(conn);
+        return;
+    }
+
+    std::string res;
+    res.swap(conn->wait_out);
+    conn->state = STATE_REQ;
+    conn_respond(conn, res);
+    // resume the pipelined requests left in the buffer
+    conn_process(conn);
+
+    if (conn->state == STATE_END) {
+        conn_done(conn);
+    } else {
+        conn_trim(conn);
+        conn_rewatch(conn);
+    }
+}
+
+// on a follower: execute a batch from the primary, the replies are
+// dropped. the commands are logged again for the AOF of the follower.
+static void repl_apply(const std::string &batch) {
+    std::vector<std::string_view> &cmd = g_data.args;
+    std::string out;
+    size_t pos = 0;
+    while (pos < batch.size()) {
+        uint32_t len = 0;
+        memcpy(&len, &batch[pos], 4);
+        int32_t rv = parse_req((const uint8_t *)&batch[pos + 4], len, cmd);
+        assert(rv == 0);    // checked by repl_link()
+        pos += 4 + len;
+
+        out.clear();
+        const Command *c = cmd_check(cmd, out);
+        if (c && (c->flags & CMD_ALLSHARDS) && g_data.shard_id != 0) {
+            c->handler(cmd, out);   // logged once, by shard 0
+        } else if (c) {
+            cmd_exec(c, cmd, out);
+        }
+    }
+}
+
+// on a follower: the shard of a command from the primary, -1 for all
+// shards, -2 if not applied
+static int repl_route(std::vector<std::string_view> &cmd) {
+    std::string out;
+    const Command *c = cmd_check(cmd, out);
+    if (c && (c->flags & CMD_ALLSHARDS)) {
+        return -1;
+    }
+    if (!c || !(c->flags & CMD_WRITE)) {
+        return -2;
+    }
+    size_t owner = 0;
+    if (c->first_key > 0 && (size_t)c->first_key < cmd.size()) {
+        owner = key_shard(cmd[c->first_key]);
+    }
+    return (int)owner;
+}
+
+static void repl_post(size_t shard, std::string &batch) {
+    ShardMsg msg;
+    msg.is_repl = true;
+    msg.repl.swap(batch);
+    shard_post(shard, msg);
+}
+
+// woken up by the eventfd, handle all messages in the mailbox
+static void shard_drain() {
+    Shard *shard = g_shards[g_data.shard_id];
+    uint64_t cnt = 0;
+    ssize_t rv = read(shard->efd, &cnt, sizeof(cnt));
+    (void)rv;
+
+    std::vector<ShardMsg> msgs;
+    pthread_mutex_lock(&shard->mu);
+    msgs.swap(shard->inbox);
+    pthread_mutex_unlock(&shard->mu);
+
+    for (ShardMsg &msg : msgs) {
+        if (msg.is_pause) {
+            snapshot_wait();
+        } else if (msg.is_repl) {
+            repl_apply(msg.repl);
+        } else if (msg.sync) {
+            repl_sync_fork(msg.sync);
+        } else if (msg.is_reply) {
+            shard_on_reply(msg.conn, msg.out);
+        } else {
+            // execute on behalf of the other shard and send the output back
+            g_data.args.assign(msg.cmd.begin(), msg.cmd.end());
+            const Command *c = cmd_check(g_data.args, msg.out);
+            if (c && (c->flags & CMD_ALLSHARDS)) {
+                // logged once by the shard that received it
+                c->handler(g_data.args, msg.out);
+            } else if (c) {
+                cmd_exec(c, g_data.args, msg.out);
+            }
+            msg.is_reply = true;
+            bool wrote = c && (c->flags & CMD_WRITE);
+            if (g_aof_conf.policy == AOF_ALWAYS && wrote && aof_dirty()) {
+                shard->aof_held.push_back(std::move(msg));
+            } else {
+                shard_post(msg.from, msg);
+            }
+        }
+    }
+}
+
+// with AOF_ALWAYS, send the held replies whose commands are on disk
+static void aof_release(uint64_t synced) {
+    Shard *shard = g_shards[g_data.shard_id];
+    std::vector<ShardMsg> msgs;
+    msgs.swap(shard->aof_held);
+    for (ShardMsg &msg : msgs) {
+        if (msg.aof_seq <= synced) {
+            shard_post(msg.from, msg);
+        } else {
+            shard->aof_held.push_back(std::move(msg));
+        }
+    }
+    // the resumed connections may hold again, for the next commit
+    std::vector<Conn *> conns;
+    conns.swap(g_data.aof_waiters);
+    for (Conn *conn : conns) {
+        if (conn->aof_seq > synced) {
+            g_data.aof_waiters.push_back(conn);
+            continue;
+        }
+        conn->aof_held = false;
+        conn->aof_wrote = false;
+        if (conn->state != STATE_REQ) {
+            continue;   // waiting for other shards, or closed
+        }
+        conn->state = STATE_RES;
+        state_res(conn);
+        conn_process(conn);
+        if (conn->state == STATE_END) {
+            conn_done(conn);
+        } else {
+            conn_trim(conn);
+            conn_rewatch(conn);
+        }
+    }
+}
+
+// hand the commands of this iteration to the writer. with AOF_ALWAYS,
+// the replies held in this iteration wait for them. the loop never
+// blocks on the disk: the writer wakes it up through the mailbox once
+// they are synced, and the held replies are released then.
+static void aof_commit() {
+    aof_submit();
+    Shard *shard = g_shards[g_data.shard_id];
+    while (g_aof_conf.policy == AOF_ALWAYS && aof_dirty()) {
+        uint64_t wait = UINT64_MAX;
+        for (ShardMsg &msg : shard->aof_held) {
+            msg.aof_seq = msg.aof_seq ? msg.aof_seq : g_data.aof_seq;
+            wait = std::min(wait, msg.aof_seq);
+        }
+        for (Conn *conn : g_data.aof_waiters) {
+            conn->aof_seq = conn->aof_seq ? conn->aof_seq : g_data.aof_seq;
+            wait = std::min(wait, conn->aof_seq);
+        }
+
+        bool waiting = wait != UINT64_MAX;
+        uint64_t synced = aof_synced(waiting ? wait : 0, shard->efd);
+        bool blocked = waiting && wait > synced;
+        g_data.aof_synced = std::min(synced, g_data.aof_seq);
+        if (!waiting || blocked) {
+            return;
+        }
+        aof_release(synced);
+        aof_submit();   // the resumed connections may have written more
+    }
 }
 
+// the time budget of the active expiry per loop iteration. it grows
+// while there is a backlog, and is reset once the timers catch up.
+const uint64_t k_expire_budget_min_us = 1000;
+const uint64_t k_expire_budget_max_us = 8000;
+
 static void process_timers() {
-    // the extra 1000us is for the ms resolution of poll()
-    uint64_t now_us = get_monotonic_usec() + 1000;
+    snapshot_reap();
+    aof_auto_rewrite();
+
+    // the extra 1000us is for the ms resolution of epoll_wait()
+    uint64_t now_us = clock_now_us() + 1000;
 
     // idle timers
     while (!dlist_empty(&g_data.idle_list)) {
@@ -779,28 +2843,213 @@ static void process_timers() {
             // not ready
             break;
         }
+        if (next->state == STATE_WAIT) {
+            // still referenced by messages in flight, not idle
+            conn_touch(next);
+            continue;
+        }
 
         printf("removing idle connection: %d\n", next->fd);
         conn_done(next);
     }
 
-    // TTL timers
-    const size_t k_max_works = 2000;
+    // TTL timers. don't stall the server if too many keys are expiring
+    // at once, the clock is checked every few keys.
+    uint64_t budget_us = g_data.expire_budget_us;
+    if (budget_us < k_expire_budget_min_us) {
+        budget_us = k_expire_budget_min_us;
+    }
+    uint64_t start_us = clock_refresh();
+    bool backlog = false;
     size_t nworks = 0;
-    while (!g_data.heap.empty() && g_data.heap[0].val < now_us) {
-        Entry *ent = container_of(g_data.heap[0].ref, Entry, heap_idx);
+    Entry *ent = NULL;
+    while ((ent = ttl_pop_expired(now_us))) {
         HNode *node = hm_pop(&g_data.db, &ent->node, &hnode_same);
         assert(node == &ent->node);
         entry_del(ent);
-        if (nworks++ >= k_max_works) {
-            // don't stall the server if too many keys are expiring at once
+        if (++nworks % 32 == 0 && clock_refresh() - start_us > budget_us) {
+            backlog = true;
             break;
         }
     }
+    g_data.expire_budget_us = backlog
+        ? std::min(budget_us * 2, k_expire_budget_max_us)
+        : k_expire_budget_min_us;
+}
+
+// conn_done() was called, waiting for the in-flight operations.
+// the fd is not closed yet so its slot in fd2conn can't be reused.
+static bool uring_conn_closing(Conn *conn) {
+    return g_data.fd2conn[conn->fd] != conn;
+}
+
+static void uring_conn_release(Conn *conn) {
+    if (conn->uops == 0) {
+        conn_free(conn);
+    }
+}
+
+// continue after some I/O was completed
+static void uring_conn_resume(Conn *conn) {
+    conn_process(conn);
+    if (conn->state == STATE_END) {
+        conn_done(conn);
+    } else {
+        conn_trim(conn);
+        conn_rewatch(conn);
+    }
+}
+
+static void uring_on_recv(Conn *conn, int32_t res, uint32_t flags) {
+    conn->uops &= ~(UOP_RECV | UOP_RECV_RBUF);
+    uint8_t *src = NULL;
+    uint16_t bid = 0;
+    if (flags & IORING_CQE_F_BUFFER) {
+        bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+        src = uring_buf(&g_data.bufs, bid);
+    }
+
+    if (uring_conn_closing(conn)) {
+        if (src) {
+            uring_buf_recycle(&g_data.ring, &g_data.bufs, bid);
+        }
+        return uring_conn_release(conn);
+    }
+    if (res == -ENOBUFS) {
+        // all provided buffers are in use, read into rbuf instead
+        return uring_queue_recv(conn, false);
+    }
+    if (res <= 0) {
+        msg(res == 0 ? "EOF" : "recv() error");
+        return conn_done(conn);
+    }
+
+    conn_touch(conn);
+    if (src) {
+        rbuf_compact(conn);
+        bool ok = buf_reserve(&conn->rbuf, &conn->rbuf_cap,
+            conn->rbuf_size, conn->rbuf_size + (size_t)res);
+        if (ok) {
+            memcpy(&conn->rbuf[conn->rbuf_size], src, (size_t)res);
+        }
+        uring_buf_recycle(&g_data.ring, &g_data.bufs, bid);
+        if (!ok) {
+            msg("out of memory");
+            return conn_done(conn);
+        }
+    }
+    conn->rbuf_size += (size_t)res;
+    assert(conn->rbuf_size <= conn->rbuf_cap);
+    uring_conn_resume(conn);
+}
+
+static void uring_on_send(Conn *conn, int32_t res) {
+    conn->uops &= ~UOP_SEND;
+    if (uring_conn_closing(conn)) {
+        return uring_conn_release(conn);
+    }
+    if (res < 0) {
+        msg("send() error");
+        return conn_done(conn);
+    }
+
+    if (!conn_out_advance(conn, (size_t)res)) {
+        return uring_queue_send(conn);
+    }
+    // responses were fully sent, change state back
+    conn->state = STATE_REQ;
+    uring_conn_resume(conn);
+}
+
+static void uring_queue_accept(int fd) {
+    io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;  // one CQE per new connection
+    sqe->user_data = UOP_ACCEPT;
+}
+
+static void uring_queue_inbox(int efd) {
+    io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = efd;
+    sqe->addr = (uint64_t)&g_data.inbox_cnt;
+    sqe->len = sizeof(g_data.inbox_cnt);
+    sqe->user_data = UOP_INBOX;
+}
+
+// the event loop of the io_uring engine.
+// all SQEs queued while handling a batch of completions are
+// submitted together with the next wait, in a single syscall.
+static void uring_run(int fd, int efd) {
+    const uint32_t k_ring_entries = 4096;
+    const uint32_t k_recv_bufs = 1024;
+    const uint32_t k_recv_buf_size = 4096;
+    if (uring_init(&g_data.ring, k_ring_entries)) {
+        die("io_uring_setup()");
+    }
+    if (uring_bufs_init(
+        &g_data.ring, &g_data.bufs, 0, k_recv_bufs, k_recv_buf_size))
+    {
+        die("IORING_OP_PROVIDE_BUFFERS");
+    }
+    uring_queue_accept(fd);
+    uring_queue_inbox(efd);
+
+    while (true) {
+        int timeout_ms = (int)next_timer_ms();
+        if (uring_submit_and_wait(&g_data.ring, timeout_ms) < 0) {
+            die("io_uring_enter()");
+        }
+        clock_refresh();
+
+        // handle completions
+        while (io_uring_cqe *cqe = uring_peek_cqe(&g_data.ring)) {
+            uint64_t data = cqe->user_data;
+            int32_t res = cqe->res;
+            uint32_t flags = cqe->flags;
+            uring_cqe_seen(&g_data.ring);
+
+            Conn *conn = (Conn *)(data & ~(uint64_t)UOP_MASK);
+            switch (data & UOP_MASK) {
+            case UOP_RECV:
+                uring_on_recv(conn, res, flags);
+                break;
+            case UOP_SEND:
+                uring_on_send(conn, res);
+                break;
+            case UOP_ACCEPT:
+                if (res >= 0) {
+                    (void)conn_new(res);
+                } else {
+                    msg("accept() error");
+                }
+                if (!(flags & IORING_CQE_F_MORE)) {
+                    uring_queue_accept(fd);
+                }
+                break;
+            case UOP_INBOX:
+                // handle requests and replies from other shards
+                shard_drain();
+                uring_queue_inbox(efd);
+                break;
+            default:
+                // only failed IORING_OP_PROVIDE_BUFFERS report completions
+                msg("io_uring: provide buffers error");
+                break;
+            }
+        }
+
+        // handle timers
+        process_timers();
+        // the values deleted in this iteration
+        lazyfree_flush();
+        // the commands of this iteration
+        aof_commit();
+    }
 }
 
-int main() {
-    // prepare the listening socket
+static int listen_on(uint16_t port) {
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0) {
         die("socket()");
@@ -808,11 +3057,14 @@ int main() {
 
     int val = 1;
     setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    // every reactor binds its own listener to the same port,
+    // the kernel spreads incoming connections among them.
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
 
     // bind
     struct sockaddr_in addr = {};
     addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
+    addr.sin_port = ntohs(port);
     addr.sin_addr.s_addr = ntohl(0);    // wildcard address 0.0.0.0
     int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
     if (rv) {
@@ -827,59 +3079,473 @@ int main() {
 
     // set the listen fd to nonblocking mode
     fd_set_nb(fd);
+    return fd;
+}
+
+static void epoll_watch(int fd) {
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(g_data.epfd, EPOLL_CTL_ADD, fd, &ev)) {
+        die("epoll_ctl(ADD)");
+    }
+}
+
+// a live key of the snapshot, found by snapshot_scan()
+struct LoadKey {
+    uint64_t pos = 0;       // the offset of the record
+    uint64_t hcode = 0;
+};
+
+// the keys of a chunk, by shard
+struct LoadChunk {
+    std::vector<std::vector<LoadKey>> shards;
+    bool err = false;
+};
+
+// loading the snapshot takes 2 steps: the thread pool scans the chunks
+// in parallel, hashing the keys and sorting them by shard, then each
+// reactor builds its own keys. the entries are allocated by their owner
+// reactors, whose slab arenas reuse the memory when they are deleted.
+static struct {
+    SnapReader r;           // open until every shard has loaded
+    int64_t now_ms = 0;     // the keys that expire before are skipped
+    std::vector<LoadChunk> chunks;
+    pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+    size_t nscanning = 0;
+    std::atomic<size_t> nloading{0};
+} g_load;
+
+// a record: u8 type, i64 expire, key, then skip the value
+static bool snapshot_skip(
+    SnapReader *r, int64_t *expire_ms, std::string_view *key)
+{
+    uint8_t type = snap_get_u8(r);
+    *expire_ms = (int64_t)snap_get_u64(r);
+    *key = snap_get_str(r);
+    if (type == SNAP_STR) {
+        (void)snap_get_str(r);
+    } else if (type == SNAP_ZSET) {
+        uint32_t n = snap_get_u32(r);
+        for (uint32_t i = 0; i < n && !r->err; ++i) {
+            (void)snap_get_dbl(r);
+            (void)snap_get_str(r);
+        }
+    } else {
+        r->err = true;
+    }
+    return !r->err;
+}
+
+// in the thread pool
+static void snapshot_scan(void *arg) {
+    LoadChunk *chunk = (LoadChunk *)arg;
+    SnapReader r = snap_chunk(&g_load.r, (size_t)(chunk - &g_load.chunks[0]));
+    chunk->shards.resize(g_shards.size());
+    while (!snap_eof(&r)) {
+        LoadKey k;
+        k.pos = r.pos;
+        int64_t expire_ms = 0;
+        std::string_view key;
+        if (!snapshot_skip(&r, &expire_ms, &key)) {
+            break;
+        }
+        if (expire_ms >= 0 && expire_ms <= g_load.now_ms) {
+            continue;
+        }
+        k.hcode = str_hash((uint8_t *)key.data(), key.size());
+        chunk->shards[hash_shard(k.hcode)].push_back(k);
+    }
+    chunk->err = r.err;
+
+    pthread_mutex_lock(&g_load.mu);
+    if (--g_load.nscanning == 0) {
+        pthread_cond_signal(&g_load.done);
+    }
+    pthread_mutex_unlock(&g_load.mu);
+}
+
+// the 1st step, from main()
+static void snapshot_scan_all() {
+    uint64_t start_us = get_monotonic_usec();
+    g_load.now_ms = get_unix_msec();
+    g_load.chunks.resize(g_load.r.chunks.size());
+    g_load.nscanning = g_load.chunks.size();
+    g_load.nloading = g_shards.size();
+    for (LoadChunk &chunk : g_load.chunks) {
+        thread_pool_queue(&g_tp, &snapshot_scan, &chunk);
+    }
+    pthread_mutex_lock(&g_load.mu);
+    while (g_load.nscanning > 0) {
+        pthread_cond_wait(&g_load.done, &g_load.mu);
+    }
+    pthread_mutex_unlock(&g_load.mu);
+
+    for (LoadChunk &chunk : g_load.chunks) {
+        if (chunk.err) {
+            die("the snapshot is corrupted");
+        }
+    }
+    fprintf(stderr, "snapshot: scanned %zu chunks, %zu threads, %.0f ms\n",
+        g_load.chunks.size(), g_tp.threads.size(),
+        (double)(get_monotonic_usec() - start_us) / 1000);
+}
+
+static Entry *snapshot_load_zset(SnapReader *r, LookupKey *key, uint32_t n) {
+    Entry *ent = entry_new(key->key, key->node.hcode, T_ZSET, 0);
+    ent->zset = new ZSet();
+    zset_reserve(ent->zset, n);
+    for (uint32_t i = 0; i < n && !r->err; ++i) {
+        double score = snap_get_dbl(r);
+        std::string_view name = snap_get_str(r);
+        zset_add(ent->zset, name.data(), name.size(), score);
+    }
+    return ent;
+}
+
+// the 2nd step: build the keys of this reactor, found by the scan
+static void snapshot_load() {
+    if (!g_load.r.data) {
+        return;
+    }
+    uint64_t start_us = get_monotonic_usec();
+    size_t nkeys = 0;
+    for (LoadChunk &chunk : g_load.chunks) {
+        nkeys += chunk.shards[g_data.shard_id].size();
+    }
+    hm_reserve(&g_data.db, nkeys);
+
+    for (LoadChunk &chunk : g_load.chunks) {
+        std::vector<LoadKey> keys;
+        keys.swap(chunk.shards[g_data.shard_id]);
+        for (const LoadKey &k : keys) {
+            SnapReader r;
+            r.data = g_load.r.data;
+            r.size = g_load.r.size;
+            r.pos = k.pos;
+            uint8_t type = snap_get_u8(&r);
+            int64_t expire_ms = (int64_t)snap_get_u64(&r);
+            LookupKey key;
+            key.key = snap_get_str(&r);
+            key.node.hcode = k.hcode;
+
+            Entry *ent = NULL;
+            if (type == SNAP_STR) {
+                ent = entry_new_str(&key, snap_get_str(&r));
+            } else {
+                ent = snapshot_load_zset(&r, &key, snap_get_u32(&r));
+            }
+            assert(!r.err);     // checked by the scan
+            hm_insert(&g_data.db, &ent->node);
+            if (expire_ms >= 0) {
+                entry_set_ttl(ent, expire_ms - g_load.now_ms);
+            }
+        }
+    }
+    fprintf(stderr, "shard %zu: loaded %zu keys in %.0f ms\n",
+        g_data.shard_id, nkeys,
+        (double)(get_monotonic_usec() - start_us) / 1000);
+
+    // the last one unmaps the file
+    if (g_load.nloading.fetch_sub(1) == 1) {
+        snap_close(&g_load.r);
+        g_load.chunks.clear();
+    }
+}
+
+// the valid requests at the start of the AOF, a crash may have left a
+// partial one at the end. the commands are sorted by shard, for
+// aof_open().
+static size_t aof_scan(const uint8_t *data, size_t size) {
+    g_aof_load.cmds.resize(g_shards.size());
+    std::vector<std::string_view> cmd;
+    std::string out;
+    size_t pos = 0;
+    while (size - pos >= 4) {
+        uint32_t len = 0;
+        memcpy(&len, &data[pos], 4);
+        if (len > size - pos - 4 || 0 != parse_req(&data[pos + 4], len, cmd)) {
+            break;
+        }
+        out.clear();
+        const Command *c = cmd_check(cmd, out);
+        if (c && (c->flags & CMD_ALLSHARDS)) {
+            for (std::vector<uint64_t> &cmds : g_aof_load.cmds) {
+                cmds.push_back(pos);
+            }
+        } else if (c && c->first_key > 0 && (size_t)c->first_key < cmd.size()) {
+            g_aof_load.cmds[key_shard(cmd[c->first_key])].push_back(pos);
+        }
+        pos += 4 + len;
+    }
+    return pos;
+}
+
+// replay the commands of this reactor, found by aof_scan()
+static void aof_load() {
+    if (!g_aof_load.data) {
+        return;
+    }
+    uint64_t start_us = get_monotonic_usec();
+    std::vector<uint64_t> cmds;
+    cmds.swap(g_aof_load.cmds[g_data.shard_id]);
+    std::vector<std::string_view> cmd;
+    std::string out;
+    for (uint64_t pos : cmds) {
+        const uint8_t *req = &g_aof_load.data[pos];
+        uint32_t len = 0;
+        memcpy(&len, req, 4);
+        int32_t rv = parse_req(req + 4, len, cmd);
+        assert(rv == 0);    // checked by aof_scan()
+        (void)rv;
+
+        out.clear();
+        const Command *c = cmd_check(cmd, out);
+        c->handler(cmd, out);   // not logged again
+    }
+    fprintf(stderr, "shard %zu: replayed %zu commands in %.0f ms\n",
+        g_data.shard_id, cmds.size(),
+        (double)(get_monotonic_usec() - start_us) / 1000);
+
+    // the last one unmaps the file
+    if (g_aof_load.nloading.fetch_sub(1) == 1) {
+        (void)munmap((void *)g_aof_load.data, g_aof_load.size);
+        g_aof_load.data = NULL;
+        g_aof_load.cmds.clear();
+    }
+}
+
+// the event loop of one reactor thread
+static void *reactor_run(void *arg) {
+    g_data.shard_id = (size_t)arg;
+    int fd = listen_on(g_port);
+    Shard *shard = g_shards[g_data.shard_id];
+    int efd = shard->efd;
 
     // some initializations
     dlist_init(&g_data.idle_list);
-    thread_pool_init(&g_data.tp, 4);
+    clock_refresh();
+#ifdef TTL_WHEEL
+    tw_init(&g_data.wheel, g_data.now_us / 1000);
+#endif
+    shard->db = &g_data.db;
+#ifndef TTL_WHEEL
+    shard->heap = &g_data.heap;
+#endif
+    aof_load();
+    snapshot_load();
+
+    if (g_use_uring) {
+        uring_run(fd, efd);
+        return NULL;
+    }
+
+    // the listening fd and the mailbox are registered once; connections
+    // are added in accept_new_conn() and removed in conn_done().
+    g_data.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (g_data.epfd < 0) {
+        die("epoll_create1()");
+    }
+    epoll_watch(fd);
+    epoll_watch(efd);
 
     // the event loop
-    std::vector<struct pollfd> poll_args;
+    const size_t k_max_events = 1024;
+    std::vector<struct epoll_event> events(k_max_events);
     while (true) {
-        // prepare the arguments of the poll()
-        poll_args.clear();
-        // for convenience, the listening fd is put in the first position
-        struct pollfd pfd = {fd, POLLIN, 0};
-        poll_args.push_back(pfd);
-        // connection fds
-        for (Conn *conn : g_data.fd2conn) {
-            if (!conn) {
-                continue;
-            }
-            struct pollfd pfd = {};
-            pfd.fd = conn->fd;
-            pfd.events = (conn->state == STATE_REQ) ? POLLIN : POLLOUT;
-            pfd.events = pfd.events | POLLERR;
-            poll_args.push_back(pfd);
-        }
-
-        // poll for active fds
+        // wait for active fds
         int timeout_ms = (int)next_timer_ms();
-        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), timeout_ms);
+        int rv = epoll_wait(
+            g_data.epfd, events.data(), (int)events.size(), timeout_ms);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
         if (rv < 0) {
-            die("poll");
+            die("epoll_wait");
         }
+        clock_refresh();
 
         // process active connections
-        for (size_t i = 1; i < poll_args.size(); ++i) {
-            if (poll_args[i].revents) {
-                Conn *conn = g_data.fd2conn[poll_args[i].fd];
-                connection_io(conn);
-                if (conn->state == STATE_END) {
-                    // client closed normally, or something bad happened.
-                    // destroy this connection
-                    conn_done(conn);
-                }
+        bool listen_ready = false;
+        bool inbox_ready = false;
+        for (int i = 0; i < rv; ++i) {
+            int cfd = events[i].data.fd;
+            if (cfd == fd) {
+                listen_ready = true;
+                continue;
+            }
+            if (cfd == efd) {
+                inbox_ready = true;
+                continue;
+            }
+            Conn *conn = g_data.fd2conn[cfd];
+            connection_io(conn);
+            if (conn->state == STATE_END) {
+                // client closed normally, or something bad happened.
+                // destroy this connection
+                conn_done(conn);
+            } else {
+                conn_trim(conn);
+                conn_rewatch(conn);
             }
         }
 
+        // handle requests and replies from other shards
+        if (inbox_ready) {
+            shard_drain();
+        }
+
         // handle timers
         process_timers();
+        // the values deleted in this iteration
+        lazyfree_flush();
+        // the commands of this iteration
+        aof_commit();
 
         // try to accept a new connection if the listening fd is active
-        if (poll_args[0].revents) {
+        if (listen_ready) {
             (void)accept_new_conn(fd);
         }
     }
 
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "usage: %s [--reactors N] [--io epoll|uring] [--max-msg BYTES]"
+        " [--precise-ttl] [--snapshot PATH] [--appendonly PATH]"
+        " [--appendfsync always|everysec|no] [--aof-rewrite-min BYTES]"
+        " [--port N] [--repl-listen PATH] [--repl-backlog BYTES]"
+        " [--replicaof PATH]\n",
+        prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    size_t nreactors = 1;
+    const char *primary = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (0 == strcmp(argv[i], "--reactors") && i + 1 < argc) {
+            nreactors = (size_t)atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--io") && i + 1 < argc) {
+            const char *io = argv[++i];
+            if (0 == strcmp(io, "uring")) {
+                g_use_uring = true;
+            } else if (0 != strcmp(io, "epoll")) {
+                usage(argv[0]);
+            }
+        } else if (0 == strcmp(argv[i], "--max-msg") && i + 1 < argc) {
+            g_max_msg = (size_t)strtoull(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "--precise-ttl")) {
+            g_precise_ttl = true;
+        } else if (0 == strcmp(argv[i], "--snapshot") && i + 1 < argc) {
+            g_snap_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "--appendonly") && i + 1 < argc) {
+            g_aof_conf.path = argv[++i];
+        } else if (0 == strcmp(argv[i], "--appendfsync") && i + 1 < argc) {
+            const char *policy = argv[++i];
+            if (0 == strcmp(policy, "always")) {
+                g_aof_conf.policy = AOF_ALWAYS;
+            } else if (0 == strcmp(policy, "everysec")) {
+                g_aof_conf.policy = AOF_EVERYSEC;
+            } else if (0 == strcmp(policy, "no")) {
+                g_aof_conf.policy = AOF_NO;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (0 == strcmp(argv[i], "--aof-rewrite-min") && i + 1 < argc) {
+            // 0 disables the automatic rewrite
+            g_aof_conf.rewrite_min = strtoull(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "--port") && i + 1 < argc) {
+            g_port = (uint16_t)atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--repl-listen") && i + 1 < argc) {
+            g_repl_conf.listen_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "--repl-backlog") && i + 1 < argc) {
+            g_repl_conf.backlog = (size_t)strtoull(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "--replicaof") && i + 1 < argc) {
+            primary = argv[++i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    // the length prefix of the protocol is 32-bit
+    if (nreactors < 1 || g_max_msg < 1 || g_max_msg > UINT32_MAX - 4
+        || g_port == 0 || g_repl_conf.backlog < 1)
+    {
+        usage(argv[0]);
+    }
+    // a dead follower must not kill the primary
+    signal(SIGPIPE, SIG_IGN);
+
+    // a random hash seed per process, shared by all shards
+    ssize_t rv = getrandom(&g_hash_seed, sizeof(g_hash_seed), 0);
+    if (rv != (ssize_t)sizeof(g_hash_seed)) {
+        die("getrandom()");
+    }
+
+    clock_calibrate();
+    // lazy-free and snapshot loading, a thread per core
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    thread_pool_init(&g_tp, (size_t)std::max(ncpu, 4L));
+
+    // refuse to start from a corrupted snapshot
+    int snap_rv = snap_open(&g_load.r, g_snap_path, true);
+    if (snap_rv < 0) {
+        fprintf(stderr, "bad snapshot: %s\n", g_snap_path);
+        exit(1);
+    }
+    struct stat aof_st;
+    if (g_aof_conf.path && stat(g_aof_conf.path, &aof_st) == 0
+        && aof_st.st_size > 0)
+    {
+        // the AOF has everything the snapshot has, and more
+        snap_close(&g_load.r);
+    } else if (g_aof_conf.path && g_load.r.data) {
+        // a new AOF starts from the snapshot
+        g_aof_load.rewrite = true;
+    }
+
+    // one shard of the keyspace per reactor
+    for (size_t i = 0; i < nreactors; ++i) {
+        Shard *shard = new Shard();
+        pthread_mutex_init(&shard->mu, NULL);
+        shard->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (shard->efd < 0) {
+            die("eventfd()");
+        }
+        g_shards.push_back(shard);
+    }
+    if (g_aof_conf.path) {
+        g_aof_load.data = aof_open(&aof_scan, &snapshot_done, &g_aof_load.size);
+        g_aof_load.nloading = g_shards.size();
+    }
+    if (g_load.r.data) {
+        snapshot_scan_all();
+    }
+    g_repl_conf.max_msg = g_max_msg;
+    g_repl_conf.nshards = g_shards.size();
+    g_repl_conf.sync_claim = &repl_sync_claim;
+    g_repl_conf.sync_start = &repl_sync_start;
+    g_repl_conf.route = &repl_route;
+    g_repl_conf.apply = &repl_post;
+    if (g_repl_conf.listen_path) {
+        repl_listen();
+    }
+    if (primary) {
+        repl_start(primary);
+    }
+
+    // the main thread runs reactor 0
+    std::vector<pthread_t> threads(nreactors);
+    for (size_t i = 1; i < nreactors; ++i) {
+        int rv = pthread_create(&threads[i], NULL, &reactor_run, (void *)i);
+        if (rv) {
+            errno = rv;
+            die("pthread_create()");
+        }
+    }
+    reactor_run((void *)0);
     return 0;
 }
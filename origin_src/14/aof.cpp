@@ -0,0 +1,364 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include "aof.h"
+
+
+// a reactor holding replies until the AOF is synced up to `seq`
+struct AofWaiter {
+    int efd = -1;
+    uint64_t seq = 0;
+};
+
+static struct {
+    int fd = -1;
+    void (*on_rewrite)() = NULL;    // see aof_open()
+    pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t has_data = PTHREAD_COND_INITIALIZER;
+    std::string pending;
+    uint64_t submitted = 0;     // the bytes handed to the writer
+    uint64_t synced = 0;        // written, and on disk if AOF_ALWAYS
+    // the reactors to wake up, see aof_synced()
+    std::vector<AofWaiter> waiters;
+    // the rewrite
+    bool rewriting = false;     // the commands are also kept in rewrite_buf
+    bool rewrite_done = false;  // the child is done, the writer takes over
+    std::string rewrite_buf;    // the commands after the fork
+    // the file size, a rewrite starts when it has doubled since the last
+    std::atomic<uint64_t> size{0};
+    std::atomic<uint64_t> base_size{0};
+    // stats
+    std::atomic<uint64_t> nwrites{0};
+    std::atomic<uint64_t> nsyncs{0};
+    std::atomic<uint64_t> nrewrites{0};
+} g_aof;
+
+static void msg(const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+}
+
+static void die(const char *msg) {
+    int err = errno;
+    fprintf(stderr, "[%d] %s\n", err, msg);
+    abort();
+}
+
+static uint64_t get_monotonic_usec() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+static bool write_all(int fd, const char *data, size_t n) {
+    while (n > 0) {
+        ssize_t rv = write(fd, data, n);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        data += rv;
+        n -= (size_t)rv;
+    }
+    return true;
+}
+
+void aof_append_req(std::string &out, const std::string_view *args, size_t n) {
+    uint32_t len = 4;
+    for (size_t i = 0; i < n; ++i) {
+        len += 4 + (uint32_t)args[i].size();
+    }
+    out.append((char *)&len, 4);
+    uint32_t nstr = (uint32_t)n;
+    out.append((char *)&nstr, 4);
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t sz = (uint32_t)args[i].size();
+        out.append((char *)&sz, 4);
+        out.append(args[i]);
+    }
+}
+
+int32_t parse_req(
+    const uint8_t *data, size_t len, std::vector<std::string_view> &out)
+{
+    out.clear();
+    if (len < 4) {
+        return -1;
+    }
+    uint32_t n = 0;
+    memcpy(&n, &data[0], 4);
+    if (n > k_max_args) {
+        return -1;
+    }
+
+    size_t pos = 4;
+    while (n--) {
+        if (pos + 4 > len) {
+            return -1;
+        }
+        uint32_t sz = 0;
+        memcpy(&sz, &data[pos], 4);
+        if (pos + 4 + sz > len) {
+            return -1;
+        }
+        out.push_back(std::string_view((char *)&data[pos + 4], sz));
+        pos += 4 + sz;
+    }
+
+    if (pos != len) {
+        return -1;  // trailing garbage
+    }
+    return 0;
+}
+
+uint64_t aof_append(const std::string &buf) {
+    pthread_mutex_lock(&g_aof.mu);
+    g_aof.pending.append(buf);
+    if (g_aof.rewriting) {
+        g_aof.rewrite_buf.append(buf);
+    }
+    g_aof.submitted += buf.size();
+    uint64_t seq = g_aof.submitted;
+    pthread_cond_signal(&g_aof.has_data);
+    pthread_mutex_unlock(&g_aof.mu);
+    return seq;
+}
+
+uint64_t aof_synced(uint64_t wait, int efd) {
+    pthread_mutex_lock(&g_aof.mu);
+    uint64_t synced = g_aof.synced;
+    std::vector<AofWaiter> &v = g_aof.waiters;
+    size_t i = 0;
+    while (i < v.size() && v[i].efd != efd) {
+        i++;
+    }
+    if (i < v.size()) {
+        v[i] = v.back();
+        v.pop_back();
+    }
+    if (wait > synced) {
+        v.push_back(AofWaiter{efd, wait});
+    }
+    pthread_mutex_unlock(&g_aof.mu);
+    return synced;
+}
+
+std::string aof_rewrite_path() {
+    return std::string(g_aof_conf.path) + ".rewrite";
+}
+
+// the commands after the fork are kept for the new file
+void aof_rewrite_begin() {
+    pthread_mutex_lock(&g_aof.mu);
+    g_aof.rewriting = true;
+    g_aof.rewrite_buf.clear();
+    pthread_mutex_unlock(&g_aof.mu);
+}
+
+void aof_rewrite_end(bool ok) {
+    pthread_mutex_lock(&g_aof.mu);
+    if (ok) {
+        g_aof.rewrite_done = true;
+        pthread_cond_signal(&g_aof.has_data);
+    } else {
+        g_aof.rewriting = false;
+        g_aof.rewrite_buf.clear();
+    }
+    pthread_mutex_unlock(&g_aof.mu);
+    if (!ok) {
+        msg("AOF rewrite failed");
+        (void)unlink(aof_rewrite_path().c_str());
+        g_aof.base_size = g_aof.size.load();    // don't retry at once
+        g_aof.on_rewrite();
+    }
+}
+
+bool aof_rewrite_due() {
+    uint64_t size = g_aof.size.load();
+    return g_aof_conf.rewrite_min > 0 && size >= g_aof_conf.rewrite_min
+        && size >= 2 * g_aof.base_size.load();
+}
+
+void aof_stats(AofStats *st) {
+    pthread_mutex_lock(&g_aof.mu);
+    st->submitted = g_aof.submitted;
+    st->synced = g_aof.synced;
+    pthread_mutex_unlock(&g_aof.mu);
+    st->nwrites = g_aof.nwrites.load();
+    st->nsyncs = g_aof.nsyncs.load();
+    st->size = g_aof.size.load();
+    st->nrewrites = g_aof.nrewrites.load();
+}
+
+// in the writer thread: append the commands since the fork to the
+// rewritten file, and replace the AOF with it
+static bool aof_rewrite_finish(const std::string &tail) {
+    std::string tmp = aof_rewrite_path();
+    int fd = open(tmp.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    struct stat st;
+    bool ok = fd >= 0 && write_all(fd, tail.data(), tail.size())
+        && fdatasync(fd) == 0 && fstat(fd, &st) == 0
+        && rename(tmp.c_str(), g_aof_conf.path) == 0;
+    if (!ok) {
+        msg("AOF rewrite failed");
+        if (fd >= 0) {
+            (void)close(fd);
+        }
+        (void)unlink(tmp.c_str());
+        g_aof.base_size = g_aof.size.load();    // don't retry at once
+        return false;
+    }
+    (void)close(g_aof.fd);
+    g_aof.fd = fd;
+    g_aof.size = (uint64_t)st.st_size;
+    g_aof.base_size = (uint64_t)st.st_size;
+    g_aof.nrewrites++;
+    return true;
+}
+
+static void *aof_writer(void *) {
+    std::string buf;
+    std::string tail;       // the end of a rewritten file
+    uint64_t last_sync_us = get_monotonic_usec();
+    bool dirty = false;     // written but not synced
+    int policy = g_aof_conf.policy;
+    while (true) {
+        pthread_mutex_lock(&g_aof.mu);
+        if (g_aof.pending.empty() && !g_aof.rewrite_done) {
+            if (dirty && policy == AOF_EVERYSEC) {
+                // sync the end of a burst a second later
+                timespec ts = {0, 0};
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec += 1;
+                pthread_cond_timedwait(&g_aof.has_data, &g_aof.mu, &ts);
+            } else {
+                pthread_cond_wait(&g_aof.has_data, &g_aof.mu);
+            }
+        }
+        buf.swap(g_aof.pending);
+        uint64_t upto = g_aof.submitted;
+        // `tail` has everything since the fork, including `buf`
+        bool rewrite = g_aof.rewrite_done;
+        if (rewrite) {
+            tail.swap(g_aof.rewrite_buf);
+            g_aof.rewriting = false;
+            g_aof.rewrite_done = false;
+        }
+        pthread_mutex_unlock(&g_aof.mu);
+
+        if (!buf.empty()) {
+            if (!write_all(g_aof.fd, buf.data(), buf.size())) {
+                die("write() to the AOF");
+            }
+            g_aof.nwrites++;
+            g_aof.size += buf.size();
+            dirty = true;
+            buf.clear();
+        }
+        if (rewrite) {
+            if (aof_rewrite_finish(tail)) {
+                dirty = false;  // synced
+            }
+            tail.clear();
+            tail.shrink_to_fit();
+            g_aof.on_rewrite();
+        }
+        uint64_t now_us = get_monotonic_usec();
+        bool sync = policy == AOF_ALWAYS
+            || (policy == AOF_EVERYSEC && now_us - last_sync_us >= 1000 * 1000);
+        if (dirty && sync) {
+            if (fdatasync(g_aof.fd) != 0) {
+                die("fdatasync() of the AOF");
+            }
+            g_aof.nsyncs++;
+            last_sync_us = now_us;
+            dirty = false;
+        }
+
+        pthread_mutex_lock(&g_aof.mu);
+        g_aof.synced = upto;
+        // wake up the reactors holding replies
+        std::vector<AofWaiter> &v = g_aof.waiters;
+        for (size_t i = 0; i < v.size(); ) {
+            if (v[i].seq > upto) {
+                i++;
+                continue;
+            }
+            uint64_t one = 1;
+            ssize_t rv = write(v[i].efd, &one, sizeof(one));
+            (void)rv;
+            v[i] = v.back();
+            v.pop_back();
+        }
+        pthread_mutex_unlock(&g_aof.mu);
+    }
+    return NULL;
+}
+
+const uint8_t *aof_open(
+    size_t (*scan)(const uint8_t *data, size_t size),
+    void (*rewrite_done)(), size_t *map_size)
+{
+    int flags = O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC;
+    int fd = open(g_aof_conf.path, flags, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        die("open() of the AOF");
+    }
+    uint64_t start_us = get_monotonic_usec();
+    size_t size = (size_t)st.st_size;
+    size_t valid = 0;
+    const uint8_t *data = NULL;
+    if (size > 0) {
+        void *ptr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED) {
+            die("mmap() of the AOF");
+        }
+        (void)madvise(ptr, size, MADV_SEQUENTIAL);
+        data = (const uint8_t *)ptr;
+        valid = scan(data, size);
+        fprintf(stderr, "AOF: scanned %zu bytes in %.0f ms\n", valid,
+            (double)(get_monotonic_usec() - start_us) / 1000);
+    }
+    if (valid < size) {
+        // a crash leaves a request cut short by the end of the file.
+        // anything else is corruption, the commands after it are kept.
+        uint32_t len = 0;
+        if (size - valid >= 4) {
+            memcpy(&len, &data[valid], 4);
+        }
+        if (size - valid >= 4 && len <= size - valid - 4) {
+            fprintf(stderr, "bad AOF: %s: a corrupted request at offset %zu\n",
+                g_aof_conf.path, valid);
+            exit(1);
+        }
+        fprintf(stderr, "AOF: dropping %zu bytes of a partial request\n",
+            size - valid);
+        if (ftruncate(fd, (off_t)valid) != 0) {
+            die("ftruncate() of the AOF");
+        }
+    }
+    g_aof.fd = fd;
+    g_aof.on_rewrite = rewrite_done;
+    g_aof.size = valid;
+    g_aof.base_size = valid;
+    (void)unlink(aof_rewrite_path().c_str());   // an unfinished rewrite
+
+    pthread_t thread;
+    int rv = pthread_create(&thread, NULL, &aof_writer, NULL);
+    if (rv) {
+        errno = rv;
+        die("pthread_create()");
+    }
+    *map_size = size;
+    return data;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+// the append-only log of write commands, in the request format. the
+// reactors collect the commands of a loop iteration and hand them over
+// with aof_append() at the end of the iteration. the writer thread then
+// writes everything pending with a single write() and fdatasync(),
+// which is shared by all the reactors (group commit).
+enum {
+    AOF_NO = 0,         // write(), the kernel flushes it eventually
+    AOF_EVERYSEC = 1,   // fdatasync() at most once per second
+    AOF_ALWAYS = 2,     // fdatasync() before replying
+};
+
+// set by main() before aof_open()
+struct AofConfig {
+    const char *path = NULL;    // NULL if disabled, see --appendonly
+    int policy = AOF_EVERYSEC;
+    // a rewrite starts when the file has doubled since the last one and
+    // is at least this big, 0 disables it. see --aof-rewrite-min
+    uint64_t rewrite_min = 64 << 20;
+};
+
+inline AofConfig g_aof_conf;
+
+// a request: u32 len, u32 nstr, nstr * (u32 len, bytes)
+const size_t k_max_args = 1024;
+
+void aof_append_req(std::string &out, const std::string_view *args, size_t n);
+// the request without its length prefix, 0 if well-formed
+int32_t parse_req(
+    const uint8_t *data, size_t len, std::vector<std::string_view> &out);
+
+// check the AOF and cut off a partial request at the end, then open it
+// for appending and start the writer. `scan` returns the size of the
+// valid requests at the start, the process exits if a bad one is
+// followed by more data. the file is returned mapped for the replay,
+// NULL if empty. `rewrite_done` is called when a rewrite is over.
+const uint8_t *aof_open(
+    size_t (*scan)(const uint8_t *data, size_t size),
+    void (*rewrite_done)(), size_t *map_size);
+// hand the commands of an iteration to the writer, returns their end
+uint64_t aof_append(const std::string &buf);
+// the end of the commands synced, or written unless AOF_ALWAYS. if it's
+// before `wait`, the writer writes to the eventfd `efd` once it's not.
+// 0 cancels the wakeup.
+uint64_t aof_synced(uint64_t wait, int efd);
+
+// the rewrite: a child writes the keyspace to aof_rewrite_path(), the
+// commands appended from aof_rewrite_begin() on are added to it
+std::string aof_rewrite_path();
+void aof_rewrite_begin();
+// the child has exited. the writer replaces the AOF if `ok`.
+void aof_rewrite_end(bool ok);
+// the file has grown enough for a rewrite
+bool aof_rewrite_due();
+
+struct AofStats {
+    uint64_t submitted = 0;
+    uint64_t synced = 0;
+    uint64_t nwrites = 0;
+    uint64_t nsyncs = 0;
+    uint64_t size = 0;
+    uint64_t nrewrites = 0;
+};
+
+void aof_stats(AofStats *st);
@@ -21,3 +21,4 @@ inline void avl_init(AVLNode *node) {
 AVLNode *avl_fix(AVLNode *node);
 AVLNode *avl_del(AVLNode *node);
 AVLNode *avl_offset(AVLNode *node, int64_t offset);
+int64_t avl_rank(AVLNode *node);
@@ -0,0 +1,113 @@
+// hash function benchmark: the old FNV variant vs the seeded wyhash.
+// usage: ./bench_hash
+// reports the hashing throughput for several key sizes, and the bucket
+// chain lengths of a power-of-2 table for sequential and crafted keys.
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "common.h"
+
+
+static uint64_t get_monotonic_usec() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+// the previous str_hash()
+static uint64_t fnv_hash(const uint8_t *data, size_t len) {
+    uint32_t h = 0x811C9DC5;
+    for (size_t i = 0; i < len; i++) {
+        h = (h + data[i]) * 0x01000193;
+    }
+    return h;
+}
+
+typedef uint64_t (*hash_fn)(const uint8_t *, size_t);
+
+static void bench_speed(const char *name, hash_fn fn) {
+    const size_t sizes[] = {8, 16, 32, 64, 256, 4096};
+    std::vector<uint8_t> buf(4096 + 64);
+    for (size_t i = 0; i < buf.size(); ++i) {
+        buf[i] = (uint8_t)(i * 131 + 7);
+    }
+    printf("%-6s", name);
+    for (size_t len : sizes) {
+        size_t total = (size_t)256 << 20;   // bytes hashed per size
+        size_t n = total / len;
+        uint64_t sink = 0;
+        uint64_t t0 = get_monotonic_usec();
+        for (size_t i = 0; i < n; ++i) {
+            // vary the input so the calls can't be hoisted
+            sink += fn(&buf[i & 63], len);
+        }
+        uint64_t us = get_monotonic_usec() - t0 + 1;
+        printf("  %4zuB: %7.0f MB/s %6.1f ns", len,
+            (double)total / us, us * 1000.0 / n);
+        if (sink == 42) {
+            printf("!");
+        }
+    }
+    printf("\n");
+}
+
+// the chain lengths of a table with `nslots` buckets
+static void report_chains(
+    const char *name, hash_fn fn,
+    const std::vector<std::string> &keys, size_t nslots)
+{
+    std::vector<uint32_t> cnt(nslots);
+    for (const std::string &k : keys) {
+        cnt[fn((uint8_t *)k.data(), k.size()) & (nslots - 1)]++;
+    }
+    uint32_t max = 0;
+    size_t empty = 0;
+    double probes = 0;  // the average chain length seen by a lookup
+    for (uint32_t c : cnt) {
+        max = c > max ? c : max;
+        empty += (c == 0);
+        probes += (double)c * c;
+    }
+    printf("  %-6s max=%-6u empty=%5.1f%% avg_chain=%.2f\n",
+        name, max, 100.0 * empty / nslots, probes / keys.size());
+}
+
+static uint64_t seeded_hash(const uint8_t *data, size_t len) {
+    return str_hash(data, len);
+}
+
+int main() {
+    g_hash_seed = ((uint64_t)time(NULL) << 32) ^ (uint64_t)clock();
+
+    printf("throughput:\n");
+    bench_speed("fnv", fnv_hash);
+    bench_speed("wyhash", seeded_hash);
+
+    const size_t nslots = 1 << 16;
+    std::vector<std::string> keys;
+    char tmp[64];
+    for (size_t i = 0; i < nslots; ++i) {
+        snprintf(tmp, sizeof(tmp), "user:%zu", i);
+        keys.push_back(tmp);
+    }
+    printf("sequential keys (%zu keys, %zu slots):\n", keys.size(), nslots);
+    report_chains("fnv", fnv_hash, keys, nslots);
+    report_chains("wyhash", seeded_hash, keys, nslots);
+
+    // keys crafted offline against the unseeded FNV to share bucket 0
+    keys.clear();
+    for (size_t i = 0; keys.size() < 1000; ++i) {
+        snprintf(tmp, sizeof(tmp), "flood:%zu", i);
+        if ((fnv_hash((uint8_t *)tmp, strlen(tmp)) & (nslots - 1)) == 0) {
+            keys.push_back(tmp);
+        }
+    }
+    printf("crafted keys (%zu keys, %zu slots):\n", keys.size(), nslots);
+    report_chains("fnv", fnv_hash, keys, nslots);
+    report_chains("wyhash", seeded_hash, keys, nslots);
+    return 0;
+}
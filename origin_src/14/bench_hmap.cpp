@@ -0,0 +1,123 @@
+// HMap benchmark, build it once for each engine and compare:
+//   g++ -O2 -std=gnu++17 bench_hmap.cpp hashtable*.cpp -o bench_chain
+//   g++ -O2 -std=gnu++17 -DHMAP_SWISS bench_hmap.cpp hashtable*.cpp -o bench_swiss
+// usage: ./bench_xxx [nkeys]
+// the keys look like the ones of a typical cache: "user:<id>:session".
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "hashtable.h"
+#include "common.h"
+
+
+static uint64_t get_monotonic_nsec() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+struct Item {
+    HNode node;
+    std::string key;
+};
+
+struct LookupKey {
+    HNode node;
+    const std::string *key;
+};
+
+static bool item_eq(HNode *node, HNode *key) {
+    Item *item = container_of(node, Item, node);
+    LookupKey *lk = container_of(key, LookupKey, node);
+    return node->hcode == key->hcode && item->key == *lk->key;
+}
+
+static void lookup_key_init(LookupKey *lk, const std::string &key) {
+    lk->key = &key;
+    lk->node.hcode = str_hash((uint8_t *)key.data(), key.size());
+}
+
+static void report(const char *name, uint64_t t0, size_t n) {
+    double ns = (double)(get_monotonic_nsec() - t0) / n;
+    printf("  %-8s %7.1f ns/op\n", name, ns);
+}
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? (size_t)atol(argv[1]) : 2000000;
+#ifdef HMAP_SWISS
+    printf("engine: swiss, %zu keys\n", n);
+#else
+    printf("engine: chaining, %zu keys\n", n);
+#endif
+    g_hash_seed = 0x1234;
+
+    std::vector<Item *> items(n);
+    std::vector<std::string> misses(n);
+    char tmp[64];
+    for (size_t i = 0; i < n; ++i) {
+        // visit the keys in a random order
+        size_t id = (i * 2654435761u) % (n * 7);
+        snprintf(tmp, sizeof(tmp), "user:%zu:session", id);
+        items[i] = new Item();
+        items[i]->key = tmp;
+        items[i]->node.hcode = str_hash((uint8_t *)tmp, strlen(tmp));
+        snprintf(tmp, sizeof(tmp), "user:%zu:miss", id);
+        misses[i] = tmp;
+    }
+
+    HMap map;
+    // insert, and track the worst case caused by resizing
+    uint64_t worst = 0;
+    uint64_t t0 = get_monotonic_nsec();
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t t = get_monotonic_nsec();
+        hm_insert(&map, &items[i]->node);
+        t = get_monotonic_nsec() - t;
+        worst = t > worst ? t : worst;
+    }
+    report("insert", t0, n);
+    printf("  %-8s %7.1f us\n", "worst", worst / 1000.0);
+    assert(hm_size(&map) == n);
+
+    t0 = get_monotonic_nsec();
+    for (size_t i = 0; i < n; ++i) {
+        LookupKey lk;
+        lookup_key_init(&lk, items[(i * 7919) % n]->key);
+        HNode *node = hm_lookup(&map, &lk.node, &item_eq);
+        assert(node);
+        (void)node;
+    }
+    report("hit", t0, n);
+
+    t0 = get_monotonic_nsec();
+    for (size_t i = 0; i < n; ++i) {
+        LookupKey lk;
+        lookup_key_init(&lk, misses[i]);
+        HNode *node = hm_lookup(&map, &lk.node, &item_eq);
+        assert(!node);
+        (void)node;
+    }
+    report("miss", t0, n);
+
+    t0 = get_monotonic_nsec();
+    for (size_t i = 0; i < n; ++i) {
+        LookupKey lk;
+        lookup_key_init(&lk, items[i]->key);
+        HNode *node = hm_pop(&map, &lk.node, &item_eq);
+        assert(node == &items[i]->node);
+        (void)node;
+    }
+    report("delete", t0, n);
+    assert(hm_size(&map) == 0);
+
+    hm_destroy(&map);
+    for (Item *item : items) {
+        delete item;
+    }
+    return 0;
+}
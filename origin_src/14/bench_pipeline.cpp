@@ -0,0 +1,147 @@
+// pipelined throughput benchmark.
+// usage: ./bench_pipeline [depth] [rounds] [nconns] [get|set]
+// each round writes `depth` small GET requests in a single write()
+// on every connection, then reads back the responses of the previous round.
+// `set` sends SET requests instead, for the cost of the AOF.
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <vector>
+
+
+static void die(const char *msg) {
+    int err = errno;
+    fprintf(stderr, "[%d] %s\n", err, msg);
+    abort();
+}
+
+static uint64_t get_monotonic_usec() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+static int32_t read_full(int fd, char *buf, size_t n) {
+    while (n > 0) {
+        ssize_t rv = read(fd, buf, n);
+        if (rv <= 0) {
+            return -1;  // error, or unexpected EOF
+        }
+        assert((size_t)rv <= n);
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return 0;
+}
+
+static int32_t write_all(int fd, const char *buf, size_t n) {
+    while (n > 0) {
+        ssize_t rv = write(fd, buf, n);
+        if (rv <= 0) {
+            return -1;  // error
+        }
+        assert((size_t)rv <= n);
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return 0;
+}
+
+static void append_req(std::string &out, const std::vector<std::string> &cmd) {
+    uint32_t len = 4;
+    for (const std::string &s : cmd) {
+        len += 4 + s.size();
+    }
+    out.append((char *)&len, 4);
+    uint32_t n = cmd.size();
+    out.append((char *)&n, 4);
+    for (const std::string &s : cmd) {
+        uint32_t p = (uint32_t)s.size();
+        out.append((char *)&p, 4);
+        out.append(s);
+    }
+}
+
+static int connect_server() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = ntohs(1234);
+    addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK);  // 127.0.0.1
+    if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr))) {
+        die("connect");
+    }
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    size_t depth = argc > 1 ? (size_t)atoi(argv[1]) : 200;
+    size_t rounds = argc > 2 ? (size_t)atoi(argv[2]) : 2000;
+    size_t nconns = argc > 3 ? (size_t)atoi(argv[3]) : 1;
+    bool is_set = argc > 4 && 0 == strcmp(argv[4], "set");
+
+    std::vector<int> fds;
+    for (size_t i = 0; i < nconns; ++i) {
+        fds.push_back(connect_server());
+    }
+
+    std::string batch;
+    for (size_t i = 0; i < depth; ++i) {
+        if (is_set) {
+            append_req(batch, {"set", "k" + std::to_string(i), "v"});
+        } else {
+            append_req(batch, {"get", "k"});
+        }
+    }
+
+    std::vector<char> rbuf(64 * 1024);
+    uint64_t start = get_monotonic_usec();
+    for (size_t r = 0; r <= rounds; ++r) {
+        // keep the next batch in flight while reading the current one,
+        // so the connection never sits idle waiting for delayed ACKs.
+        for (int fd : fds) {
+            if (r < rounds && write_all(fd, batch.data(), batch.size())) {
+                die("write()");
+            }
+        }
+        for (int fd : fds) {
+            for (size_t i = 0; r > 0 && i < depth; ++i) {
+                // ACK at once, or Nagle on the server side holds back
+                // the responses until our delayed ACK fires.
+                int val = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &val, sizeof(val));
+                uint32_t len = 0;
+                if (read_full(fd, (char *)&len, 4)) {
+                    die("read()");
+                }
+                if (len > rbuf.size() || read_full(fd, rbuf.data(), len)) {
+                    die("read()");
+                }
+            }
+        }
+    }
+    uint64_t usec = get_monotonic_usec() - start;
+
+    double nreq = (double)depth * rounds * nconns;
+    printf("%s depth=%zu rounds=%zu conns=%zu: %.0f req/s\n",
+        is_set ? "set" : "get", depth, rounds, nconns,
+        nreq * 1e6 / (double)usec);
+
+    for (int fd : fds) {
+        close(fd);
+    }
+    return 0;
+}
@@ -0,0 +1,90 @@
+// slab allocator benchmark against malloc, with a churn workload
+// like SET/DEL and ZADD/ZREM: a working set of small objects of
+// mixed sizes, randomly freed and replaced.
+// usage: ./bench_slab [nobjs] [nops]
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <vector>
+#include "slab.h"
+
+
+static uint64_t get_monotonic_nsec() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static uint64_t rss_kb() {
+    FILE *fp = fopen("/proc/self/statm", "r");
+    unsigned long size = 0, rss = 0;
+    if (fp) {
+        if (fscanf(fp, "%lu %lu", &size, &rss) != 2) {
+            rss = 0;
+        }
+        fclose(fp);
+    }
+    return rss * 4;
+}
+
+struct Obj {
+    void *ptr = NULL;
+    size_t size = 0;
+};
+
+// Entry-like and ZNode-like sizes
+static size_t rand_size(uint64_t &seed) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    return 48 + (seed >> 33) % 128;
+}
+
+template <class Alloc, class Free>
+static void run(
+    const char *name, size_t nobjs, size_t nops, Alloc alloc, Free dealloc)
+{
+    uint64_t rss0 = rss_kb();
+    std::vector<Obj> objs(nobjs);
+    uint64_t seed = 1;
+    uint64_t t0 = get_monotonic_nsec();
+    for (Obj &o : objs) {
+        o.size = rand_size(seed);
+        o.ptr = alloc(o.size);
+        memset(o.ptr, 1, 8);
+    }
+    uint64_t t1 = get_monotonic_nsec();
+    for (size_t i = 0; i < nops; ++i) {
+        Obj &o = objs[(seed >> 20) % nobjs];
+        dealloc(o.ptr, o.size);
+        o.size = rand_size(seed);
+        o.ptr = alloc(o.size);
+        memset(o.ptr, 1, 8);
+    }
+    uint64_t t2 = get_monotonic_nsec();
+    uint64_t rss1 = rss_kb();
+    for (Obj &o : objs) {
+        dealloc(o.ptr, o.size);
+    }
+    printf("%-6s fill %5.1f ns/obj, churn %5.1f ns/op, rss +%lu MB\n",
+        name, (double)(t1 - t0) / nobjs, (double)(t2 - t1) / nops,
+        (unsigned long)((rss1 - rss0) / 1024));
+}
+
+int main(int argc, char **argv) {
+    size_t nobjs = argc > 1 ? (size_t)atol(argv[1]) : 1000000;
+    size_t nops = argc > 2 ? (size_t)atol(argv[2]) : 10000000;
+    printf("%zu objects, %zu ops\n", nobjs, nops);
+
+    run("slab", nobjs, nops,
+        [](size_t sz) { return slab_alloc(sz); },
+        [](void *p, size_t sz) { slab_free(p, sz); });
+    SlabStats st;
+    slab_stats(&st);
+    printf("       slab pages left: %zu, live objs: %zu\n", st.pages, st.objs);
+
+    run("malloc", nobjs, nops,
+        [](size_t sz) { return malloc(sz); },
+        [](void *p, size_t) { free(p); });
+    return 0;
+}
@@ -0,0 +1,126 @@
+// TTL timers: the binary heap against the timing wheel.
+// an EXPIRE-heavy workload on keys that all have a TTL,
+// then all the keys expire.
+// usage: ./bench_ttl [nkeys] [nops]
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <vector>
+#include "heap.cpp"         // lazy
+#include "wheel.cpp"
+
+
+static uint64_t get_monotonic_nsec() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static uint64_t rng(uint64_t &seed) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    return seed >> 20;
+}
+
+// like Entry, the timer is embedded in the key
+struct Key {
+    size_t heap_idx = -1;
+    WTimer timer;
+};
+
+// TTLs from 1s to 1h
+static uint64_t rand_ttl(uint64_t &seed) {
+    return 1000 + rng(seed) % 3600000;
+}
+
+static void heap_set(std::vector<HeapItem> &heap, Key &key, uint64_t at) {
+    size_t pos = key.heap_idx;
+    if (pos == (size_t)-1) {
+        HeapItem item;
+        item.ref = &key.heap_idx;
+        heap.push_back(item);
+        pos = heap.size() - 1;
+    }
+    heap[pos].val = at;
+    heap_update(heap.data(), pos, heap.size());
+}
+
+static void heap_pop(std::vector<HeapItem> &heap) {
+    *heap[0].ref = -1;
+    heap[0] = heap.back();
+    heap.pop_back();
+    if (!heap.empty()) {
+        heap_update(heap.data(), 0, heap.size());
+    }
+}
+
+static void report(const char *name, uint64_t t[4], size_t n, size_t nops) {
+    printf("%-6s arm %5.1f ns, re-arm %5.1f ns, expire %5.1f ns\n", name,
+        (double)(t[1] - t[0]) / n, (double)(t[2] - t[1]) / nops,
+        (double)(t[3] - t[2]) / n);
+}
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? (size_t)atol(argv[1]) : 10000000;
+    size_t nops = argc > 2 ? (size_t)atol(argv[2]) : 10000000;
+    printf("%zu keys, %zu re-arms\n", n, nops);
+    const uint64_t k_end = 4000000;     // after all TTLs
+
+    {
+        std::vector<Key> keys(n);
+        std::vector<HeapItem> heap;
+        uint64_t seed = 1;
+        uint64_t t[4];
+        t[0] = get_monotonic_nsec();
+        for (Key &key : keys) {
+            heap_set(heap, key, rand_ttl(seed));
+        }
+        t[1] = get_monotonic_nsec();
+        for (size_t i = 0; i < nops; ++i) {
+            heap_set(heap, keys[rng(seed) % n], rand_ttl(seed));
+        }
+        t[2] = get_monotonic_nsec();
+        size_t cnt = 0;
+        for (uint64_t now = 0; now < k_end; now += 1000) {
+            while (!heap.empty() && heap[0].val <= now) {
+                heap_pop(heap);
+                cnt++;
+            }
+        }
+        t[3] = get_monotonic_nsec();
+        report("heap", t, n, nops);
+        if (cnt != n) {
+            return 1;
+        }
+    }
+
+    {
+        std::vector<Key> keys(n);
+        TimerWheel *tw = new TimerWheel();
+        tw_init(tw, 0);
+        uint64_t seed = 1;
+        uint64_t t[4];
+        t[0] = get_monotonic_nsec();
+        for (Key &key : keys) {
+            tw_add(tw, &key.timer, rand_ttl(seed));
+        }
+        t[1] = get_monotonic_nsec();
+        for (size_t i = 0; i < nops; ++i) {
+            tw_add(tw, &keys[rng(seed) % n].timer, rand_ttl(seed));
+        }
+        t[2] = get_monotonic_nsec();
+        size_t cnt = 0;
+        for (uint64_t now = 0; now < k_end; now += 1000) {
+            while (tw_pop(tw, now)) {
+                cnt++;
+            }
+        }
+        t[3] = get_monotonic_nsec();
+        report("wheel", t, n, nops);
+        delete tw;
+        if (cnt != n) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,83 @@
+// range query benchmark of the zset index, build it with each engine:
+//   g++ -O2 -std=gnu++17 bench_zset.cpp -lpthread
+//   g++ -O2 -std=gnu++17 -DZSET_BTREE bench_zset.cpp -lpthread
+// usage: ./bench_zset [nmembers] [nqueries] [range]
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "zset.cpp"         // lazy
+#include "btree.cpp"
+#include "avl.cpp"
+#include "hashtable.cpp"
+#include "hashtable_swiss.cpp"
+#include "slab.cpp"
+
+
+static uint64_t get_monotonic_nsec() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static uint64_t rng(uint64_t &seed) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    return seed >> 20;
+}
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? (size_t)atol(argv[1]) : 10000000;
+    size_t nq = argc > 2 ? (size_t)atol(argv[2]) : 1000000;
+    int64_t range = argc > 3 ? atol(argv[3]) : 10;
+#ifdef ZSET_BTREE
+    printf("btree, ");
+#else
+    printf("avl, ");
+#endif
+    printf("%zu members, %zu queries of %ld\n", n, nq, (long)range);
+
+    ZSet zset;
+    uint64_t seed = 1;
+    char name[32];
+    uint64_t t0 = get_monotonic_nsec();
+    for (size_t i = 0; i < n; ++i) {
+        int len = snprintf(name, sizeof(name), "m%zu", i);
+        zset_add(&zset, name, len, (double)(rng(seed) % n));
+    }
+    uint64_t t1 = get_monotonic_nsec();
+    printf("zadd       %6.1f ns/op\n", (double)(t1 - t0) / n);
+
+    // ZQUERY: seek to a score, then scan `range` members
+    uint64_t sum = 0;
+    t0 = get_monotonic_nsec();
+    for (size_t i = 0; i < nq; ++i) {
+        ZIter it;
+        zset_query(&zset, (double)(rng(seed) % n), "", 0, 0, &it);
+        for (int64_t j = 0; it.valid && j < range; ++j) {
+            sum += it.len;
+            zset_next(&it);
+        }
+    }
+    t1 = get_monotonic_nsec();
+    printf("seek+scan  %6.1f ns/op\n", (double)(t1 - t0) / nq);
+
+    // the same with a large offset, like deep pagination
+    t0 = get_monotonic_nsec();
+    for (size_t i = 0; i < nq; ++i) {
+        ZIter it;
+        int64_t offset = (int64_t)(rng(seed) % (n / 2));
+        zset_query(&zset, -1, "", 0, offset, &it);
+        for (int64_t j = 0; it.valid && j < range; ++j) {
+            sum += it.len;
+            zset_next(&it);
+        }
+    }
+    t1 = get_monotonic_nsec();
+    printf("offset     %6.1f ns/op\n", (double)(t1 - t0) / nq);
+
+    t0 = get_monotonic_nsec();
+    zset_dispose(&zset);
+    t1 = get_monotonic_nsec();
+    printf("dispose    %6.1f ns/op\n", (double)(t1 - t0) / n);
+    return sum == 0;
+}
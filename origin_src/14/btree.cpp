@@ -0,0 +1,441 @@
+#include <assert.h>
+#include <string.h>
+#include "btree.h"
+#include "zset.h"
+#include "common.h"
+
+
+// compare an item with the (score, name) tuple
+static int zcmp(
+    double iscore, ZNode *item, double score, const char *name, size_t len)
+{
+    if (iscore != score) {
+        return iscore < score ? -1 : 1;
+    }
+    int rv = memcmp(item->name, name, item->len < len ? item->len : len);
+    if (rv != 0) {
+        return rv;
+    }
+    return item->len < len ? -1 : (item->len > len ? 1 : 0);
+}
+
+static BLeaf *as_leaf(BNode *node) {
+    assert(node->leaf);
+    return container_of(node, BLeaf, hdr);
+}
+
+static BInner *as_inner(BNode *node) {
+    assert(!node->leaf);
+    return container_of(node, BInner, hdr);
+}
+
+static uint32_t node_size(BNode *node) {
+    if (node->leaf) {
+        return node->n;
+    }
+    BInner *in = as_inner(node);
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < node->n; ++i) {
+        total += in->cnt[i];
+    }
+    return total;
+}
+
+// the smallest item in the subtree
+static ZNode *node_first(BNode *node, double *score) {
+    if (node->n == 0) {
+        return NULL;
+    }
+    if (node->leaf) {
+        *score = as_leaf(node)->score[0];
+        return as_leaf(node)->item[0];
+    }
+    *score = as_inner(node)->score[0];
+    return as_inner(node)->first[0];
+}
+
+// the first index whose item is greater or equal to the tuple
+static uint32_t leaf_lower(
+    BLeaf *leaf, double score, const char *name, size_t len)
+{
+    uint32_t lo = 0, hi = leaf->hdr.n;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (zcmp(leaf->score[mid], leaf->item[mid], score, name, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// the last child whose first item is less or equal to the tuple, or 0
+static uint32_t inner_pick(
+    BInner *in, double score, const char *name, size_t len)
+{
+    uint32_t lo = 1, hi = in->hdr.n;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (zcmp(in->score[mid], in->first[mid], score, name, len) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+static void leaf_put(BLeaf *leaf, uint32_t pos, double score, ZNode *item) {
+    uint32_t n = leaf->hdr.n;
+    assert(pos <= n && n <= k_bt_cap);
+    memmove(&leaf->score[pos + 1], &leaf->score[pos], (n - pos) * 8);
+    memmove(&leaf->item[pos + 1], &leaf->item[pos], (n - pos) * 8);
+    leaf->score[pos] = score;
+    leaf->item[pos] = item;
+    leaf->hdr.n++;
+}
+
+static void leaf_remove(BLeaf *leaf, uint32_t pos) {
+    uint32_t n = leaf->hdr.n;
+    assert(pos < n);
+    memmove(&leaf->score[pos], &leaf->score[pos + 1], (n - pos - 1) * 8);
+    memmove(&leaf->item[pos], &leaf->item[pos + 1], (n - pos - 1) * 8);
+    leaf->hdr.n--;
+}
+
+// refresh the cached size and first item of a child
+static void inner_set(BInner *in, uint32_t i, BNode *child) {
+    in->child[i] = child;
+    in->cnt[i] = node_size(child);
+    in->first[i] = node_first(child, &in->score[i]);
+}
+
+static void inner_put(BInner *in, uint32_t pos, BNode *child) {
+    uint32_t n = in->hdr.n;
+    assert(pos <= n && n <= k_bt_cap);
+    memmove(&in->cnt[pos + 1], &in->cnt[pos], (n - pos) * 4);
+    memmove(&in->score[pos + 1], &in->score[pos], (n - pos) * 8);
+    memmove(&in->first[pos + 1], &in->first[pos], (n - pos) * 8);
+    memmove(&in->child[pos + 1], &in->child[pos], (n - pos) * 8);
+    in->hdr.n++;
+    inner_set(in, pos, child);
+}
+
+static void inner_remove(BInner *in, uint32_t pos) {
+    uint32_t n = in->hdr.n;
+    assert(pos < n);
+    memmove(&in->cnt[pos], &in->cnt[pos + 1], (n - pos - 1) * 4);
+    memmove(&in->score[pos], &in->score[pos + 1], (n - pos - 1) * 8);
+    memmove(&in->first[pos], &in->first[pos + 1], (n - pos - 1) * 8);
+    memmove(&in->child[pos], &in->child[pos + 1], (n - pos - 1) * 8);
+    in->hdr.n--;
+}
+
+static BLeaf *leaf_new() {
+    BLeaf *leaf = new BLeaf();
+    leaf->hdr.leaf = true;
+    return leaf;
+}
+
+// move the upper half to a new right sibling
+static BNode *leaf_split(BLeaf *leaf) {
+    BLeaf *right = leaf_new();
+    uint32_t half = leaf->hdr.n / 2;
+    uint32_t m = leaf->hdr.n - half;
+    memcpy(right->score, &leaf->score[half], m * 8);
+    memcpy(right->item, &leaf->item[half], m * 8);
+    right->hdr.n = m;
+    leaf->hdr.n = half;
+    // link the leaves
+    right->next = leaf->next;
+    if (right->next) {
+        right->next->prev = right;
+    }
+    right->prev = leaf;
+    leaf->next = right;
+    return &right->hdr;
+}
+
+static BNode *inner_split(BInner *in) {
+    BInner *right = new BInner();
+    uint32_t half = in->hdr.n / 2;
+    uint32_t m = in->hdr.n - half;
+    memcpy(right->cnt, &in->cnt[half], m * 4);
+    memcpy(right->score, &in->score[half], m * 8);
+    memcpy(right->first, &in->first[half], m * 8);
+    memcpy(right->child, &in->child[half], m * 8);
+    right->hdr.n = m;
+    in->hdr.n = half;
+    return &right->hdr;
+}
+
+// returns the new right sibling if the node was split
+static BNode *node_insert(BNode *node, ZNode *item) {
+    if (node->leaf) {
+        BLeaf *leaf = as_leaf(node);
+        uint32_t pos = leaf_lower(leaf, item->score, item->name, item->len);
+        leaf_put(leaf, pos, item->score, item);
+        return node->n > k_bt_cap ? leaf_split(leaf) : NULL;
+    }
+
+    BInner *in = as_inner(node);
+    uint32_t i = inner_pick(in, item->score, item->name, item->len);
+    BNode *sib = node_insert(in->child[i], item);
+    in->cnt[i]++;
+    in->first[i] = node_first(in->child[i], &in->score[i]);
+    if (sib) {
+        inner_set(in, i, in->child[i]);
+        inner_put(in, i + 1, sib);
+    }
+    return node->n > k_bt_cap ? inner_split(in) : NULL;
+}
+
+void bt_insert(BTree *tree, ZNode *item) {
+    if (!tree->root) {
+        tree->root = &leaf_new()->hdr;
+    }
+    BNode *sib = node_insert(tree->root, item);
+    if (sib) {
+        // grow a level
+        BInner *root = new BInner();
+        inner_put(root, 0, tree->root);
+        inner_put(root, 1, sib);
+        tree->root = &root->hdr;
+    }
+    tree->size++;
+}
+
+// append b to a, then free b
+static void node_merge(BNode *a, BNode *b) {
+    uint32_t n = a->n, m = b->n;
+    assert(a->leaf == b->leaf && n + m <= k_bt_cap);
+    if (a->leaf) {
+        BLeaf *la = as_leaf(a), *lb = as_leaf(b);
+        memcpy(&la->score[n], lb->score, m * 8);
+        memcpy(&la->item[n], lb->item, m * 8);
+        la->next = lb->next;
+        if (la->next) {
+            la->next->prev = la;
+        }
+        delete lb;
+    } else {
+        BInner *ia = as_inner(a), *ib = as_inner(b);
+        memcpy(&ia->cnt[n], ib->cnt, m * 4);
+        memcpy(&ia->score[n], ib->score, m * 8);
+        memcpy(&ia->first[n], ib->first, m * 8);
+        memcpy(&ia->child[n], ib->child, m * 8);
+        delete ib;
+    }
+    a->n = n + m;
+}
+
+// move 1 entry from the bigger node to the smaller one
+static void node_balance(BNode *a, BNode *b) {
+    if (a->leaf) {
+        BLeaf *la = as_leaf(a), *lb = as_leaf(b);
+        if (a->n < b->n) {
+            leaf_put(la, a->n, lb->score[0], lb->item[0]);
+            leaf_remove(lb, 0);
+        } else {
+            uint32_t last = a->n - 1;
+            leaf_put(lb, 0, la->score[last], la->item[last]);
+            leaf_remove(la, last);
+        }
+    } else {
+        BInner *ia = as_inner(a), *ib = as_inner(b);
+        if (a->n < b->n) {
+            inner_put(ia, a->n, ib->child[0]);
+            inner_remove(ib, 0);
+        } else {
+            uint32_t last = a->n - 1;
+            inner_put(ib, 0, ia->child[last]);
+            inner_remove(ia, last);
+        }
+    }
+}
+
+// child i has too few entries: merge it with a sibling,
+// or borrow from the sibling if they don't fit into one node.
+static void inner_fix(BInner *in, uint32_t i) {
+    assert(in->hdr.n >= 2);
+    uint32_t l = i > 0 ? i - 1 : i;
+    BNode *a = in->child[l], *b = in->child[l + 1];
+    if (a->n + b->n <= k_bt_cap) {
+        node_merge(a, b);
+        in->cnt[l] += in->cnt[l + 1];
+        inner_remove(in, l + 1);
+        in->first[l] = node_first(a, &in->score[l]);
+    } else {
+        node_balance(a, b);
+        inner_set(in, l, a);
+        inner_set(in, l + 1, b);
+    }
+}
+
+// the caller fixes the underflow of this node
+static void node_delete(BNode *node, ZNode *item) {
+    if (node->leaf) {
+        BLeaf *leaf = as_leaf(node);
+        uint32_t pos = leaf_lower(leaf, item->score, item->name, item->len);
+        assert(pos < node->n && leaf->item[pos] == item);
+        leaf_remove(leaf, pos);
+        return;
+    }
+
+    BInner *in = as_inner(node);
+    uint32_t i = inner_pick(in, item->score, item->name, item->len);
+    BNode *child = in->child[i];
+    node_delete(child, item);
+    in->cnt[i]--;
+    if (child->n < k_bt_min && node->n >= 2) {
+        inner_fix(in, i);
+    } else {
+        in->first[i] = node_first(child, &in->score[i]);
+    }
+}
+
+void bt_delete(BTree *tree, ZNode *item) {
+    node_delete(tree->root, item);
+    tree->size--;
+
+    BNode *root = tree->root;
+    if (!root->leaf && root->n == 1) {
+        // shrink a level
+        tree->root = as_inner(root)->child[0];
+        delete as_inner(root);
+    } else if (root->leaf && root->n == 0) {
+        delete as_leaf(root);
+        tree->root = NULL;
+    }
+}
+
+static void iter_load(BIter *it) {
+    it->node = it->leaf ? it->leaf->item[it->idx] : NULL;
+}
+
+void bt_seek(
+    BTree *tree, double score, const char *name, size_t len, BIter *it)
+{
+    *it = BIter{};
+    BNode *node = tree->root;
+    if (!node) {
+        return;
+    }
+    while (!node->leaf) {
+        BInner *in = as_inner(node);
+        node = in->child[inner_pick(in, score, name, len)];
+    }
+
+    BLeaf *leaf = as_leaf(node);
+    it->leaf = leaf;
+    it->idx = leaf_lower(leaf, score, name, len);
+    if (it->idx == node->n) {
+        // the next leaf starts with a greater item
+        it->leaf = leaf->next;
+        it->idx = 0;
+    }
+    iter_load(it);
+}
+
+void bt_seek_rank(BTree *tree, int64_t rank, BIter *it) {
+    *it = BIter{};
+    if (rank < 0 || (uint64_t)rank >= tree->size) {
+        return;
+    }
+
+    uint64_t r = (uint64_t)rank;
+    BNode *node = tree->root;
+    while (!node->leaf) {
+        BInner *in = as_inner(node);
+        uint32_t i = 0;
+        while (r >= in->cnt[i]) {
+            r -= in->cnt[i];
+            i++;
+        }
+        node = in->child[i];
+    }
+    it->leaf = as_leaf(node);
+    it->idx = (uint32_t)r;
+    iter_load(it);
+}
+
+int64_t bt_rank(BTree *tree, ZNode *item) {
+    int64_t rank = 0;
+    BNode *node = tree->root;
+    while (!node->leaf) {
+        BInner *in = as_inner(node);
+        uint32_t i = inner_pick(in, item->score, item->name, item->len);
+        for (uint32_t j = 0; j < i; ++j) {
+            rank += in->cnt[j];
+        }
+        node = in->child[i];
+    }
+    BLeaf *leaf = as_leaf(node);
+    uint32_t pos = leaf_lower(leaf, item->score, item->name, item->len);
+    assert(pos < node->n && leaf->item[pos] == item);
+    return rank + pos;
+}
+
+void bt_next(BIter *it) {
+    if (!it->leaf) {
+        return;
+    }
+    if (++it->idx >= it->leaf->hdr.n) {
+        it->leaf = it->leaf->next;
+        it->idx = 0;
+    }
+    iter_load(it);
+}
+
+void bt_prev(BIter *it) {
+    if (!it->leaf) {
+        return;
+    }
+    if (it->idx == 0) {
+        it->leaf = it->leaf->prev;
+        it->idx = it->leaf ? it->leaf->hdr.n - 1 : 0;
+    } else {
+        it->idx--;
+    }
+    iter_load(it);
+}
+
+static void node_dispose(BNode *node, void (*f)(ZNode *)) {
+    if (node->leaf) {
+        BLeaf *leaf = as_leaf(node);
+        for (uint32_t i = 0; i < node->n; ++i) {
+            f(leaf->item[i]);
+        }
+        delete leaf;
+        return;
+    }
+    BInner *in = as_inner(node);
+    for (uint32_t i = 0; i < node->n; ++i) {
+        node_dispose(in->child[i], f);
+    }
+    delete in;
+}
+
+void bt_dispose(BTree *tree, void (*f)(ZNode *)) {
+    if (tree->root) {
+        node_dispose(tree->root, f);
+    }
+    *tree = BTree{};
+}
+
+static size_t node_mem_usage(BNode *node) {
+    if (node->leaf) {
+        return sizeof(BLeaf);
+    }
+    BInner *in = as_inner(node);
+    size_t total = sizeof(BInner);
+    for (uint32_t i = 0; i < node->n; ++i) {
+        total += node_mem_usage(in->child[i]);
+    }
+    return total;
+}
+
+size_t bt_mem_usage(BTree *tree) {
+    return tree->root ? node_mem_usage(tree->root) : 0;
+}
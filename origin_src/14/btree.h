@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+struct ZNode;
+
+// an order-statistic B+tree of ZNode pointers, ordered by (score, name).
+// leaves keep copies of the scores so that most comparisons stay in
+// the node, and are linked for sequential scans. inner nodes keep the
+// number of items in each subtree for rank queries.
+const uint32_t k_bt_cap = 32;
+const uint32_t k_bt_min = k_bt_cap / 2;
+
+struct BNode {
+    uint32_t n = 0;         // the number of items or children
+    bool leaf = false;
+};
+
+// the arrays have room for 1 extra entry before a split
+struct BLeaf {
+    BNode hdr;
+    BLeaf *prev = NULL;
+    BLeaf *next = NULL;
+    double score[k_bt_cap + 1];
+    ZNode *item[k_bt_cap + 1];
+};
+
+struct BInner {
+    BNode hdr;
+    uint32_t cnt[k_bt_cap + 1];     // the size of each subtree
+    double score[k_bt_cap + 1];     // the first item of each subtree
+    ZNode *first[k_bt_cap + 1];
+    BNode *child[k_bt_cap + 1];
+};
+
+struct BTree {
+    BNode *root = NULL;
+    size_t size = 0;
+};
+
+// a position in the sorted order, `node` is NULL if out of range
+struct BIter {
+    BLeaf *leaf = NULL;
+    uint32_t idx = 0;
+    ZNode *node = NULL;
+};
+
+void bt_insert(BTree *tree, ZNode *node);
+void bt_delete(BTree *tree, ZNode *node);
+// the first item that is greater or equal to the tuple
+void bt_seek(
+    BTree *tree, double score, const char *name, size_t len, BIter *it);
+// by the 0-based rank
+void bt_seek_rank(BTree *tree, int64_t rank, BIter *it);
+// the 0-based rank of an item in the tree
+int64_t bt_rank(BTree *tree, ZNode *node);
+void bt_next(BIter *it);
+void bt_prev(BIter *it);
+void bt_dispose(BTree *tree, void (*f)(ZNode *));
+// the bytes of the tree nodes, not including the items
+size_t bt_mem_usage(BTree *tree);
@@ -0,0 +1,64 @@
+#include <assert.h>
+#include <stdlib.h>
+#include "bufpool.h"
+
+
+static size_t size_class(size_t cap) {
+    size_t shift = k_bufpool_min_shift;
+    while (((size_t)1 << shift) < cap) {
+        shift++;
+    }
+    return shift;
+}
+
+// get a buffer of at least *cap bytes, *cap is updated to the real size.
+// returns NULL if out of memory.
+uint8_t *bufpool_get(BufPool *pool, size_t *cap) {
+    size_t shift = size_class(*cap);
+    if (shift > k_bufpool_max_shift) {
+        // too big to cache, round up to the largest class
+        size_t unit = (size_t)1 << k_bufpool_max_shift;
+        size_t n = (*cap + unit - 1) & ~(unit - 1);
+        uint8_t *buf = (uint8_t *)malloc(n);
+        if (buf) {
+            *cap = n;
+        }
+        return buf;
+    }
+
+    size_t n = (size_t)1 << shift;
+    void **head = &pool->free[shift - k_bufpool_min_shift];
+    uint8_t *buf = NULL;
+    if (*head) {
+        // pop from the free list
+        buf = (uint8_t *)*head;
+        *head = *(void **)buf;
+        pool->cached_bytes -= n;
+    } else {
+        buf = (uint8_t *)malloc(n);
+    }
+    if (buf) {
+        *cap = n;
+    }
+    return buf;
+}
+
+// return a buffer obtained from bufpool_get()
+void bufpool_put(BufPool *pool, uint8_t *buf, size_t cap) {
+    if (!buf) {
+        return;
+    }
+    size_t shift = size_class(cap);
+    if (shift > k_bufpool_max_shift
+        || pool->cached_bytes + cap > pool->max_cached_bytes)
+    {
+        free(buf);
+        return;
+    }
+
+    assert(cap == (size_t)1 << shift);
+    void **head = &pool->free[shift - k_bufpool_min_shift];
+    *(void **)buf = *head;
+    *head = buf;
+    pool->cached_bytes += cap;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// buffers come in power-of-2 size classes, the smaller ones are cached
+const size_t k_bufpool_min_shift = 12;  // 4 KiB
+const size_t k_bufpool_max_shift = 20;  // 1 MiB, larger ones are not cached
+const size_t k_bufpool_nclass = k_bufpool_max_shift - k_bufpool_min_shift + 1;
+
+// a cache of free buffers, not thread-safe
+struct BufPool {
+    // free lists, linked through the first bytes of each buffer
+    void *free[k_bufpool_nclass] = {};
+    size_t cached_bytes = 0;
+    size_t max_cached_bytes = (size_t)64 << 20;
+};
+
+uint8_t *bufpool_get(BufPool *pool, size_t *cap);
+void bufpool_put(BufPool *pool, uint8_t *buf, size_t cap);
@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 
 
 #define container_of(ptr, type, member) ({                  \
@@ -9,12 +10,76 @@
     (type *)( (char *)__mptr - offsetof(type, member) );})
 
 
-inline uint64_t str_hash(const uint8_t *data, size_t len) {
-    uint32_t h = 0x811C9DC5;
-    for (size_t i = 0; i < len; i++) {
-        h = (h + data[i]) * 0x01000193;
+// the seed of str_hash(), randomized once at startup so that
+// clients can't predict which keys share a bucket.
+inline uint64_t g_hash_seed = 0;
+
+// wyhash (public domain), 8 bytes at a time with 128-bit multiplies
+inline uint64_t wy_mix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+inline uint64_t wy_r8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+inline uint64_t wy_r4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+inline uint64_t wy_hash(const uint8_t *p, size_t len, uint64_t seed) {
+    const uint64_t s0 = 0xa0761d6478bd642full, s1 = 0xe7037ed1a0b428dbull;
+    const uint64_t s2 = 0x8ebc6af09c88c6e3ull, s3 = 0x589965cc75374cc3ull;
+    seed ^= wy_mix(seed ^ s0, s1);
+    uint64_t a = 0, b = 0;
+    if (len <= 16) {
+        if (len >= 4) {
+            // 2 overlapping reads from each end
+            size_t d = (len >> 3) << 2;
+            a = (wy_r4(p) << 32) | wy_r4(p + d);
+            b = (wy_r4(p + len - 4) << 32) | wy_r4(p + len - 4 - d);
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8)
+                | p[len - 1];
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            // 3 independent lanes
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wy_mix(wy_r8(p) ^ s1, wy_r8(p + 8) ^ seed);
+                see1 = wy_mix(wy_r8(p + 16) ^ s2, wy_r8(p + 24) ^ see1);
+                see2 = wy_mix(wy_r8(p + 32) ^ s3, wy_r8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wy_mix(wy_r8(p) ^ s1, wy_r8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = wy_r8(p + i - 16);
+        b = wy_r8(p + i - 8);
     }
-    return h;
+    a ^= s1;
+    b ^= seed;
+    __uint128_t r = (__uint128_t)a * b;
+    a = (uint64_t)r;
+    b = (uint64_t)(r >> 64);
+    return wy_mix(a ^ s0 ^ len, b ^ s1);
+}
+
+// the hash of keys and zset names, all 64 bits are usable
+inline uint64_t str_hash(const uint8_t *data, size_t len) {
+    return wy_hash(data, len, g_hash_seed);
 }
 
 enum {
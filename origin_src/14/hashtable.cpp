@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include "hashtable.h"
 
+#ifndef HMAP_SWISS
+
 
 // n must be a power of 2
 static void h_init(HTab *htab, size_t n) {
@@ -133,8 +135,50 @@ size_t hm_size(HMap *hmap) {
     return hmap->ht1.size + hmap->ht2.size;
 }
 
+void hm_reserve(HMap *hmap, size_t n) {
+    assert(hm_size(hmap) == 0);
+    hm_destroy(hmap);
+    size_t cap = 4;
+    while (n / cap >= k_max_load_factor) {
+        cap *= 2;
+    }
+    h_init(&hmap->ht1, cap);
+}
+
 void hm_destroy(HMap *hmap) {
     free(hmap->ht1.tab);
     free(hmap->ht2.tab);
     *hmap = HMap{};
 }
+
+size_t hm_mem_usage(HMap *hmap) {
+    size_t n = 0;
+    if (hmap->ht1.tab) {
+        n += (hmap->ht1.mask + 1) * sizeof(HNode *);
+    }
+    if (hmap->ht2.tab) {
+        n += (hmap->ht2.mask + 1) * sizeof(HNode *);
+    }
+    return n;
+}
+
+static void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg) {
+    if (tab->size == 0) {
+        return;
+    }
+    for (size_t i = 0; i < tab->mask + 1; ++i) {
+        HNode *node = tab->tab[i];
+        while (node) {
+            HNode *next = node->next;
+            f(node, arg);
+            node = next;
+        }
+    }
+}
+
+void hm_foreach(HMap *hmap, void (*f)(HNode *, void *), void *arg) {
+    h_scan(&hmap->ht1, f, arg);
+    h_scan(&hmap->ht2, f, arg);
+}
+
+#endif  // HMAP_SWISS
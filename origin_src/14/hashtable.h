@@ -4,6 +4,29 @@
 #include <stdint.h>
 
 
+// the engine is chosen at build time:
+// chaining by default, or open addressing with -DHMAP_SWISS.
+#ifdef HMAP_SWISS
+
+// hashtable node, should be embedded into the payload
+struct HNode {
+    uint64_t hcode = 0;
+};
+
+// a fixed-sized open addressing table (hashtable_swiss.cpp).
+// the slots are probed 16 at a time by their control bytes,
+// which hold 7 bits of the hash, so most mismatches
+// are rejected without touching the nodes.
+struct HTab {
+    uint8_t *ctrl = NULL;
+    HNode **slots = NULL;
+    size_t mask = 0;
+    size_t size = 0;
+    size_t used = 0;    // full or deleted slots
+};
+
+#else
+
 // hashtable node, should be embedded into the payload
 struct HNode {
     HNode *next = NULL;
@@ -17,6 +40,8 @@ struct HTab {
     size_t size = 0;
 };
 
+#endif
+
 // the real hashtable interface.
 // it uses 2 hashtables for progressive resizing.
 struct HMap {
@@ -29,4 +54,11 @@ HNode *hm_lookup(HMap *hmap, HNode *key, bool (*cmp)(HNode *, HNode *));
 void hm_insert(HMap *hmap, HNode *node);
 HNode *hm_pop(HMap *hmap, HNode *key, bool (*cmp)(HNode *, HNode *));
 size_t hm_size(HMap *hmap);
+// size an empty map for `n` nodes, so that inserting them won't resize
+void hm_reserve(HMap *hmap, size_t n);
 void hm_destroy(HMap *hmap);
+// the bytes of the tables, not including the nodes
+size_t hm_mem_usage(HMap *hmap);
+// call f() on each node. f() may free the node, but the map
+// must not be modified meanwhile.
+void hm_foreach(HMap *hmap, void (*f)(HNode *, void *), void *arg);
@@ -0,0 +1,266 @@
+// the open addressing engine of HMap, built with -DHMAP_SWISS.
+#ifdef HMAP_SWISS
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "hashtable.h"
+
+
+// control bytes. a full slot is 0xxxxxxx: the top 7 bits of the hash.
+const uint8_t k_ctrl_empty = 0x80;
+const uint8_t k_ctrl_deleted = 0xFE;
+// slots are probed in aligned groups
+const size_t k_group = 16;
+
+static uint8_t h_tag(uint64_t hcode) {
+    return (uint8_t)(hcode >> 57);
+}
+
+// bit i is set if ctrl[i] == b
+static uint32_t group_match(const uint8_t *ctrl, uint8_t b) {
+#ifdef __SSE2__
+    __m128i g = _mm_load_si128((const __m128i *)ctrl);
+    __m128i eq = _mm_cmpeq_epi8(g, _mm_set1_epi8((char)b));
+    return (uint32_t)_mm_movemask_epi8(eq);
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < k_group; ++i) {
+        mask |= (uint32_t)(ctrl[i] == b) << i;
+    }
+    return mask;
+#endif
+}
+
+// bit i is set if ctrl[i] is empty or deleted (the high bit)
+static uint32_t group_free(const uint8_t *ctrl) {
+#ifdef __SSE2__
+    __m128i g = _mm_load_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(g);
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < k_group; ++i) {
+        mask |= (uint32_t)(ctrl[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+
+// n must be a power of 2, and at least a group
+static void h_init(HTab *htab, size_t n) {
+    assert(n >= k_group && ((n - 1) & n) == 0);
+    // one block: n control bytes followed by n slots
+    size_t sz = (n + n * sizeof(HNode *) + 63) & ~(size_t)63;
+    uint8_t *mem = (uint8_t *)aligned_alloc(64, sz);
+    assert(mem);
+    memset(mem, k_ctrl_empty, n);
+    htab->ctrl = mem;
+    htab->slots = (HNode **)(mem + n);
+    htab->mask = n - 1;
+    htab->size = 0;
+    htab->used = 0;
+}
+
+// the probe sequence visits every group once: g, g+1, g+3, g+6, ...
+static size_t h_group_mask(HTab *htab) {
+    return (htab->mask + 1) / k_group - 1;
+}
+
+// the table always has empty slots, so an empty slot is found
+static void h_insert(HTab *htab, HNode *node) {
+    size_t gmask = h_group_mask(htab);
+    size_t g = (size_t)node->hcode & gmask;
+    for (size_t i = 1; ; ++i) {
+        uint8_t *ctrl = &htab->ctrl[g * k_group];
+        uint32_t m = group_free(ctrl);
+        if (m) {
+            size_t pos = g * k_group + __builtin_ctz(m);
+            if (htab->ctrl[pos] == k_ctrl_empty) {
+                htab->used++;
+            }
+            htab->ctrl[pos] = h_tag(node->hcode);
+            htab->slots[pos] = node;
+            htab->size++;
+            return;
+        }
+        g = (g + i) & gmask;
+    }
+}
+
+// returns the slot holding the target node.
+// stops at the first group with an empty slot,
+// since an insertion would have used that slot.
+static HNode **h_lookup(
+    HTab *htab, HNode *key, bool (*cmp)(HNode *, HNode *))
+{
+    if (!htab->ctrl) {
+        return NULL;
+    }
+
+    size_t gmask = h_group_mask(htab);
+    size_t g = (size_t)key->hcode & gmask;
+    uint8_t tag = h_tag(key->hcode);
+    for (size_t i = 1; ; ++i) {
+        uint8_t *ctrl = &htab->ctrl[g * k_group];
+        for (uint32_t m = group_match(ctrl, tag); m; m &= m - 1) {
+            size_t pos = g * k_group + __builtin_ctz(m);
+            if (cmp(htab->slots[pos], key)) {
+                return &htab->slots[pos];
+            }
+        }
+        if (group_match(ctrl, k_ctrl_empty)) {
+            return NULL;
+        }
+        g = (g + i) & gmask;
+    }
+}
+
+// free a slot. it can be marked as empty if its group has other empty
+// slots, because then no probe sequence has continued past this group.
+static HNode *h_detach(HTab *htab, HNode **from) {
+    size_t pos = from - htab->slots;
+    HNode *node = *from;
+    if (group_match(&htab->ctrl[pos & ~(k_group - 1)], k_ctrl_empty)) {
+        htab->ctrl[pos] = k_ctrl_empty;
+        htab->used--;
+    } else {
+        htab->ctrl[pos] = k_ctrl_deleted;
+    }
+    htab->size--;
+    return node;
+}
+
+// the max number of slots scanned per operation
+const size_t k_resizing_work = 128;
+
+static void hm_help_resizing(HMap *hmap) {
+    if (hmap->ht2.ctrl == NULL) {
+        return;
+    }
+
+    HTab *old = &hmap->ht2;
+    size_t nwork = 0;
+    while (nwork < k_resizing_work && old->size > 0) {
+        // scan for nodes from ht2 and move them to ht1
+        size_t pos = hmap->resizing_pos++;
+        assert(pos <= old->mask);
+        nwork++;
+        if (old->ctrl[pos] & 0x80) {
+            continue;   // empty or deleted
+        }
+        h_insert(&hmap->ht1, h_detach(old, &old->slots[pos]));
+    }
+
+    if (old->size == 0) {
+        // done
+        free(old->ctrl);
+        *old = HTab{};
+    }
+}
+
+static void hm_start_resizing(HMap *hmap, size_t n) {
+    assert(hmap->ht2.ctrl == NULL);
+    // move the nodes to a new table, it's also used to purge
+    // the deleted slots without changing the size.
+    hmap->ht2 = hmap->ht1;
+    h_init(&hmap->ht1, n);
+    hmap->resizing_pos = 0;
+}
+
+HNode *hm_lookup(
+    HMap *hmap, HNode *key, bool (*cmp)(HNode *, HNode *))
+{
+    hm_help_resizing(hmap);
+    HNode **from = h_lookup(&hmap->ht1, key, cmp);
+    if (!from) {
+        from = h_lookup(&hmap->ht2, key, cmp);
+    }
+    return from ? *from : NULL;
+}
+
+void hm_insert(HMap *hmap, HNode *node) {
+    if (!hmap->ht1.ctrl) {
+        h_init(&hmap->ht1, k_group);
+    }
+
+    // keep 1/8 of the slots empty so that the probes stay short
+    HTab *htab = &hmap->ht1;
+    size_t n = htab->mask + 1;
+    if ((htab->used + 1) * 8 > n * 7) {
+        // the previous resizing is normally long done by now
+        while (hmap->ht2.ctrl) {
+            hm_help_resizing(hmap);
+        }
+        // double the size, unless the deleted slots are the problem
+        hm_start_resizing(hmap, htab->size * 16 > n * 7 ? n * 2 : n);
+    }
+    h_insert(&hmap->ht1, node);
+    hm_help_resizing(hmap);
+}
+
+HNode *hm_pop(
+    HMap *hmap, HNode *key, bool (*cmp)(HNode *, HNode *))
+{
+    hm_help_resizing(hmap);
+    HNode **from = h_lookup(&hmap->ht1, key, cmp);
+    if (from) {
+        return h_detach(&hmap->ht1, from);
+    }
+    from = h_lookup(&hmap->ht2, key, cmp);
+    if (from) {
+        return h_detach(&hmap->ht2, from);
+    }
+    return NULL;
+}
+
+size_t hm_size(HMap *hmap) {
+    return hmap->ht1.size + hmap->ht2.size;
+}
+
+void hm_reserve(HMap *hmap, size_t n) {
+    assert(hm_size(hmap) == 0);
+    hm_destroy(hmap);
+    size_t cap = k_group;
+    while (n * 8 > cap * 7) {
+        cap *= 2;
+    }
+    h_init(&hmap->ht1, cap);
+}
+
+void hm_destroy(HMap *hmap) {
+    free(hmap->ht1.ctrl);
+    free(hmap->ht2.ctrl);
+    *hmap = HMap{};
+}
+
+size_t hm_mem_usage(HMap *hmap) {
+    size_t n = 0;
+    if (hmap->ht1.ctrl) {
+        n += (hmap->ht1.mask + 1) * (1 + sizeof(HNode *));
+    }
+    if (hmap->ht2.ctrl) {
+        n += (hmap->ht2.mask + 1) * (1 + sizeof(HNode *));
+    }
+    return n;
+}
+
+static void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg) {
+    if (tab->size == 0) {
+        return;
+    }
+    for (size_t i = 0; i < tab->mask + 1; ++i) {
+        if (!(tab->ctrl[i] & 0x80)) {
+            f(tab->slots[i], arg);
+        }
+    }
+}
+
+void hm_foreach(HMap *hmap, void (*f)(HNode *, void *), void *arg) {
+    h_scan(&hmap->ht1, f, arg);
+    h_scan(&hmap->ht2, f, arg);
+}
+
+#endif  // HMAP_SWISS
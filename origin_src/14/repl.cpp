@@ -0,0 +1,565 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <atomic>
+#include "repl.h"
+#include "aof.h"
+
+
+static struct {
+    pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t has_data = PTHREAD_COND_INITIALIZER;
+    // the primary
+    char replid[33] = {};               // random per process
+    std::string backlog;
+    uint64_t off = 0;                   // the bytes ever appended
+    size_t nfollowers = 0;
+    // the follower, see replicaof
+    std::atomic<bool> following{false};
+    std::string primary;                // the socket path
+    uint64_t gen = 0;                   // a new link stops the old thread
+    int link_fd = -1;
+    bool linked = false;                // in sync, streaming
+    std::string primary_replid;         // empty if a full sync is needed
+    uint64_t primary_off = 0;           // applied up to
+    // stats
+    uint64_t nfull = 0;
+    uint64_t npartial = 0;
+} g_repl;
+
+static void msg(const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+}
+
+static void die(const char *msg) {
+    int err = errno;
+    fprintf(stderr, "[%d] %s\n", err, msg);
+    abort();
+}
+
+static bool write_all(int fd, const char *data, size_t n) {
+    while (n > 0) {
+        ssize_t rv = write(fd, data, n);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        data += rv;
+        n -= (size_t)rv;
+    }
+    return true;
+}
+
+static bool read_full(int fd, char *data, size_t n) {
+    while (n > 0) {
+        ssize_t rv = read(fd, data, n);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        data += rv;
+        n -= (size_t)rv;
+    }
+    return true;
+}
+
+static bool cmd_is(std::string_view word, const char *cmd) {
+    return word.size() == strlen(cmd)
+        && 0 == strncasecmp(word.data(), cmd, word.size());
+}
+
+static bool str2int(std::string_view s, int64_t &out) {
+    char buf[32];
+    if (s.empty() || s.size() >= sizeof(buf)) {
+        return false;
+    }
+    memcpy(buf, s.data(), s.size());
+    buf[s.size()] = '\0';
+
+    char *endp = NULL;
+    out = strtoll(buf, &endp, 10);
+    return endp == buf + s.size();
+}
+
+static void start_thread(void *(*f)(void *), void *arg) {
+    pthread_t thread;
+    int rv = pthread_create(&thread, NULL, f, arg);
+    if (rv) {
+        errno = rv;
+        die("pthread_create()");
+    }
+    pthread_detach(thread);
+}
+
+// the oldest offset still in the backlog
+static uint64_t repl_backlog_start() {
+    return g_repl.off - std::min(g_repl.off, (uint64_t)g_repl.backlog.size());
+}
+
+void repl_feed(const std::string &buf) {
+    pthread_mutex_lock(&g_repl.mu);
+    size_t cap = g_repl.backlog.size();
+    const char *data = buf.data();
+    size_t n = buf.size();
+    if (n > cap) {
+        // only the tail fits
+        g_repl.off += n - cap;
+        data += n - cap;
+        n = cap;
+    }
+    size_t at = (size_t)(g_repl.off % cap);
+    size_t first = std::min(n, cap - at);
+    memcpy(&g_repl.backlog[at], data, first);
+    memcpy(&g_repl.backlog[0], data + first, n - first);
+    g_repl.off += n;
+    pthread_cond_broadcast(&g_repl.has_data);
+    pthread_mutex_unlock(&g_repl.mu);
+}
+
+uint64_t repl_offset() {
+    pthread_mutex_lock(&g_repl.mu);
+    uint64_t off = g_repl.off;
+    pthread_mutex_unlock(&g_repl.mu);
+    return off;
+}
+
+// the offset is the cut of the pause
+bool repl_sync_write(int fd, uint64_t cut, bool (*keyspace)(int fd)) {
+    std::string buf;
+    char off[32];
+    int n = snprintf(off, sizeof(off), "%" PRIu64, cut);
+    std::string_view hdr[3] = {"fullresync", g_repl.replid, {off, (size_t)n}};
+    aof_append_req(buf, hdr, 3);
+    if (!write_all(fd, buf.data(), buf.size()) || !keyspace(fd)) {
+        return false;
+    }
+    buf.clear();
+    std::string_view end[1] = {"synced"};
+    aof_append_req(buf, end, 1);
+    return write_all(fd, buf.data(), buf.size());
+}
+
+// the full sync is over, wake up the serve thread
+void repl_sync_finish(FullSync *sync, bool ok) {
+    pthread_mutex_lock(&g_repl.mu);
+    sync->status = ok ? 1 : -1;
+    pthread_cond_broadcast(&g_repl.has_data);
+    pthread_mutex_unlock(&g_repl.mu);
+}
+
+static int listen_unix(const char *path) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        die("the socket path is too long");
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+    (void)unlink(path);     // left by a previous process
+    if (bind(fd, (const sockaddr *)&addr, sizeof(addr))) {
+        die("bind()");
+    }
+    if (listen(fd, SOMAXCONN)) {
+        die("listen()");
+    }
+    return fd;
+}
+
+static int connect_unix(const char *path) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (const sockaddr *)&addr, sizeof(addr))) {
+        (void)close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// the replication messages are requests in both directions
+static bool repl_send(int fd, const std::string_view *args, size_t n) {
+    std::string buf;
+    aof_append_req(buf, args, n);
+    return write_all(fd, buf.data(), buf.size());
+}
+
+static bool repl_recv(
+    int fd, std::string &buf, std::vector<std::string_view> &args)
+{
+    uint32_t len = 0;
+    if (!read_full(fd, (char *)&len, 4) || len > g_repl_conf.max_msg) {
+        return false;
+    }
+    buf.resize(len);
+    return read_full(fd, buf.data(), len)
+        && 0 == parse_req((const uint8_t *)buf.data(), len, args);
+}
+
+// on the primary: the keyspace from a forked child, in the same cut as
+// the backlog offset `*pos`
+static bool repl_full_sync(int fd, uint64_t *pos) {
+    // one fork at a time, ping the follower while another save runs
+    while (!g_repl_conf.sync_claim(1000)) {
+        std::string_view ping[1] = {"ping"};
+        if (!repl_send(fd, ping, 1)) {
+            return false;
+        }
+    }
+
+    FullSync sync;
+    sync.fd = fd;
+    g_repl_conf.sync_start(&sync);
+
+    pthread_mutex_lock(&g_repl.mu);
+    while (sync.status == 0) {
+        pthread_cond_wait(&g_repl.has_data, &g_repl.mu);
+    }
+    pthread_mutex_unlock(&g_repl.mu);
+    *pos = sync.cut;
+    return sync.status > 0;
+}
+
+const size_t k_repl_chunk = 256 * 1024;
+
+// on the primary: a thread per follower
+static void *repl_serve(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    // the handshake: psync REPLID OFFSET, REPLID is ? for a new follower
+    struct timeval tv = {5, 0};
+    (void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    std::string req;
+    std::vector<std::string_view> args;
+    int64_t off = 0;
+    if (!repl_recv(fd, req, args) || args.size() != 3
+        || !cmd_is(args[0], "psync") || !str2int(args[2], off) || off < 0)
+    {
+        (void)close(fd);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_repl.mu);
+    g_repl.nfollowers++;
+    uint64_t pos = (uint64_t)off;
+    bool partial = args[1] == g_repl.replid
+        && pos >= repl_backlog_start() && pos <= g_repl.off;
+    if (partial) {
+        g_repl.npartial++;
+    } else {
+        g_repl.nfull++;
+    }
+    pthread_mutex_unlock(&g_repl.mu);
+
+    std::string_view cont[1] = {"continue"};
+    bool ok = partial ? repl_send(fd, cont, 1) : repl_full_sync(fd, &pos);
+
+    // stream the backlog
+    std::string buf;
+    while (ok) {
+        pthread_mutex_lock(&g_repl.mu);
+        if (pos == g_repl.off) {
+            timespec ts = {0, 0};
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            pthread_cond_timedwait(&g_repl.has_data, &g_repl.mu, &ts);
+        }
+        if (pos < repl_backlog_start()) {
+            pthread_mutex_unlock(&g_repl.mu);
+            msg("a follower is too far behind");
+            break;
+        }
+        size_t n = (size_t)std::min(g_repl.off - pos, (uint64_t)k_repl_chunk);
+        size_t cap = g_repl.backlog.size();
+        size_t at = (size_t)(pos % cap);
+        size_t first = std::min(n, cap - at);
+        buf.assign(&g_repl.backlog[at], first);
+        buf.append(&g_repl.backlog[0], n - first);
+        pthread_mutex_unlock(&g_repl.mu);
+
+        if (n == 0) {
+            // idle, so that both ends notice a dead link
+            std::string_view ping[1] = {"ping"};
+            ok = repl_send(fd, ping, 1);
+        } else {
+            ok = write_all(fd, buf.data(), n);
+            pos += n;
+        }
+    }
+
+    pthread_mutex_lock(&g_repl.mu);
+    g_repl.nfollowers--;
+    pthread_mutex_unlock(&g_repl.mu);
+    (void)close(fd);
+    return NULL;
+}
+
+// on the primary: accept the followers
+static void *repl_accept(void *arg) {
+    int lfd = (int)(intptr_t)arg;
+    while (true) {
+        int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;   // EINTR, ECONNABORTED ...
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, &repl_serve, (void *)(intptr_t)fd)) {
+            (void)close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+void repl_listen() {
+    // a new replication ID per process, the offsets restart from 0
+    uint8_t id[16];
+    if (getrandom(id, sizeof(id), 0) != (ssize_t)sizeof(id)) {
+        die("getrandom()");
+    }
+    for (size_t i = 0; i < sizeof(id); ++i) {
+        snprintf(&g_repl.replid[2 * i], 3, "%02x", id[i]);
+    }
+    g_repl.backlog.resize(g_repl_conf.backlog);
+    int fd = listen_unix(g_repl_conf.listen_path);
+    start_thread(&repl_accept, (void *)(intptr_t)fd);
+}
+
+// on the follower: route the commands from the primary to their shards,
+// until the link breaks. returns false if a newer link replaced this one.
+static bool repl_link(int fd, uint64_t gen) {
+    pthread_mutex_lock(&g_repl.mu);
+    std::string replid = g_repl.primary_replid;
+    uint64_t off = g_repl.primary_off;
+    pthread_mutex_unlock(&g_repl.mu);
+
+    bool synced = !replid.empty();  // the offset counts the stream only
+    if (replid.empty()) {
+        replid = "?";
+    }
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%" PRIu64, off);
+    std::string_view req[3] = {"psync", replid, {buf, (size_t)n}};
+    if (!repl_send(fd, req, 3)) {
+        return true;
+    }
+    // the primary pings every second
+    struct timeval tv = {5, 0};
+    (void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    std::string next_replid;        // set when the full sync completes
+    std::string rbuf;
+    std::vector<std::string_view> cmd;
+    std::vector<std::string> batches(g_repl_conf.nshards);
+    std::vector<char> chunk(64 * 1024);
+    while (true) {
+        ssize_t rv = read(fd, chunk.data(), chunk.size());
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return true;
+        }
+        rbuf.append(chunk.data(), (size_t)rv);
+
+        bool err = false;
+        bool linked = false;
+        size_t pos = 0;
+        while (rbuf.size() - pos >= 4) {
+            uint32_t len = 0;
+            memcpy(&len, &rbuf[pos], 4);
+            if (len > g_repl_conf.max_msg) {
+                err = true;
+                break;
+            }
+            if (rbuf.size() - pos - 4 < len) {
+                break;  // want more data
+            }
+            const char *rec = &rbuf[pos];
+            if (0 != parse_req((const uint8_t *)rec + 4, len, cmd)) {
+                err = true;
+                break;
+            }
+            pos += 4 + len;
+
+            if (cmd.empty() || cmd_is(cmd[0], "ping")) {
+                continue;
+            }
+            if (cmd_is(cmd[0], "fullresync") && cmd.size() == 3) {
+                // replace the keyspace
+                int64_t at = 0;
+                (void)str2int(cmd[2], at);
+                next_replid = cmd[1];
+                off = (uint64_t)at;
+                synced = false;
+                std::string_view flush[1] = {"flushall"};
+                for (std::string &batch : batches) {
+                    aof_append_req(batch, flush, 1);
+                }
+                continue;
+            }
+            if (cmd_is(cmd[0], "continue") || cmd_is(cmd[0], "synced")) {
+                synced = linked = true;
+                continue;
+            }
+
+            int shard = g_repl_conf.route(cmd);
+            if (shard == -1) {
+                for (std::string &batch : batches) {
+                    batch.append(rec, 4 + len);
+                }
+            } else if (shard >= 0) {
+                batches[shard].append(rec, 4 + len);
+            }
+            if (synced) {
+                off += 4 + len;
+            }
+        }
+        rbuf.erase(0, pos);
+
+        // apply under the lock, a newer link may have flushed the keyspace
+        pthread_mutex_lock(&g_repl.mu);
+        bool current = g_repl.gen == gen;
+        for (size_t i = 0; current && i < batches.size(); ++i) {
+            if (!batches[i].empty()) {
+                g_repl_conf.apply(i, batches[i]);
+            }
+        }
+        if (current) {
+            if (!next_replid.empty()) {
+                // a partial sync needs the keyspace, until `synced`
+                g_repl.primary_replid = synced ? next_replid : "";
+                if (synced) {
+                    next_replid.clear();
+                }
+            }
+            g_repl.primary_off = off;
+            g_repl.linked = g_repl.linked || linked;
+        }
+        pthread_mutex_unlock(&g_repl.mu);
+        for (std::string &batch : batches) {
+            batch.clear();
+        }
+        if (!current) {
+            return false;
+        }
+        if (err) {
+            msg("bad replication stream");
+            return true;
+        }
+    }
+}
+
+// on the follower: reconnect until replaced or stopped
+static void *repl_follow(void *arg) {
+    uint64_t gen = (uint64_t)arg;
+    // the retry delay doubles while the primary is down
+    const uint32_t k_retry_min_ms = 100;
+    const uint32_t k_retry_max_ms = 5000;
+    uint32_t retry_ms = k_retry_min_ms;
+    while (true) {
+        pthread_mutex_lock(&g_repl.mu);
+        if (g_repl.gen != gen) {
+            pthread_mutex_unlock(&g_repl.mu);
+            break;
+        }
+        std::string path = g_repl.primary;
+        pthread_mutex_unlock(&g_repl.mu);
+
+        int fd = connect_unix(path.c_str());
+        if (fd >= 0) {
+            pthread_mutex_lock(&g_repl.mu);
+            bool current = g_repl.gen == gen;
+            if (current) {
+                g_repl.link_fd = fd;
+            }
+            pthread_mutex_unlock(&g_repl.mu);
+
+            current = current && repl_link(fd, gen);
+
+            pthread_mutex_lock(&g_repl.mu);
+            if (g_repl.link_fd == fd) {
+                if (g_repl.linked) {
+                    retry_ms = k_retry_min_ms;  // it was up
+                }
+                g_repl.link_fd = -1;
+                g_repl.linked = false;
+            }
+            pthread_mutex_unlock(&g_repl.mu);
+            (void)close(fd);
+            if (!current) {
+                break;
+            }
+        }
+        usleep(retry_ms * 1000);
+        retry_ms = std::min(2 * retry_ms, k_retry_max_ms);
+    }
+    return NULL;
+}
+
+void repl_start(std::string_view path) {
+    pthread_mutex_lock(&g_repl.mu);
+    if (g_repl.following && g_repl.primary == path) {
+        pthread_mutex_unlock(&g_repl.mu);
+        return;
+    }
+    uint64_t gen = ++g_repl.gen;
+    if (g_repl.link_fd >= 0) {
+        (void)shutdown(g_repl.link_fd, SHUT_RDWR);
+    }
+    g_repl.primary = path;
+    g_repl.primary_replid.clear();
+    g_repl.primary_off = 0;
+    g_repl.linked = false;
+    g_repl.following = true;
+    pthread_mutex_unlock(&g_repl.mu);
+
+    start_thread(&repl_follow, (void *)gen);
+}
+
+void repl_stop() {
+    pthread_mutex_lock(&g_repl.mu);
+    g_repl.gen++;
+    if (g_repl.link_fd >= 0) {
+        (void)shutdown(g_repl.link_fd, SHUT_RDWR);
+    }
+    g_repl.linked = false;
+    g_repl.following = false;
+    pthread_mutex_unlock(&g_repl.mu);
+}
+
+bool repl_following() {
+    return g_repl.following.load();
+}
+
+void repl_state(ReplState *st) {
+    pthread_mutex_lock(&g_repl.mu);
+    st->following = g_repl.following;
+    st->primary = g_repl.primary;
+    st->linked = g_repl.linked;
+    st->offset = g_repl.following ? g_repl.primary_off : g_repl.off;
+    st->nfollowers = g_repl.nfollowers;
+    st->nfull = g_repl.nfull;
+    st->npartial = g_repl.npartial;
+    pthread_mutex_unlock(&g_repl.mu);
+}
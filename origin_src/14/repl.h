@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+// replication over a Unix socket. the primary keeps the latest write
+// commands, in the AOF format, in a circular backlog. a thread per
+// follower streams it from the offset of the follower. a follower that
+// is new, or too far behind, first gets the keyspace as commands from a
+// forked child (full sync). the follower applies the stream through
+// the shard mailboxes, and rejects writes from its clients.
+
+// a full sync, handed by the serve thread of the follower to a reactor
+struct FullSync {
+    int fd = -1;            // the follower
+    uint64_t cut = 0;       // the backlog offset of the keyspace
+    int status = 0;         // 1 done, -1 failed, see repl_sync_finish()
+};
+
+// set by main() before repl_listen() and repl_start()
+struct ReplConfig {
+    const char *listen_path = NULL;     // see --repl-listen
+    size_t backlog = 1024 * 1024;       // see --repl-backlog
+    size_t max_msg = 0;                 // the limit of a message
+    size_t nshards = 0;
+    // the primary: claim the save slot for a full sync, false if it's
+    // still busy after `ms`
+    bool (*sync_claim)(uint32_t ms) = NULL;
+    // the primary: fork a child for the full sync from a paused reactor,
+    // it calls repl_sync_write(), then repl_sync_finish() when it exits
+    void (*sync_start)(FullSync *sync) = NULL;
+    // the follower: the shard of a command, -1 for all, -2 to skip it
+    int (*route)(std::vector<std::string_view> &cmd) = NULL;
+    // the follower: execute the requests of a shard, takes the batch
+    void (*apply)(size_t shard, std::string &batch) = NULL;
+};
+
+inline ReplConfig g_repl_conf;
+
+// the primary: accept the followers, from a new thread
+void repl_listen();
+// the primary: the commands of an iteration, for the followers
+void repl_feed(const std::string &buf);
+// the primary: the bytes ever fed
+uint64_t repl_offset();
+// in the child of a full sync: the keyspace from `keyspace` to the
+// follower, framed by the replication stream
+bool repl_sync_write(int fd, uint64_t cut, bool (*keyspace)(int fd));
+void repl_sync_finish(FullSync *sync, bool ok);
+
+// the follower: follow another primary, from a new thread
+void repl_start(std::string_view path);
+// become a primary, the keyspace is kept
+void repl_stop();
+bool repl_following();
+
+struct ReplState {
+    bool following = false;
+    std::string primary;
+    bool linked = false;        // in sync, streaming
+    uint64_t offset = 0;        // applied from the primary, or fed
+    size_t nfollowers = 0;
+    uint64_t nfull = 0;
+    uint64_t npartial = 0;
+};
+
+void repl_state(ReplState *st);
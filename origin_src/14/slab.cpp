@@ -0,0 +1,138 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <atomic>
+#include "slab.h"
+
+
+// pages are aligned to their size, so the page header of
+// an object is found by masking its address.
+const size_t k_slab_page = 64 * 1024;
+const size_t k_slab_step = 16;
+const size_t k_slab_nclass = k_slab_max / k_slab_step;
+
+struct SlabArena;
+
+struct SlabClass {
+    SlabArena *arena = NULL;
+    size_t size = 0;
+    // freed by the owner thread
+    void *free = NULL;
+    // freed by other threads, taken back by the owner when needed
+    std::atomic<void *> remote{NULL};
+    // the unused part of the last page
+    uint8_t *bump = NULL;
+    uint8_t *bump_end = NULL;
+    size_t nused = 0;
+    size_t npages = 0;
+};
+
+struct SlabPage {
+    SlabClass *cls;
+    uint8_t pad[k_slab_step - sizeof(SlabClass *)];
+};
+
+struct SlabArena {
+    SlabClass classes[k_slab_nclass];
+};
+
+static thread_local SlabArena *t_arena = NULL;
+
+static SlabArena *arena_get() {
+    if (!t_arena) {
+        // never freed: other threads may still hold objects from it
+        t_arena = new SlabArena();
+        for (size_t i = 0; i < k_slab_nclass; ++i) {
+            t_arena->classes[i].arena = t_arena;
+            t_arena->classes[i].size = (i + 1) * k_slab_step;
+        }
+    }
+    return t_arena;
+}
+
+static size_t class_idx(size_t size) {
+    return size ? (size - 1) / k_slab_step : 0;
+}
+
+size_t slab_good_size(size_t size) {
+    if (size > k_slab_max) {
+        return size;
+    }
+    return (class_idx(size) + 1) * k_slab_step;
+}
+
+static void *class_refill(SlabClass *cls) {
+    // take back the objects freed by other threads
+    void *list = cls->remote.exchange(NULL, std::memory_order_acquire);
+    if (list) {
+        for (void *p = list; p; p = *(void **)p) {
+            cls->nused--;
+        }
+        return list;
+    }
+
+    // carve from a new page
+    if (cls->bump + cls->size > cls->bump_end) {
+        uint8_t *page = (uint8_t *)aligned_alloc(k_slab_page, k_slab_page);
+        assert(page);   // not a good idea in real projects
+        ((SlabPage *)page)->cls = cls;
+        cls->bump = page + sizeof(SlabPage);
+        cls->bump_end = page + k_slab_page;
+        cls->npages++;
+    }
+    void *obj = cls->bump;
+    cls->bump += cls->size;
+    *(void **)obj = NULL;
+    return obj;
+}
+
+void *slab_alloc(size_t size) {
+    if (size > k_slab_max) {
+        return malloc(size);
+    }
+    SlabClass *cls = &arena_get()->classes[class_idx(size)];
+    if (!cls->free) {
+        cls->free = class_refill(cls);
+    }
+    void *obj = cls->free;
+    cls->free = *(void **)obj;
+    cls->nused++;
+    return obj;
+}
+
+void slab_free(void *ptr, size_t size) {
+    if (!ptr) {
+        return;
+    }
+    if (size > k_slab_max) {
+        return free(ptr);
+    }
+
+    uintptr_t addr = (uintptr_t)ptr & ~(uintptr_t)(k_slab_page - 1);
+    SlabClass *cls = ((SlabPage *)addr)->cls;
+    assert(cls->size == slab_good_size(size));
+    if (cls->arena == t_arena) {
+        *(void **)ptr = cls->free;
+        cls->free = ptr;
+        cls->nused--;
+        return;
+    }
+
+    // push to the owner's remote list
+    void *head = cls->remote.load(std::memory_order_relaxed);
+    do {
+        *(void **)ptr = head;
+    } while (!cls->remote.compare_exchange_weak(
+        head, ptr, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void slab_stats(SlabStats *stats) {
+    *stats = SlabStats{};
+    SlabArena *arena = arena_get();
+    for (size_t i = 0; i < k_slab_nclass; ++i) {
+        SlabClass *cls = &arena->classes[i];
+        stats->pages += cls->npages;
+        stats->objs += cls->nused;
+        stats->obj_bytes += cls->nused * cls->size;
+    }
+    stats->page_bytes = stats->pages * k_slab_page;
+}
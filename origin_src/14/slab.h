@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// a size-class slab allocator for small objects like Entry and ZNode.
+// each thread allocates from its own arena without locking, objects
+// can be freed from any thread. larger sizes go to malloc().
+const size_t k_slab_max = 512;
+
+void *slab_alloc(size_t size);
+// `size` must be the one passed to slab_alloc()
+void slab_free(void *ptr, size_t size);
+// the usable size of slab_alloc(size)
+size_t slab_good_size(size_t size);
+
+// the arena of the calling thread
+struct SlabStats {
+    size_t pages = 0;
+    size_t page_bytes = 0;
+    size_t objs = 0;        // live objects
+    size_t obj_bytes = 0;   // live objects, by their size class
+};
+
+void slab_stats(SlabStats *stats);
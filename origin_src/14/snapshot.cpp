@@ -0,0 +1,271 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "common.h"
+
+
+// a fixed seed, unlike str_hash(), the file outlives the process
+const uint64_t k_snap_seed = 0x534E4150;
+
+static uint64_t snap_checksum(uint64_t h, const uint8_t *p, size_t n) {
+    for (size_t off = 0; off < n; off += k_snap_block) {
+        size_t len = n - off < k_snap_block ? n - off : k_snap_block;
+        h = wy_hash(p + off, len, h);
+    }
+    return h;
+}
+
+static bool write_all(int fd, const char *data, size_t n) {
+    while (n > 0) {
+        ssize_t rv = write(fd, data, n);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        data += rv;
+        n -= (size_t)rv;
+    }
+    return true;
+}
+
+// write out the whole blocks, the checksum is computed per block
+static void snap_flush(SnapWriter *w, bool all) {
+    size_t n = w->buf.size();
+    if (!all) {
+        n -= n % k_snap_block;
+    }
+    if (n == 0) {
+        return;
+    }
+    w->checksum = snap_checksum(w->checksum, (uint8_t *)w->buf.data(), n);
+    if (!w->err && !write_all(w->fd, w->buf.data(), n)) {
+        w->err = true;
+    }
+    w->buf.erase(0, n);
+}
+
+bool snap_create(SnapWriter *w, const char *path, uint64_t nkeys) {
+    w->path = path;
+    w->tmp = w->path + ".tmp";
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    w->fd = open(w->tmp.c_str(), flags, 0644);
+    if (w->fd < 0) {
+        return false;
+    }
+    w->checksum = k_snap_seed;
+    w->buf.reserve(2 * k_snap_block);
+    w->buf.append("SNAP", 4);
+    w->offset = 4;
+    snap_put_u32(w, k_snap_version);
+    snap_put_u64(w, nkeys);
+    return true;
+}
+
+static void snap_put(SnapWriter *w, const void *data, size_t len) {
+    w->buf.append((const char *)data, len);
+    w->offset += len;
+    if (w->buf.size() >= k_snap_block) {
+        snap_flush(w, false);
+    }
+}
+
+void snap_put_u8(SnapWriter *w, uint8_t v) {
+    snap_put(w, &v, 1);
+}
+
+void snap_put_u32(SnapWriter *w, uint32_t v) {
+    snap_put(w, &v, 4);
+}
+
+void snap_put_u64(SnapWriter *w, uint64_t v) {
+    snap_put(w, &v, 8);
+}
+
+void snap_put_dbl(SnapWriter *w, double v) {
+    snap_put(w, &v, 8);
+}
+
+void snap_put_str(SnapWriter *w, const char *data, size_t len) {
+    snap_put_u32(w, (uint32_t)len);
+    snap_put(w, data, len);
+}
+
+void snap_mark(SnapWriter *w) {
+    if (w->chunks.empty() || w->offset - w->chunks.back() >= k_snap_chunk) {
+        w->chunks.push_back(w->offset);
+    }
+}
+
+bool snap_finish(SnapWriter *w) {
+    snap_put_u8(w, SNAP_EOF);
+    for (uint64_t off : w->chunks) {
+        snap_put_u64(w, off);
+    }
+    snap_put_u32(w, (uint32_t)w->chunks.size());
+    snap_flush(w, true);
+    uint64_t checksum = w->checksum;
+    bool ok = !w->err && write_all(w->fd, (char *)&checksum, 8)
+        && fsync(w->fd) == 0;
+    ok = (close(w->fd) == 0) && ok;
+    w->fd = -1;
+    if (ok && rename(w->tmp.c_str(), w->path.c_str()) == 0) {
+        return true;
+    }
+    (void)unlink(w->tmp.c_str());
+    return false;
+}
+
+void snap_abort(SnapWriter *w) {
+    if (w->fd >= 0) {
+        (void)close(w->fd);
+        w->fd = -1;
+    }
+    (void)unlink(w->tmp.c_str());
+}
+
+int snap_open(SnapReader *r, const char *path, bool verify) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < k_snap_header + 9) {
+        (void)close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    void *ptr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    (void)close(fd);
+    if (ptr == MAP_FAILED) {
+        return -1;
+    }
+    // read ahead aggressively, and drop the pages behind
+    (void)madvise(ptr, size, MADV_SEQUENTIAL);
+    (void)madvise(ptr, size, MADV_WILLNEED);
+
+    r->data = (const uint8_t *)ptr;
+    r->map_size = size;
+    r->size = size;
+    r->err = false;
+    r->pos = 4;
+    uint32_t version = snap_get_u32(r);
+    r->nkeys = snap_get_u64(r);
+    uint64_t checksum = 0;
+    memcpy(&checksum, r->data + size - 8, 8);
+
+    // the chunk index, before the checksum
+    size_t trailer = 9;
+    uint32_t nchunks = 0;
+    if (version >= 2) {
+        trailer = 13;
+        if (size >= k_snap_header + trailer) {
+            memcpy(&nchunks, r->data + size - 12, 4);
+        }
+        if (size < k_snap_header + trailer
+            || nchunks > (size - k_snap_header - trailer) / 8)
+        {
+            snap_close(r);
+            return -1;
+        }
+        trailer += (size_t)nchunks * 8;
+    }
+    r->size = size - trailer;   // the EOF mark
+    bool ok = 0 == memcmp(r->data, "SNAP", 4)
+        && (version == 1 || version == k_snap_version)
+        && r->data[r->size] == SNAP_EOF
+        && (!verify
+            || checksum == snap_checksum(k_snap_seed, r->data, size - 8));
+
+    r->chunks.clear();
+    if (version == 1 && r->size > k_snap_header) {
+        r->chunks.push_back(k_snap_header);
+    }
+    // records without any chunk would be skipped
+    ok = ok && (version == 1 || (nchunks == 0) == (r->size == k_snap_header));
+    for (uint32_t i = 0; ok && i < nchunks; ++i) {
+        uint64_t off = 0;
+        memcpy(&off, r->data + r->size + 1 + 8 * i, 8);
+        uint64_t prev = i ? r->chunks.back() : k_snap_header - 1;
+        ok = off > prev && off < r->size && (i > 0 || off == k_snap_header);
+        r->chunks.push_back(off);
+    }
+    if (!ok) {
+        snap_close(r);
+        return -1;
+    }
+    return 1;
+}
+
+void snap_close(SnapReader *r) {
+    if (r->data && r->map_size) {
+        (void)munmap((void *)r->data, r->map_size);
+    }
+    r->data = NULL;
+    r->map_size = 0;
+}
+
+SnapReader snap_chunk(const SnapReader *r, size_t i) {
+    SnapReader c;
+    c.data = r->data;
+    c.pos = r->chunks[i];
+    c.size = i + 1 < r->chunks.size() ? r->chunks[i + 1] : r->size;
+    c.nkeys = r->nkeys;
+    return c;
+}
+
+bool snap_eof(SnapReader *r) {
+    return r->err || r->pos >= r->size;
+}
+
+static const uint8_t *snap_get(SnapReader *r, size_t n) {
+    if (r->err || r->size - r->pos < n) {
+        r->err = true;
+        return NULL;
+    }
+    const uint8_t *p = r->data + r->pos;
+    r->pos += n;
+    return p;
+}
+
+uint8_t snap_get_u8(SnapReader *r) {
+    const uint8_t *p = snap_get(r, 1);
+    return p ? p[0] : 0;
+}
+
+uint32_t snap_get_u32(SnapReader *r) {
+    uint32_t v = 0;
+    if (const uint8_t *p = snap_get(r, 4)) {
+        memcpy(&v, p, 4);
+    }
+    return v;
+}
+
+uint64_t snap_get_u64(SnapReader *r) {
+    uint64_t v = 0;
+    if (const uint8_t *p = snap_get(r, 8)) {
+        memcpy(&v, p, 8);
+    }
+    return v;
+}
+
+double snap_get_dbl(SnapReader *r) {
+    double v = 0;
+    if (const uint8_t *p = snap_get(r, 8)) {
+        memcpy(&v, p, 8);
+    }
+    return v;
+}
+
+std::string_view snap_get_str(SnapReader *r) {
+    uint32_t len = snap_get_u32(r);
+    const uint8_t *p = snap_get(r, len);
+    return p ? std::string_view((const char *)p, len) : std::string_view();
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+// the snapshot file, all integers are little-endian:
+//   header:  "SNAP", u32 version, u64 nkeys (a hint for sizing tables)
+//   records: u8 type, i64 expire (unix ms, -1 if none), u32 klen, key,
+//            then the value:
+//            SNAP_STR:  u32 len, bytes
+//            SNAP_ZSET: u32 n, n * (f64 score, u32 len, name) in order
+//   trailer: u8 SNAP_EOF, n * u64 offset, u32 n, u64 checksum
+// the checksum chains wy_hash() over each 64K block before it. the
+// offsets start the chunks of about 1M that can be decoded in parallel.
+// version 1 has no chunk index.
+const uint32_t k_snap_version = 2;
+const size_t k_snap_header = 16;
+const size_t k_snap_block = 64 * 1024;
+const size_t k_snap_chunk = 1024 * 1024;
+
+enum {
+    SNAP_STR = 1,
+    SNAP_ZSET = 2,
+    SNAP_EOF = 0xFF,
+};
+
+// a buffered writer to a temporary file, renamed over the target when done
+struct SnapWriter {
+    int fd = -1;
+    std::string path;
+    std::string tmp;
+    std::string buf;
+    uint64_t checksum = 0;
+    bool err = false;   // a write failed, the file is discarded
+    uint64_t offset = 0;            // the bytes put so far
+    std::vector<uint64_t> chunks;   // the chunk index
+};
+
+bool snap_create(SnapWriter *w, const char *path, uint64_t nkeys);
+void snap_put_u8(SnapWriter *w, uint8_t v);
+void snap_put_u32(SnapWriter *w, uint32_t v);
+void snap_put_u64(SnapWriter *w, uint64_t v);
+void snap_put_dbl(SnapWriter *w, double v);
+void snap_put_str(SnapWriter *w, const char *data, size_t len);
+// a record starts here, which may start a new chunk
+void snap_mark(SnapWriter *w);
+// the trailer, fsync() and rename(). false if anything failed.
+bool snap_finish(SnapWriter *w);
+// remove the temporary file
+void snap_abort(SnapWriter *w);
+
+// a bounds-checked cursor over the mmap'ed file
+struct SnapReader {
+    const uint8_t *data = NULL;
+    size_t size = 0;        // excluding the trailer
+    size_t pos = 0;
+    uint64_t nkeys = 0;
+    bool err = false;       // truncated or malformed
+    size_t map_size = 0;    // 0 if it doesn't own the mapping
+    std::vector<uint64_t> chunks;
+};
+
+// 1 if opened, 0 if the file doesn't exist, -1 if it's not a snapshot.
+// the checksum is only verified if `verify`.
+int snap_open(SnapReader *r, const char *path, bool verify);
+void snap_close(SnapReader *r);
+bool snap_eof(SnapReader *r);
+// a cursor over the records of a chunk, it shares the mapping
+SnapReader snap_chunk(const SnapReader *r, size_t i);
+uint8_t snap_get_u8(SnapReader *r);
+uint32_t snap_get_u32(SnapReader *r);
+uint64_t snap_get_u64(SnapReader *r);
+double snap_get_dbl(SnapReader *r);
+// a view into the mapping, valid until snap_close()
+std::string_view snap_get_str(SnapReader *r);
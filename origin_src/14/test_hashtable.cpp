@@ -0,0 +1,107 @@
+// run it with both engines:
+//   g++ -std=gnu++17 test_hashtable.cpp && ./a.out
+//   g++ -std=gnu++17 -DHMAP_SWISS test_hashtable.cpp && ./a.out
+#include <assert.h>
+#include <stdlib.h>
+#include <map>
+#include "hashtable.cpp"        // lazy
+#include "hashtable_swiss.cpp"
+#include "common.h"
+
+
+struct Data {
+    HNode node;
+    uint32_t val = 0;
+};
+
+struct Container {
+    HMap map;
+    std::map<uint32_t, Data *> ref;
+};
+
+// a weak hash, so that many keys share a group or a chain
+static uint64_t weak_hash(uint32_t val, uint32_t bits) {
+    return (val * 0x9E3779B97F4A7C15ull) >> (64 - bits);
+}
+
+static bool data_eq(HNode *lhs, HNode *rhs) {
+    return container_of(lhs, Data, node)->val
+        == container_of(rhs, Data, node)->val;
+}
+
+static void add(Container &c, uint32_t val, uint32_t bits) {
+    Data *data = new Data();
+    data->val = val;
+    data->node.hcode = weak_hash(val, bits);
+    hm_insert(&c.map, &data->node);
+    c.ref[val] = data;
+}
+
+static void del(Container &c, uint32_t val, uint32_t bits) {
+    Data key;
+    key.val = val;
+    key.node.hcode = weak_hash(val, bits);
+    HNode *node = hm_pop(&c.map, &key.node, &data_eq);
+    auto it = c.ref.find(val);
+    if (it == c.ref.end()) {
+        assert(!node);
+        return;
+    }
+    assert(node == &it->second->node);
+    delete it->second;
+    c.ref.erase(it);
+}
+
+static void cb_count(HNode *node, void *arg) {
+    (void)node;
+    (*(size_t *)arg)++;
+}
+
+static void verify(Container &c, uint32_t bits) {
+    assert(hm_size(&c.map) == c.ref.size());
+    size_t n = 0;
+    hm_foreach(&c.map, &cb_count, &n);
+    assert(n == c.ref.size());
+    for (auto &p : c.ref) {
+        Data key;
+        key.val = p.first;
+        key.node.hcode = weak_hash(p.first, bits);
+        assert(hm_lookup(&c.map, &key.node, &data_eq) == &p.second->node);
+    }
+}
+
+static void dispose(Container &c) {
+    for (auto &p : c.ref) {
+        delete p.second;
+    }
+    hm_destroy(&c.map);
+}
+
+// random inserts and deletes, including the ones that leave
+// deleted slots behind and the ones during a resize.
+static void test_case(uint32_t bits, uint32_t range, size_t nops) {
+    Container c;
+    for (size_t i = 0; i < nops; ++i) {
+        uint32_t val = (uint32_t)rand() % range;
+        if (c.ref.count(val)) {
+            del(c, val, bits);
+        } else if (rand() % 3) {
+            add(c, val, bits);
+        } else {
+            del(c, val, bits);
+        }
+        if (i % 97 == 0) {
+            verify(c, bits);
+        }
+    }
+    verify(c, bits);
+    dispose(c);
+}
+
+int main() {
+    for (uint32_t bits : {4, 12, 64}) {
+        test_case(bits, 100, 20000);
+        test_case(bits, 5000, 50000);
+    }
+    return 0;
+}
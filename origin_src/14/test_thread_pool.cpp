@@ -0,0 +1,72 @@
+// g++ -std=gnu++17 test_thread_pool.cpp -lpthread && ./a.out
+#include <assert.h>
+#include <stdio.h>
+#include <vector>
+#include "thread_pool.cpp"  // lazy
+
+
+const size_t k_producers = 4;
+const size_t k_works = 50000;   // per producer
+
+static std::vector<std::atomic<uint32_t>> g_runs(k_producers * k_works);
+
+static void work(void *arg) {
+    g_runs[(size_t)arg].fetch_add(1);
+}
+
+struct Producer {
+    TheadPool *tp = NULL;
+    size_t id = 0;
+};
+
+static void *producer(void *arg) {
+    Producer *p = (Producer *)arg;
+    for (size_t i = 0; i < k_works; ++i) {
+        void *idx = (void *)(p->id * k_works + i);
+        // both submit paths
+        if (i % 2 || !thread_pool_try_queue(p->tp, &work, idx)) {
+            thread_pool_queue(p->tp, &work, idx);
+        }
+    }
+    return NULL;
+}
+
+// every work runs exactly once, including the ones still queued
+// when the pool is destroyed
+static void test_case(size_t nthreads, size_t capacity) {
+    for (auto &r : g_runs) {
+        r.store(0);
+    }
+    TheadPool tp;
+    thread_pool_init(&tp, nthreads, capacity);
+
+    Producer ps[k_producers];
+    pthread_t threads[k_producers];
+    for (size_t i = 0; i < k_producers; ++i) {
+        ps[i].tp = &tp;
+        ps[i].id = i;
+        int rv = pthread_create(&threads[i], NULL, &producer, &ps[i]);
+        assert(rv == 0);
+    }
+    for (size_t i = 0; i < k_producers; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    thread_pool_destroy(&tp);
+
+    for (auto &r : g_runs) {
+        assert(r.load() == 1);
+    }
+    assert(tp.nqueued.load() == g_runs.size());
+    assert(tp.ndone.load() == g_runs.size());
+    printf("%zu threads, capacity %zu: full %lu, peak %zu\n", nthreads,
+        capacity, (unsigned long)tp.nfull.load(), tp.peak.load());
+}
+
+int main() {
+    test_case(1, 1);
+    test_case(1, 4096);
+    test_case(4, 2);
+    test_case(4, 64);
+    test_case(8, 100000);
+    return 0;
+}
@@ -0,0 +1,82 @@
+// g++ -std=gnu++17 test_wheel.cpp && ./a.out
+#include <assert.h>
+#include <stdlib.h>
+#include <map>
+#include <vector>
+#include "wheel.cpp"        // lazy
+
+
+struct Timer {
+    WTimer wt;
+    uint64_t at = 0;
+};
+
+// advance the clock in random steps, every timer must fire
+// at the first step that reaches its expiry time.
+static void test_case(uint64_t start, uint64_t span, size_t n) {
+    TimerWheel tw;
+    tw_init(&tw, start);
+    std::vector<Timer> timers(n);
+    std::multimap<uint64_t, Timer *> ref;
+    for (Timer &t : timers) {
+        t.at = start + (uint64_t)rand() * rand() % span;
+        tw_add(&tw, &t.wt, t.at);
+        ref.insert({t.at, &t});
+    }
+    // re-arm and cancel some
+    for (size_t i = 0; i < n / 4; ++i) {
+        Timer &t = timers[rand() % n];
+        if (!tw_armed(&t.wt)) {
+            continue;
+        }
+        auto range = ref.equal_range(t.at);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == &t) {
+                ref.erase(it);
+                break;
+            }
+        }
+        if (rand() % 2) {
+            tw_del(&tw, &t.wt);
+        } else {
+            t.at = start + (uint64_t)rand() * rand() % span;
+            tw_add(&tw, &t.wt, t.at);
+            ref.insert({t.at, &t});
+        }
+    }
+    assert(tw.size == ref.size());
+
+    uint64_t now = start;
+    while (!ref.empty()) {
+        // no timer fires before this
+        uint64_t next = tw_next_ms(&tw);
+        assert(next <= ref.begin()->first);
+        now += 1 + rand() % (rand() % 2 ? 10 : 100000);
+        WTimer *wt = NULL;
+        while ((wt = tw_pop(&tw, now))) {
+            Timer *t = container_of(wt, Timer, wt);
+            assert(t->at <= now);
+            auto range = ref.equal_range(t->at);
+            bool found = false;
+            for (auto it = range.first; it != range.second; ++it) {
+                if (it->second == t) {
+                    ref.erase(it);
+                    found = true;
+                    break;
+                }
+            }
+            assert(found);
+        }
+        assert(ref.empty() || ref.begin()->first > now);
+    }
+    assert(tw.size == 0 && tw_next_ms(&tw) == (uint64_t)-1);
+}
+
+int main() {
+    test_case(0, 1000, 1000);
+    test_case(12345678, 100000, 10000);
+    test_case(0xFFFFF000ull, 1ull << 20, 10000);
+    // beyond the 2^32 ms range
+    test_case(99, 1ull << 34, 2000);
+    return 0;
+}
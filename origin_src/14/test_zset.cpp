@@ -0,0 +1,126 @@
+// run it with both engines:
+//   g++ -std=gnu++17 test_zset.cpp && ./a.out
+//   g++ -std=gnu++17 -DZSET_BTREE test_zset.cpp && ./a.out
+#include <assert.h>
+#include <stdlib.h>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include "zset.cpp"         // lazy
+#include "btree.cpp"
+#include "avl.cpp"
+#include "hashtable.cpp"
+#include "hashtable_swiss.cpp"
+#include "slab.cpp"
+
+
+typedef std::set<std::pair<double, std::string>> RefSet;
+
+static void verify(ZSet *zset, RefSet &ref) {
+    assert(zset_size(zset) == ref.size());
+    // a full scan from the smallest tuple
+    ZIter it;
+    zset_query(zset, -1e300, "", 0, 0, &it);
+    int64_t rank = 0;
+    for (auto &p : ref) {
+        assert(it.valid);
+        assert(it.score == p.first);
+        assert(std::string(it.name, it.len) == p.second);
+        assert(zset_rank(zset, it.name, it.len) == rank++);
+        zset_next(&it);
+    }
+    assert(!it.valid);
+    // backwards from the last rank
+    zset_seek_rank(zset, (int64_t)ref.size() - 1, &it);
+    for (auto p = ref.rbegin(); p != ref.rend(); ++p) {
+        assert(it.valid && it.score == p->first);
+        zset_prev(&it);
+    }
+    assert(!it.valid);
+    // the score ranks
+    for (double score = -1; score <= 51; score += 0.5) {
+        int64_t lt = 0, le = 0;
+        for (auto &p : ref) {
+            lt += p.first < score;
+            le += p.first <= score;
+        }
+        assert(zset_score_rank(zset, score, false) == lt);
+        assert(zset_score_rank(zset, score, true) == le);
+    }
+}
+
+// compare the seek + offset against the reference
+static void check_query(
+    ZSet *zset, RefSet &ref, std::vector<std::pair<double, std::string>> &v,
+    double score, const std::string &name, int64_t offset)
+{
+    auto lb = ref.lower_bound({score, name});
+    ZIter it;
+    zset_query(zset, score, name.data(), name.size(), offset, &it);
+    if (lb == ref.end()) {
+        assert(!it.valid);
+        return;
+    }
+    int64_t rank = (int64_t)std::distance(ref.begin(), lb) + offset;
+    if (rank < 0 || rank >= (int64_t)v.size()) {
+        assert(!it.valid);
+        return;
+    }
+    assert(it.valid);
+    assert(it.score == v[rank].first);
+    assert(std::string(it.name, it.len) == v[rank].second);
+}
+
+// `pad` makes long names
+static void test_case(uint32_t nkeys, uint32_t nops, size_t pad = 0) {
+    ZSet zset;
+    RefSet ref;
+    srand(nkeys);
+    for (uint32_t i = 0; i < nops; ++i) {
+        std::string name = std::string(pad, 'x');
+        name += std::to_string(rand() % nkeys);
+        double old = 0;
+        bool found = zset_score(&zset, name.data(), name.size(), &old);
+        if (rand() % 3 == 0) {
+            bool deleted = zset_del(&zset, name.data(), name.size());
+            assert(deleted == found);
+            ref.erase({old, name});
+        } else {
+            // few distinct scores, so that names break the ties
+            double score = rand() % 50;
+            if (found) {
+                ref.erase({old, name});
+            }
+            bool added = zset_add(&zset, name.data(), name.size(), score);
+            assert(added == !found);
+            ref.insert({score, name});
+        }
+        if (i % 1000 == 0) {
+            verify(&zset, ref);
+        }
+    }
+    verify(&zset, ref);
+    // the listpack is only for small sets
+    bool small = nkeys <= k_zlist_max_size && pad <= k_zlist_max_name - 8;
+    assert(zset.is_list == small);
+
+    std::vector<std::pair<double, std::string>> v(ref.begin(), ref.end());
+    for (uint32_t i = 0; i < 2000; ++i) {
+        double score = rand() % 52 - 1;
+        std::string name = std::to_string(rand() % nkeys);
+        int64_t offset = rand() % (2 * nkeys + 1) - (int64_t)nkeys;
+        check_query(&zset, ref, v, score, name, offset);
+        check_query(&zset, ref, v, score, name, rand() % 5 - 2);
+    }
+    zset_dispose(&zset);
+}
+
+int main() {
+    test_case(10, 1000);
+    test_case(100, 5000);
+    test_case(10, 1000, 70);
+    test_case(1000, 20000);
+    test_case(20000, 100000);
+    return 0;
+}
@@ -1,33 +1,93 @@
 #include <assert.h>
+#include <sched.h>
+#include <stdlib.h>
 #include "thread_pool.h"
 
 
+static bool tp_push(TheadPool *tp, const Work &w) {
+    size_t pos = tp->tail.load(std::memory_order_relaxed);
+    while (true) {
+        WorkCell *cell = &tp->cells[pos & tp->mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            // the slot is free, claim the position
+            if (tp->tail.compare_exchange_weak(
+                pos, pos + 1, std::memory_order_relaxed))
+            {
+                cell->work = w;
+                cell->seq.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+            // lost the race, `pos` was reloaded
+        } else if (diff < 0) {
+            return false;   // full: the slot is a lap behind
+        } else {
+            pos = tp->tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+static bool tp_pop(TheadPool *tp, Work *w) {
+    size_t pos = tp->head.load(std::memory_order_relaxed);
+    while (true) {
+        WorkCell *cell = &tp->cells[pos & tp->mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (tp->head.compare_exchange_weak(
+                pos, pos + 1, std::memory_order_relaxed))
+            {
+                *w = cell->work;
+                // free the slot for the next lap
+                cell->seq.store(pos + tp->mask + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;   // empty, or the producer has not finished
+        } else {
+            pos = tp->head.load(std::memory_order_relaxed);
+        }
+    }
+}
+
 static void *worker(void *arg) {
     TheadPool *tp = (TheadPool *)arg;
     while (true) {
-        pthread_mutex_lock(&tp->mu);
-        // wait for the condition: a non-empty queue
-        while (tp->queue.empty()) {
-            pthread_cond_wait(&tp->not_empty, &tp->mu);
-        }
+        // a token per queued work, plus one per thread on shutdown
+        while (sem_wait(&tp->ready) != 0) {}
 
-        // got the job
-        Work w = tp->queue.front();
-        tp->queue.pop_front();
-        pthread_mutex_unlock(&tp->mu);
+        Work w;
+        while (!tp_pop(tp, &w)) {
+            if (tp->stopping.load() && thread_pool_depth(tp) == 0) {
+                return NULL;
+            }
+            // a producer claimed a slot ahead but has not filled it yet
+            sched_yield();
+        }
 
         // do the work
         w.f(w.arg);
+        tp->ndone.fetch_add(1, std::memory_order_relaxed);
     }
     return NULL;
 }
 
-void thread_pool_init(TheadPool *tp, size_t num_threads) {
-    assert(num_threads > 0);
+void thread_pool_init(TheadPool *tp, size_t num_threads, size_t capacity) {
+    assert(num_threads > 0 && capacity > 0);
 
-    int rv = pthread_mutex_init(&tp->mu, NULL);
-    assert(rv == 0);
-    rv = pthread_cond_init(&tp->not_empty, NULL);
+    // 2 at least, a slot can't be both filled and free for the next lap
+    size_t cap = 2;
+    while (cap < capacity) {
+        cap *= 2;
+    }
+    tp->cells = (WorkCell *)calloc(cap, sizeof(WorkCell));
+    assert(tp->cells);
+    for (size_t i = 0; i < cap; ++i) {
+        tp->cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+    tp->mask = cap - 1;
+    int rv = sem_init(&tp->ready, 0, 0);
     assert(rv == 0);
 
     tp->threads.resize(num_threads);
@@ -37,13 +97,50 @@ void thread_pool_init(TheadPool *tp, size_t num_threads) {
     }
 }
 
-void thread_pool_queue(TheadPool *tp, void (*f)(void *), void *arg) {
+bool thread_pool_try_queue(TheadPool *tp, void (*f)(void *), void *arg) {
+    assert(!tp->stopping.load());
     Work w;
     w.f = f;
     w.arg = arg;
+    if (!tp_push(tp, w)) {
+        tp->nfull.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    tp->nqueued.fetch_add(1, std::memory_order_relaxed);
+    size_t depth = thread_pool_depth(tp);
+    size_t peak = tp->peak.load(std::memory_order_relaxed);
+    while (depth > peak && !tp->peak.compare_exchange_weak(
+        peak, depth, std::memory_order_relaxed))
+    {}
+    // no syscall unless a worker is sleeping
+    sem_post(&tp->ready);
+    return true;
+}
 
-    pthread_mutex_lock(&tp->mu);
-    tp->queue.push_back(w);
-    pthread_cond_signal(&tp->not_empty);
-    pthread_mutex_unlock(&tp->mu);
+void thread_pool_queue(TheadPool *tp, void (*f)(void *), void *arg) {
+    while (!thread_pool_try_queue(tp, f, arg)) {
+        sched_yield();
+    }
+}
+
+size_t thread_pool_depth(TheadPool *tp) {
+    size_t head = tp->head.load();
+    size_t tail = tp->tail.load();
+    return tail > head ? tail - head : 0;
+}
+
+void thread_pool_destroy(TheadPool *tp) {
+    tp->stopping.store(true);
+    for (size_t i = 0; i < tp->threads.size(); ++i) {
+        sem_post(&tp->ready);
+    }
+    for (pthread_t &th : tp->threads) {
+        int rv = pthread_join(th, NULL);
+        assert(rv == 0);
+    }
+    tp->threads.clear();
+    assert(thread_pool_depth(tp) == 0);
+    sem_destroy(&tp->ready);
+    free(tp->cells);
+    tp->cells = NULL;
 }
@@ -3,8 +3,9 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <atomic>
 #include <vector>
-#include <deque>
 
 
 struct Work {
@@ -12,12 +13,39 @@ struct Work {
     void *arg = NULL;
 };
 
+// a slot of the ring. `seq` tells whose turn it is:
+// == pos: free for the producer of `pos`,
+// == pos + 1: filled, for the consumer of `pos`.
+struct WorkCell {
+    std::atomic<size_t> seq;
+    Work work;
+};
+
+// a bounded lock-free MPMC queue: producers and consumers claim positions
+// with a CAS on their own counter, then wait for the turn of the slot.
+// idle workers sleep on a semaphore that counts the queued works.
 struct TheadPool {
     std::vector<pthread_t> threads;
-    std::deque<Work> queue;
-    pthread_mutex_t mu;
-    pthread_cond_t not_empty;
+    WorkCell *cells = NULL;
+    size_t mask = 0;            // capacity - 1
+    alignas(64) std::atomic<size_t> head{0};    // the next to pop
+    alignas(64) std::atomic<size_t> tail{0};    // the next to push
+    alignas(64) sem_t ready;
+    std::atomic<bool> stopping{false};
+    // metrics
+    std::atomic<uint64_t> nqueued{0};
+    std::atomic<uint64_t> ndone{0};
+    std::atomic<uint64_t> nfull{0};     // rejected by thread_pool_try_queue()
+    std::atomic<size_t> peak{0};        // the max queue depth
 };
 
-void thread_pool_init(TheadPool *tp, size_t num_threads);
+// `capacity` is rounded up to a power of 2, and 2 at least
+void thread_pool_init(TheadPool *tp, size_t num_threads, size_t capacity = 4096);
+// never blocks, false if the queue is full
+bool thread_pool_try_queue(TheadPool *tp, void (*f)(void *), void *arg);
+// waits for room if the queue is full
 void thread_pool_queue(TheadPool *tp, void (*f)(void *), void *arg);
+// the queued works that have not started
+size_t thread_pool_depth(TheadPool *tp);
+// run the remaining works, then join the threads
+void thread_pool_destroy(TheadPool *tp);
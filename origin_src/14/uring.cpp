@@ -0,0 +1,209 @@
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+
+static int sys_uring_setup(uint32_t entries, io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(
+    int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags,
+    void *arg, size_t argsz)
+{
+    return (int)syscall(
+        __NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+int uring_init(URing *ring, uint32_t entries) {
+    io_uring_params p = {};
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;     // completions can outnumber submissions
+    int fd = sys_uring_setup(entries, &p);
+    if (fd < 0) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)
+        || !(p.features & IORING_FEAT_EXT_ARG))
+    {
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // the SQ and CQ rings share one mapping
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    size_t ring_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+    uint8_t *ptr = (uint8_t *)mmap(
+        NULL, ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        fd, IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    size_t sqes_sz = p.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(
+        NULL, sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        munmap(ptr, ring_sz);
+        close(fd);
+        return -1;
+    }
+
+    ring->fd = fd;
+    ring->sq_head = (uint32_t *)(ptr + p.sq_off.head);
+    ring->sq_tail = (uint32_t *)(ptr + p.sq_off.tail);
+    ring->sq_array = (uint32_t *)(ptr + p.sq_off.array);
+    ring->sq_mask = *(uint32_t *)(ptr + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sqes = (io_uring_sqe *)sqes;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (uint32_t *)(ptr + p.cq_off.head);
+    ring->cq_tail = (uint32_t *)(ptr + p.cq_off.tail);
+    ring->cq_mask = *(uint32_t *)(ptr + p.cq_off.ring_mask);
+    ring->cqes = (io_uring_cqe *)(ptr + p.cq_off.cqes);
+    ring->ring_ptr = ptr;
+    ring->ring_sz = ring_sz;
+    ring->sqes_sz = sqes_sz;
+    return 0;
+}
+
+// publish the SQEs handed out so far, returns the number of them
+static uint32_t uring_flush_sq(URing *ring) {
+    uint32_t tail = *ring->sq_tail;
+    uint32_t n = ring->sq_local_tail - tail;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    return n;
+}
+
+static int uring_enter(
+    URing *ring, uint32_t min_complete, uint32_t flags, int timeout_ms)
+{
+    uint32_t to_submit = uring_flush_sq(ring);
+    __kernel_timespec ts = {};
+    io_uring_getevents_arg arg = {};
+    arg.sigmask_sz = _NSIG / 8;
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)&ts;
+    }
+    flags |= IORING_ENTER_EXT_ARG;
+    int rv = 0;
+    do {
+        rv = sys_uring_enter(
+            ring->fd, to_submit, min_complete, flags, &arg, sizeof(arg));
+    } while (rv < 0 && errno == EINTR && min_complete == 0);
+    return rv;
+}
+
+// get an empty SQE. all fields must be filled by the caller.
+// submits the queued SQEs without waiting if the ring is full.
+io_uring_sqe *uring_get_sqe(URing *ring) {
+    uint32_t head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        if (uring_enter(ring, 0, 0, -1) < 0) {
+            return NULL;
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sq_local_tail - head >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+
+    uint32_t idx = ring->sq_local_tail & ring->sq_mask;
+    ring->sq_array[idx] = idx;
+    ring->sq_local_tail++;
+    io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// submit all queued SQEs and wait for at least one completion,
+// or until the timeout expires. one syscall for the whole batch.
+int uring_submit_and_wait(URing *ring, int timeout_ms) {
+    if (uring_peek_cqe(ring)) {
+        // completions are ready, don't block
+        if (ring->sq_local_tail == *ring->sq_tail) {
+            return 0;
+        }
+        return uring_enter(ring, 0, 0, -1);
+    }
+    int rv = uring_enter(ring, 1, IORING_ENTER_GETEVENTS, timeout_ms);
+    if (rv < 0 && (errno == ETIME || errno == EINTR)) {
+        return 0;
+    }
+    return rv;
+}
+
+// the next unconsumed completion, or NULL
+io_uring_cqe *uring_peek_cqe(URing *ring) {
+    uint32_t head = *ring->cq_head;
+    uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(URing *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+static int uring_provide(
+    URing *ring, URingBufs *bufs, uint16_t bid, uint32_t nbufs)
+{
+    io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = (int32_t)nbufs;
+    sqe->addr = (uint64_t)uring_buf(bufs, bid);
+    sqe->len = bufs->buf_size;
+    sqe->off = bid;
+    sqe->buf_group = bufs->bgid;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;    // only failures are reported
+    return 0;
+}
+
+// the buffers are handed to the kernel with the next submission,
+// which comes before any receive queued after this call.
+int uring_bufs_init(
+    URing *ring, URingBufs *bufs, uint16_t bgid,
+    uint32_t entries, uint32_t buf_size)
+{
+    assert(entries > 0 && entries <= 65536);
+    uint8_t *base = (uint8_t *)mmap(
+        NULL, (size_t)entries * buf_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+
+    bufs->base = base;
+    bufs->entries = entries;
+    bufs->buf_size = buf_size;
+    bufs->bgid = bgid;
+    if (uring_provide(ring, bufs, 0, entries)) {
+        munmap(base, (size_t)entries * buf_size);
+        return -1;
+    }
+    return 0;
+}
+
+uint8_t *uring_buf(URingBufs *bufs, uint16_t bid) {
+    return bufs->base + (size_t)bid * bufs->buf_size;
+}
+
+// give a buffer back to the kernel, batched with the next submission
+int uring_buf_recycle(URing *ring, URingBufs *bufs, uint16_t bid) {
+    return uring_provide(ring, bufs, bid, 1);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+
+// a minimal io_uring wrapper on top of the raw syscalls
+struct URing {
+    int fd = -1;
+    // submission queue
+    uint32_t *sq_head = NULL;
+    uint32_t *sq_tail = NULL;
+    uint32_t *sq_array = NULL;
+    uint32_t sq_mask = 0;
+    uint32_t sq_entries = 0;
+    io_uring_sqe *sqes = NULL;
+    uint32_t sq_local_tail = 0;     // SQEs handed out but not yet published
+    // completion queue
+    uint32_t *cq_head = NULL;
+    uint32_t *cq_tail = NULL;
+    uint32_t cq_mask = 0;
+    io_uring_cqe *cqes = NULL;
+    // the mmap'ed regions
+    void *ring_ptr = NULL;
+    size_t ring_sz = 0;
+    size_t sqes_sz = 0;
+};
+
+// a group of buffers the kernel picks from when data actually arrives,
+// so pending receives don't pin memory.
+struct URingBufs {
+    uint8_t *base = NULL;
+    uint32_t entries = 0;
+    uint32_t buf_size = 0;
+    uint16_t bgid = 0;
+};
+
+int uring_init(URing *ring, uint32_t entries);
+io_uring_sqe *uring_get_sqe(URing *ring);
+int uring_submit_and_wait(URing *ring, int timeout_ms);
+io_uring_cqe *uring_peek_cqe(URing *ring);
+void uring_cqe_seen(URing *ring);
+
+int uring_bufs_init(
+    URing *ring, URingBufs *bufs, uint16_t bgid,
+    uint32_t entries, uint32_t buf_size);
+uint8_t *uring_buf(URingBufs *bufs, uint16_t bid);
+int uring_buf_recycle(URing *ring, URingBufs *bufs, uint16_t bid);
@@ -0,0 +1,129 @@
+#include <assert.h>
+#include "wheel.h"
+#include "common.h"
+
+
+const uint64_t k_wheel_mask = k_wheel_slots - 1;
+
+void tw_init(TimerWheel *tw, uint64_t now_ms) {
+    tw->now_ms = now_ms;
+    tw->size = 0;
+    for (size_t level = 0; level < k_wheel_levels; ++level) {
+        for (size_t i = 0; i < k_wheel_slots; ++i) {
+            dlist_init(&tw->slots[level][i]);
+        }
+    }
+}
+
+// the lowest level whose current slot range covers the expiry time.
+// a timer is moved down a level each time its slot is reached.
+static void tw_place(TimerWheel *tw, WTimer *timer) {
+    uint64_t at = timer->expire_ms;
+    if (at < tw->now_ms) {
+        at = tw->now_ms;    // overdue, the next tick
+    }
+
+    size_t level = 0;
+    while (level + 1 < k_wheel_levels
+        && (at >> ((level + 1) * k_wheel_bits))
+            != (tw->now_ms >> ((level + 1) * k_wheel_bits)))
+    {
+        level++;
+    }
+
+    uint64_t slot = at >> (level * k_wheel_bits);
+    uint64_t cur = tw->now_ms >> (level * k_wheel_bits);
+    if (slot - cur >= k_wheel_slots) {
+        // too far for the top level: park it in the last slot to be reached
+        slot = cur - 1;
+    }
+    dlist_insert_before(&tw->slots[level][slot & k_wheel_mask], &timer->link);
+}
+
+void tw_add(TimerWheel *tw, WTimer *timer, uint64_t expire_ms) {
+    if (tw_armed(timer)) {
+        dlist_detach(&timer->link);
+    } else {
+        tw->size++;
+    }
+    timer->expire_ms = expire_ms;
+    tw_place(tw, timer);
+}
+
+void tw_del(TimerWheel *tw, WTimer *timer) {
+    if (tw_armed(timer)) {
+        dlist_detach(&timer->link);
+        timer->link = DList{};
+        tw->size--;
+    }
+}
+
+// move the timers of a slot to the lower levels
+static void tw_cascade(TimerWheel *tw, size_t level) {
+    uint64_t slot = tw->now_ms >> (level * k_wheel_bits);
+    DList *head = &tw->slots[level][slot & k_wheel_mask];
+    DList list;
+    dlist_init(&list);
+    if (!dlist_empty(head)) {
+        // take over the whole list
+        dlist_insert_before(head, &list);
+        dlist_detach(head);
+        dlist_init(head);
+    }
+    while (!dlist_empty(&list)) {
+        DList *node = list.next;
+        dlist_detach(node);
+        tw_place(tw, container_of(node, WTimer, link));
+    }
+}
+
+// advance the clock to a tick, the skipped ticks must be empty
+static void tw_advance(TimerWheel *tw, uint64_t now_ms) {
+    tw->now_ms = now_ms;
+    // the highest level that enters a new slot
+    size_t top = 0;
+    while (top + 1 < k_wheel_levels) {
+        uint64_t low = ((uint64_t)1 << ((top + 1) * k_wheel_bits)) - 1;
+        if (now_ms & low) {
+            break;
+        }
+        top++;
+    }
+    for (size_t level = top; level > 0; --level) {
+        tw_cascade(tw, level);
+    }
+}
+
+WTimer *tw_pop(TimerWheel *tw, uint64_t now_ms) {
+    while (tw->now_ms <= now_ms) {
+        DList *head = &tw->slots[0][tw->now_ms & k_wheel_mask];
+        if (!dlist_empty(head)) {
+            WTimer *timer = container_of(head->next, WTimer, link);
+            tw_del(tw, timer);
+            return timer;
+        }
+        // skip to the next non-empty slot
+        uint64_t next = tw_next_ms(tw);
+        tw_advance(tw, next < now_ms + 1 ? next : now_ms + 1);
+    }
+    return NULL;
+}
+
+uint64_t tw_next_ms(TimerWheel *tw) {
+    if (tw->size == 0) {
+        return (uint64_t)-1;
+    }
+    // the first non-empty slot of the lowest level. the current slot
+    // of an upper level is always empty since it was cascaded.
+    for (size_t level = 0; level < k_wheel_levels; ++level) {
+        size_t shift = level * k_wheel_bits;
+        uint64_t cur = tw->now_ms >> shift;
+        for (uint64_t k = (level == 0 ? 0 : 1); k < k_wheel_slots; ++k) {
+            if (!dlist_empty(&tw->slots[level][(cur + k) & k_wheel_mask])) {
+                return level == 0 ? tw->now_ms + k : (cur + k) << shift;
+            }
+        }
+    }
+    assert(0);  // not expected
+    return tw->now_ms;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "list.h"
+
+
+// a hierarchical timing wheel with millisecond ticks. level L has
+// 256 slots of 256^L ms each, 4 levels cover 2^32 ms (49 days).
+// timers further away are parked and placed again when reached.
+const size_t k_wheel_bits = 8;
+const size_t k_wheel_slots = (size_t)1 << k_wheel_bits;
+const size_t k_wheel_levels = 4;
+
+struct WTimer {
+    DList link;                 // unlinked if not armed
+    uint64_t expire_ms = 0;
+};
+
+struct TimerWheel {
+    uint64_t now_ms = 0;        // the next tick to process
+    size_t size = 0;
+    DList slots[k_wheel_levels][k_wheel_slots];
+};
+
+inline bool tw_armed(WTimer *timer) {
+    return timer->link.next != NULL;
+}
+
+void tw_init(TimerWheel *tw, uint64_t now_ms);
+// arm or re-arm the timer
+void tw_add(TimerWheel *tw, WTimer *timer, uint64_t expire_ms);
+void tw_del(TimerWheel *tw, WTimer *timer);
+// remove and return a timer that expired at or before `now_ms`,
+// or NULL if none. the clock advances up to `now_ms`.
+WTimer *tw_pop(TimerWheel *tw, uint64_t now_ms);
+// no timer expires before this. -1 if there are no timers.
+uint64_t tw_next_ms(TimerWheel *tw);
@@ -1,16 +1,20 @@
 #include <assert.h>
+#include <math.h>
 #include <string.h>
 #include <stdlib.h>
 // proj
 #include "zset.h"
+#include "slab.h"
 #include "common.h"
 
 
 static ZNode *znode_new(const char *name, size_t len, double score) {
-    ZNode *node = (ZNode *)malloc(sizeof(ZNode) + len);
+    ZNode *node = (ZNode *)slab_alloc(sizeof(ZNode) + len);
     assert(node);   // not a good idea in real projects
+#ifndef ZSET_BTREE
     avl_init(&node->tree);
-    node->hmap.next = NULL;
+#endif
+    node->hmap = HNode{};
     node->hmap.hcode = str_hash((uint8_t *)name, len);
     node->score = score;
     node->len = len;
@@ -18,23 +22,226 @@ static ZNode *znode_new(const char *name, size_t len, double score) {
     return node;
 }
 
+static void znode_del(ZNode *node) {
+    slab_free(node, sizeof(ZNode) + node->len);
+}
+
 static uint32_t min(size_t lhs, size_t rhs) {
     return lhs < rhs ? lhs : rhs;
 }
 
 // compare by the (score, name) tuple
-static bool zless(
-    AVLNode *lhs, double score, const char *name, size_t len)
+static int zcmp(
+    double ls, const char *lname, size_t llen,
+    double rs, const char *rname, size_t rlen)
 {
-    ZNode *zl = container_of(lhs, ZNode, tree);
-    if (zl->score != score) {
-        return zl->score < score;
+    if (ls != rs) {
+        return ls < rs ? -1 : 1;
     }
-    int rv = memcmp(zl->name, name, min(zl->len, len));
+    int rv = memcmp(lname, rname, min(llen, rlen));
     if (rv != 0) {
-        return rv < 0;
+        return rv;
     }
-    return zl->len < len;
+    return llen < rlen ? -1 : (llen > rlen ? 1 : 0);
+}
+
+// the listpack encoding. each tuple is:
+// | score (8 bytes) | len (1 byte) | name | len (1 byte) |
+// the trailing length is for iterating backwards.
+static uint32_t zl_tuple_size(size_t len) {
+    return (uint32_t)(len + 10);
+}
+
+static double zl_score(const uint8_t *p) {
+    double score = 0;
+    memcpy(&score, p, 8);
+    return score;
+}
+
+// the first tuple that is greater or equal to the argument
+static uint32_t zl_lower(
+    ZSet *zset, double score, const char *name, size_t len, int64_t *rank)
+{
+    uint32_t off = 0;
+    int64_t r = 0;
+    while (off < zset->list_bytes) {
+        const uint8_t *p = &zset->list[off];
+        if (zcmp(zl_score(p), (char *)p + 9, p[8], score, name, len) >= 0) {
+            break;
+        }
+        off += zl_tuple_size(p[8]);
+        r++;
+    }
+    *rank = r;
+    return off;
+}
+
+// linear search by name
+static bool zl_find(
+    ZSet *zset, const char *name, size_t len, uint32_t *off, int64_t *rank)
+{
+    int64_t r = 0;
+    for (uint32_t pos = 0; pos < zset->list_bytes; r++) {
+        const uint8_t *p = &zset->list[pos];
+        if (p[8] == len && 0 == memcmp(p + 9, name, len)) {
+            *off = pos;
+            *rank = r;
+            return true;
+        }
+        pos += zl_tuple_size(p[8]);
+    }
+    return false;
+}
+
+static void zl_insert(ZSet *zset, double score, const char *name, size_t len) {
+    assert(len <= k_zlist_max_name);
+    int64_t rank = 0;
+    uint32_t off = zl_lower(zset, score, name, len, &rank);
+    uint32_t sz = zl_tuple_size(len);
+    if (zset->list_bytes + sz > zset->list_cap) {
+        uint32_t cap = zset->list_cap + zset->list_cap / 2;
+        if (cap < zset->list_bytes + sz) {
+            cap = zset->list_bytes + sz;
+        }
+        zset->list = (uint8_t *)realloc(zset->list, cap);
+        assert(zset->list);
+        zset->list_cap = cap;
+    }
+
+    uint8_t *p = &zset->list[off];
+    memmove(p + sz, p, zset->list_bytes - off);
+    memcpy(p, &score, 8);
+    p[8] = (uint8_t)len;
+    memcpy(p + 9, name, len);
+    p[9 + len] = (uint8_t)len;
+    zset->list_bytes += sz;
+    zset->list_size++;
+}
+
+static void zl_remove(ZSet *zset, uint32_t off) {
+    uint8_t *p = &zset->list[off];
+    uint32_t sz = zl_tuple_size(p[8]);
+    memmove(p, p + sz, zset->list_bytes - off - sz);
+    zset->list_bytes -= sz;
+    zset->list_size--;
+}
+
+static void zl_load(ZIter *it) {
+    ZSet *zset = it->zset;
+    it->valid = it->off < zset->list_bytes;
+    if (it->valid) {
+        const uint8_t *p = &zset->list[it->off];
+        it->score = zl_score(p);
+        it->len = p[8];
+        it->name = (const char *)p + 9;
+    }
+}
+
+static void zl_seek_rank(ZSet *zset, int64_t rank, ZIter *it) {
+    it->valid = false;
+    if (rank < 0 || rank >= (int64_t)zset->list_size) {
+        return;
+    }
+    it->off = 0;
+    for (int64_t i = 0; i < rank; ++i) {
+        it->off += zl_tuple_size(zset->list[it->off + 8]);
+    }
+    zl_load(it);
+}
+
+static void zl_next(ZIter *it) {
+    it->off += zl_tuple_size(it->len);
+    zl_load(it);
+}
+
+static void zl_prev(ZIter *it) {
+    if (it->off == 0) {
+        it->valid = false;
+        return;
+    }
+    it->off -= zl_tuple_size(it->zset->list[it->off - 1]);
+    zl_load(it);
+}
+
+static void iter_load(ZIter *it, ZNode *node) {
+    it->node = node;
+    it->valid = node != NULL;
+    if (node) {
+        it->score = node->score;
+        it->name = node->name;
+        it->len = node->len;
+    }
+}
+
+#ifdef ZSET_BTREE
+
+static void tree_add(ZSet *zset, ZNode *node) {
+    bt_insert(&zset->tree, node);
+}
+
+static void tree_del(ZSet *zset, ZNode *node) {
+    bt_delete(&zset->tree, node);
+}
+
+static void tree_query(
+    ZSet *zset, double score, const char *name, size_t len, int64_t offset,
+    ZIter *it)
+{
+    BIter *pos = &it->pos;
+    bt_seek(&zset->tree, score, name, len, pos);
+    if (pos->node && offset != 0) {
+        int64_t idx = (int64_t)pos->idx + offset;
+        if (0 <= idx && idx < (int64_t)pos->leaf->hdr.n) {
+            // within the leaf
+            pos->idx = (uint32_t)idx;
+            pos->node = pos->leaf->item[idx];
+        } else {
+            int64_t rank = bt_rank(&zset->tree, pos->node) + offset;
+            bt_seek_rank(&zset->tree, rank, pos);
+        }
+    }
+    iter_load(it, pos->node);
+}
+
+static void tree_seek_rank(ZSet *zset, int64_t rank, ZIter *it) {
+    bt_seek_rank(&zset->tree, rank, &it->pos);
+    iter_load(it, it->pos.node);
+}
+
+static int64_t tree_rank(ZSet *zset, ZNode *node) {
+    return bt_rank(&zset->tree, node);
+}
+
+static void tree_next(ZIter *it) {
+    bt_next(&it->pos);
+    iter_load(it, it->pos.node);
+}
+
+static void tree_prev(ZIter *it) {
+    bt_prev(&it->pos);
+    iter_load(it, it->pos.node);
+}
+
+static void tree_dispose(ZSet *zset) {
+    bt_dispose(&zset->tree, &znode_del);
+}
+
+static size_t tree_mem_usage(ZSet *zset) {
+    size_t total = bt_mem_usage(&zset->tree);
+    BIter it;
+    for (bt_seek_rank(&zset->tree, 0, &it); it.node; bt_next(&it)) {
+        total += sizeof(ZNode) + it.node->len;
+    }
+    return total;
+}
+
+#else
+
+static bool zless(
+    AVLNode *lhs, double score, const char *name, size_t len)
+{
+    ZNode *zl = container_of(lhs, ZNode, tree);
+    return zcmp(zl->score, zl->name, zl->len, score, name, len) < 0;
 }
 
 static bool zless(AVLNode *lhs, AVLNode *rhs) {
@@ -62,31 +269,89 @@ static void tree_add(ZSet *zset, ZNode *node) {
     }
 }
 
-// update the score of an existing node (AVL tree reinsertion)
-static void zset_update(ZSet *zset, ZNode *node, double score) {
-    if (node->score == score) {
-        return;
-    }
+static void tree_del(ZSet *zset, ZNode *node) {
     zset->tree = avl_del(&node->tree);
-    node->score = score;
     avl_init(&node->tree);
-    tree_add(zset, node);
 }
 
-// add a new (score, name) tuple, or update the score of the existing tuple
-bool zset_add(ZSet *zset, const char *name, size_t len, double score) {
-    ZNode *node = zset_lookup(zset, name, len);
-    if (node) {
-        zset_update(zset, node, score);
-        return false;
-    } else {
-        node = znode_new(name, len, score);
-        hm_insert(&zset->hmap, &node->hmap);
-        tree_add(zset, node);
-        return true;
+// find the (score, name) tuple that is greater or equal to the argument,
+// then offset relative to it.
+static void tree_query(
+    ZSet *zset, double score, const char *name, size_t len, int64_t offset,
+    ZIter *it)
+{
+    AVLNode *found = NULL;
+    AVLNode *cur = zset->tree;
+    while (cur) {
+        if (zless(cur, score, name, len)) {
+            cur = cur->right;
+        } else {
+            found = cur;    // candidate
+            cur = cur->left;
+        }
+    }
+
+    if (found) {
+        found = avl_offset(found, offset);
     }
+    iter_load(it, found ? container_of(found, ZNode, tree) : NULL);
 }
 
+static void tree_seek_rank(ZSet *zset, int64_t rank, ZIter *it) {
+    AVLNode *root = zset->tree;
+    if (rank < 0 || !root || rank >= (int64_t)root->cnt) {
+        return iter_load(it, NULL);
+    }
+    // offset from the root
+    int64_t root_rank = root->left ? root->left->cnt : 0;
+    AVLNode *found = avl_offset(root, rank - root_rank);
+    iter_load(it, container_of(found, ZNode, tree));
+}
+
+static int64_t tree_rank(ZSet *zset, ZNode *node) {
+    (void)zset;
+    return avl_rank(&node->tree);
+}
+
+static void tree_next(ZIter *it) {
+    AVLNode *next = avl_offset(&it->node->tree, +1);
+    iter_load(it, next ? container_of(next, ZNode, tree) : NULL);
+}
+
+static void tree_prev(ZIter *it) {
+    AVLNode *prev = avl_offset(&it->node->tree, -1);
+    iter_load(it, prev ? container_of(prev, ZNode, tree) : NULL);
+}
+
+static void avl_dispose(AVLNode *node) {
+    if (!node) {
+        return;
+    }
+    avl_dispose(node->left);
+    avl_dispose(node->right);
+    znode_del(container_of(node, ZNode, tree));
+}
+
+static void tree_dispose(ZSet *zset) {
+    avl_dispose(zset->tree);
+    zset->tree = NULL;
+}
+
+static size_t avl_mem_usage(AVLNode *node) {
+    if (!node) {
+        return 0;
+    }
+    ZNode *znode = container_of(node, ZNode, tree);
+    return sizeof(ZNode) + znode->len
+        + avl_mem_usage(node->left) + avl_mem_usage(node->right);
+}
+
+static size_t tree_mem_usage(ZSet *zset) {
+    return avl_mem_usage(zset->tree);
+}
+
+#endif  // ZSET_BTREE
+
 // a helper structure for the hashtable lookup
 struct HKey {
     HNode node;
@@ -106,81 +371,217 @@ static bool hcmp(HNode *node, HNode *key) {
     return 0 == memcmp(znode->name, hkey->name, znode->len);
 }
 
-// lookup by name
-ZNode *zset_lookup(ZSet *zset, const char *name, size_t len) {
-    if (!zset->tree) {
-        return NULL;
-    }
+static void hkey_init(HKey *key, const char *name, size_t len) {
+    key->node.hcode = str_hash((uint8_t *)name, len);
+    key->name = name;
+    key->len = len;
+}
 
+// lookup by name
+static ZNode *znode_lookup(ZSet *zset, const char *name, size_t len) {
     HKey key;
-    key.node.hcode = str_hash((uint8_t *)name, len);
-    key.name = name;
-    key.len = len;
+    hkey_init(&key, name, len);
     HNode *found = hm_lookup(&zset->hmap, &key.node, &hcmp);
-    if (!found) {
-        return NULL;
+    return found ? container_of(found, ZNode, hmap) : NULL;
+}
+
+// move the tuples to the hashtable and the index
+static void zl_convert(ZSet *zset) {
+    uint32_t off = 0;
+    while (off < zset->list_bytes) {
+        const uint8_t *p = &zset->list[off];
+        ZNode *node = znode_new((char *)p + 9, p[8], zl_score(p));
+        hm_insert(&zset->hmap, &node->hmap);
+        tree_add(zset, node);
+        off += zl_tuple_size(p[8]);
+    }
+    free(zset->list);
+    zset->list = NULL;
+    zset->list_size = zset->list_bytes = zset->list_cap = 0;
+    zset->is_list = false;
+}
+
+// add a new (score, name) tuple, or update the score of the existing tuple
+bool zset_add(ZSet *zset, const char *name, size_t len, double score) {
+    if (zset->is_list) {
+        uint32_t off = 0;
+        int64_t rank = 0;
+        if (zl_find(zset, name, len, &off, &rank)) {
+            if (zl_score(&zset->list[off]) != score) {
+                zl_remove(zset, off);
+                zl_insert(zset, score, name, len);
+            }
+            return false;
+        }
+        if (zset->list_size < k_zlist_max_size && len <= k_zlist_max_name) {
+            zl_insert(zset, score, name, len);
+            return true;
+        }
+        zl_convert(zset);
     }
 
-    return container_of(found, ZNode, hmap);
+    ZNode *node = znode_lookup(zset, name, len);
+    if (node) {
+        // update the score (reinsertion)
+        if (node->score != score) {
+            tree_del(zset, node);
+            node->score = score;
+            tree_add(zset, node);
+        }
+        return false;
+    } else {
+        node = znode_new(name, len, score);
+        hm_insert(&zset->hmap, &node->hmap);
+        tree_add(zset, node);
+        return true;
+    }
+}
+
+bool zset_score(ZSet *zset, const char *name, size_t len, double *score) {
+    if (zset->is_list) {
+        uint32_t off = 0;
+        int64_t rank = 0;
+        if (!zl_find(zset, name, len, &off, &rank)) {
+            return false;
+        }
+        *score = zl_score(&zset->list[off]);
+        return true;
+    }
+
+    ZNode *node = znode_lookup(zset, name, len);
+    if (node) {
+        *score = node->score;
+    }
+    return node != NULL;
 }
 
 // deletion by name
-ZNode *zset_pop(ZSet *zset, const char *name, size_t len) {
-    if (!zset->tree) {
-        return NULL;
+bool zset_del(ZSet *zset, const char *name, size_t len) {
+    if (zset->is_list) {
+        uint32_t off = 0;
+        int64_t rank = 0;
+        if (!zl_find(zset, name, len, &off, &rank)) {
+            return false;
+        }
+        zl_remove(zset, off);
+        return true;
     }
 
     HKey key;
-    key.node.hcode = str_hash((uint8_t *)name, len);
-    key.name = name;
-    key.len = len;
+    hkey_init(&key, name, len);
     HNode *found = hm_pop(&zset->hmap, &key.node, &hcmp);
     if (!found) {
-        return NULL;
+        return false;
     }
-
     ZNode *node = container_of(found, ZNode, hmap);
-    zset->tree = avl_del(&node->tree);
-    return node;
+    tree_del(zset, node);
+    znode_del(node);
+    return true;
+}
+
+int64_t zset_rank(ZSet *zset, const char *name, size_t len) {
+    if (zset->is_list) {
+        uint32_t off = 0;
+        int64_t rank = 0;
+        return zl_find(zset, name, len, &off, &rank) ? rank : -1;
+    }
+
+    ZNode *node = znode_lookup(zset, name, len);
+    return node ? tree_rank(zset, node) : -1;
 }
 
 // find the (score, name) tuple that is greater or equal to the argument,
 // then offset relative to it.
-ZNode *zset_query(
-    ZSet *zset, double score, const char *name, size_t len, int64_t offset)
+void zset_query(
+    ZSet *zset, double score, const char *name, size_t len, int64_t offset,
+    ZIter *it)
 {
-    AVLNode *found = NULL;
-    AVLNode *cur = zset->tree;
-    while (cur) {
-        if (zless(cur, score, name, len)) {
-            cur = cur->right;
-        } else {
-            found = cur;    // candidate
-            cur = cur->left;
-        }
+    it->zset = zset;
+    if (!zset->is_list) {
+        return tree_query(zset, score, name, len, offset, it);
     }
 
-    if (found) {
-        found = avl_offset(found, offset);
+    int64_t rank = 0;
+    it->off = zl_lower(zset, score, name, len, &rank);
+    zl_load(it);
+    if (it->valid && offset != 0) {
+        zl_seek_rank(zset, rank + offset, it);
     }
-    return found ? container_of(found, ZNode, tree) : NULL;
 }
 
-void znode_del(ZNode *node) {
-    free(node);
+void zset_seek_rank(ZSet *zset, int64_t rank, ZIter *it) {
+    it->zset = zset;
+    if (zset->is_list) {
+        zl_seek_rank(zset, rank, it);
+    } else {
+        tree_seek_rank(zset, rank, it);
+    }
 }
 
-static void tree_dispose(AVLNode *node) {
-    if (!node) {
+void zset_next(ZIter *it) {
+    if (!it->valid) {
         return;
     }
-    tree_dispose(node->left);
-    tree_dispose(node->right);
-    znode_del(container_of(node, ZNode, tree));
+    if (it->zset->is_list) {
+        zl_next(it);
+    } else {
+        tree_next(it);
+    }
+}
+
+void zset_prev(ZIter *it) {
+    if (!it->valid) {
+        return;
+    }
+    if (it->zset->is_list) {
+        zl_prev(it);
+    } else {
+        tree_prev(it);
+    }
+}
+
+int64_t zset_score_rank(ZSet *zset, double score, bool incl) {
+    if (incl) {
+        if (score == INFINITY) {
+            return (int64_t)zset_size(zset);
+        }
+        // the first tuple with a higher score
+        score = nextafter(score, INFINITY);
+    }
+
+    if (zset->is_list) {
+        int64_t rank = 0;
+        zl_lower(zset, score, "", 0, &rank);
+        return rank;
+    }
+    ZIter it;
+    it.zset = zset;
+    tree_query(zset, score, "", 0, 0, &it);
+    return it.valid ? tree_rank(zset, it.node) : (int64_t)zset_size(zset);
+}
+
+size_t zset_size(ZSet *zset) {
+    return zset->is_list ? zset->list_size : hm_size(&zset->hmap);
+}
+
+void zset_reserve(ZSet *zset, size_t n) {
+    assert(zset_size(zset) == 0);
+    if (n > k_zlist_max_size) {
+        zl_convert(zset);
+        hm_reserve(&zset->hmap, n);
+    }
 }
 
 // destroy the zset
 void zset_dispose(ZSet *zset) {
-    tree_dispose(zset->tree);
+    free(zset->list);
+    zset->list = NULL;
+    tree_dispose(zset);
     hm_destroy(&zset->hmap);
 }
+
+// the bytes allocated by the zset, including itself
+size_t zset_mem_usage(ZSet *zset) {
+    return sizeof(ZSet) + zset->list_cap + tree_mem_usage(zset)
+        + hm_mem_usage(&zset->hmap);
+}
@@ -1,27 +1,73 @@
 #pragma once
 
 #include "avl.h"
+#include "btree.h"
 #include "hashtable.h"
 
 
+// small zsets are a sorted array of tuples, and are converted to
+// the hashtable + index when they grow past these limits.
+const size_t k_zlist_max_size = 128;
+const size_t k_zlist_max_name = 64;
+
+// the sorted index is an AVL tree, or a B+tree with -DZSET_BTREE
 struct ZSet {
+    // the listpack: (score, len, name, len) tuples. NULL if converted.
+    uint8_t *list = NULL;
+    uint32_t list_size = 0;     // the number of tuples
+    uint32_t list_bytes = 0;
+    uint32_t list_cap = 0;
+    bool is_list = true;
+#ifdef ZSET_BTREE
+    BTree tree;
+#else
     AVLNode *tree = NULL;
+#endif
     HMap hmap;
 };
 
 struct ZNode {
+#ifndef ZSET_BTREE
     AVLNode tree;
+#endif
     HNode hmap;
     double score = 0;
     size_t len = 0;
     char name[0];
 };
 
+// a position in the sorted order, the tuple is valid until the next update
+struct ZIter {
+    bool valid = false;     // false if out of range
+    double score = 0;
+    const char *name = NULL;
+    size_t len = 0;
+    // the position
+    ZSet *zset = NULL;
+    uint32_t off = 0;       // into the listpack
+    ZNode *node = NULL;
+#ifdef ZSET_BTREE
+    BIter pos;
+#endif
+};
+
 bool zset_add(ZSet *zset, const char *name, size_t len, double score);
-ZNode *zset_lookup(ZSet *zset, const char *name, size_t len);
-ZNode *zset_pop(ZSet *zset, const char *name, size_t len);
-ZNode *zset_query(
-    ZSet *zset, double score, const char *name, size_t len, int64_t offset
+bool zset_score(ZSet *zset, const char *name, size_t len, double *score);
+bool zset_del(ZSet *zset, const char *name, size_t len);
+// the 0-based rank of a name, -1 if not found
+int64_t zset_rank(ZSet *zset, const char *name, size_t len);
+void zset_query(
+    ZSet *zset, double score, const char *name, size_t len, int64_t offset,
+    ZIter *it
 );
+// by the 0-based rank
+void zset_seek_rank(ZSet *zset, int64_t rank, ZIter *it);
+void zset_next(ZIter *it);
+void zset_prev(ZIter *it);
+// the number of tuples with a lower score, or lower or equal if `incl`
+int64_t zset_score_rank(ZSet *zset, double score, bool incl);
+size_t zset_size(ZSet *zset);
+// size an empty zset for `n` tuples
+void zset_reserve(ZSet *zset, size_t n);
 void zset_dispose(ZSet *zset);
-void znode_del(ZNode *node);
+size_t zset_mem_usage(ZSet *zset);
@@ -8,6 +8,7 @@
 
 #include <functional>
 #include <map>
+#include <string_view>
 #include <vector>
 #include <unordered_map>
 
@@ -19,13 +20,18 @@
 class BasicFullServer : public EventLoopServer {
 protected:
 #ifdef USE_STL_MAP
-    static std::map<std::string, std::string> g_map;
+    // std::less<> allows lookups by std::string_view without a copy
+    static std::map<std::string, std::string, std::less<>> g_map;
 #elif defined(USE_MY_MAP)
     static my_map<std::string, std::string> g_map;
 #endif
     static const size_t K_MAX_ARGS = 1024;
 
-    static int32_t parse_req(const uint8_t *data, size_t len, std::vector<std::string> &out) {
+    // arguments of the current request, they point into Conn::rbuf
+    static std::vector<std::string_view> g_args;
+
+    static int32_t parse_req(const uint8_t *data, size_t len, std::vector<std::string_view> &out) {
+        out.clear();
         if (len < 4) {
             return -1;
         }
@@ -59,12 +65,13 @@ protected:
     //      +-----+-----+
     // cmd: | get | str |
     //      +-----+-----+
-    static uint32_t do_get(const std::vector<std::string> &cmd, uint8_t *res, uint32_t *reslen) {
-        if (!g_map.count(cmd[1])) {
+    static uint32_t do_get(const std::vector<std::string_view> &cmd, uint8_t *res, uint32_t *reslen) {
+        auto it = g_map.find(cmd[1]);
+        if (it == g_map.end()) {
             return RES_NX;
         }
 
-        std::string &val = g_map[cmd[1]];
+        std::string &val = it->second;
         assert(val.size() <= K_MAX_MSG);
         memcpy(res, val.data(), val.size());
 
@@ -73,31 +80,40 @@ protected:
         return RES_OK;
     }
 
-    static uint32_t do_set(const std::vector<std::string> &cmd, uint8_t *res, uint32_t *reslen) {
-        g_map[cmd[1]] = cmd[2];
+    static uint32_t do_set(const std::vector<std::string_view> &cmd, uint8_t *res, uint32_t *reslen) {
+        auto it = g_map.find(cmd[1]);
+        if (it == g_map.end()) {
+            g_map.emplace(cmd[1], cmd[2]);
+        } else {
+            it->second.assign(cmd[2]);
+        }
         return RES_OK;
     }
 
-    static uint32_t do_del(const std::vector<std::string> &cmd, uint8_t *res, uint32_t *reslen) {
-        g_map.erase(cmd[1]);
+    static uint32_t do_del(const std::vector<std::string_view> &cmd, uint8_t *res, uint32_t *reslen) {
+        auto it = g_map.find(cmd[1]);
+        if (it != g_map.end()) {
+            g_map.erase(it);
+        }
         return RES_OK;
     }
 
-    static bool cmd_is(const std::string &word, const char *cmd) {
-        return 0 == strcasecmp(word.c_str(), cmd);
+    static bool cmd_is(std::string_view word, const char *cmd) {
+        return word.size() == strlen(cmd)
+            && 0 == strncasecmp(word.data(), cmd, word.size());
     }
 
     static int32_t do_request(
             const uint8_t *req, uint32_t reqlen,
             uint32_t *rescode, uint8_t *res, uint32_t *reslen) {
-        std::vector<std::string> cmd;
+        std::vector<std::string_view> &cmd = g_args;
         if (0 != parse_req(req, reqlen, cmd)) {
             msg("bad request");
             return -1;
         }
         printf("client cmd length: %zu, command: ", cmd.size());
         for (const auto& c: cmd) {
-            printf("%s ", c.data());
+            printf("%.*s ", static_cast<int>(c.size()), c.data());
         }
         printf("\n");
         if (cmd.size() == 2 && cmd_is(cmd[0], "get")) {
@@ -169,90 +185,8 @@ protected:
         // continue the outer loop if the request was fully processed
         return (conn->state == STATE_REQ);
     }
-
-public:
-    int work() override {
-        curFd = socket(AF_INET, SOCK_STREAM, 0);
-        if (curFd < 0) {
-            die("socket()");
-        }
-
-        int val = 1;
-        setsockopt(curFd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
-
-        // bind
-        struct sockaddr_in addr = {};
-        addr.sin_family = AF_INET;
-        addr.sin_port = ntohs(1234);
-        addr.sin_addr.s_addr = ntohl(0);    // wildcard address 0.0.0.0
-        int rv = bind(curFd, (const sockaddr *)&addr, sizeof(addr));
-        if (rv) {
-            die("bind()");
-        }
-
-        // listen
-        rv = listen(curFd, SOMAXCONN);
-        if (rv) {
-            die("listen()");
-        }
-
-        // a map of all client connections, keyed by fd
-        std::vector<Conn *> fd2conn;
-
-        // set the listen fd to nonblocking mode
-        fd_set_nb(curFd);
-
-        // the event loop
-        std::vector<struct pollfd> poll_args;
-        while (true) {
-            // prepare the arguments of the poll()
-            poll_args.clear();
-            // for convenience, the listening fd is put in the first position
-            struct pollfd pfd = {curFd, POLLIN, 0};
-            poll_args.push_back(pfd);
-            // connection fds
-            for (Conn *conn : fd2conn) {
-                if (!conn) {
-                    continue;
-                }
-                struct pollfd pfd = {};
-                pfd.fd = conn->fd;
-                pfd.events = (conn->state == STATE_REQ) ? POLLIN : POLLOUT;
-                pfd.events = pfd.events | POLLERR;
-                poll_args.push_back(pfd);
-            }
-
-            // poll for active fds
-            // the timeout argument doesn't matter here
-            int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), 1000);
-            if (rv < 0) {
-                die("poll");
-            }
-
-            // process active connections
-            for (size_t i = 1; i < poll_args.size(); ++i) {
-                if (poll_args[i].revents) {
-                    Conn *conn = fd2conn[poll_args[i].fd];
-                    connection_io(conn);
-                    if (conn->state == STATE_END) {
-                        // client closed normally, or something bad happened.
-                        // destroy this connection
-                        fd2conn[conn->fd] = NULL;
-                        (void)close(conn->fd);
-                        free(conn);
-                    }
-                }
-            }
-
-            // try to accept a new connection if the listening fd is active
-            if (poll_args[0].revents) {
-                (void)accept_new_conn(fd2conn, curFd);
-            }
-        }
-
-        return 0;
-    }
 };
 
-std::map<std::string, std::string> BasicFullServer::g_map;
+std::map<std::string, std::string, std::less<>> BasicFullServer::g_map;
+std::vector<std::string_view> BasicFullServer::g_args;
 
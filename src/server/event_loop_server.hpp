@@ -6,7 +6,7 @@
 
 #pragma once
 
-#include <poll.h>
+#include <sys/epoll.h>
 
 #include <vector>
 
@@ -15,6 +15,11 @@
 
 class EventLoopServer : public BaseServer {
 protected:
+    // epoll instance, watches the listening fd and all connections
+    int epfd{-1};
+
+    static const int K_MAX_EVENTS = 1024;
+
     // function which can set the listen fd to nonblocking mode
     void fd_set_nb(int fd) {
         errno = 0;
@@ -40,6 +45,43 @@ protected:
         fd2conn[conn->fd] = conn;
     }
 
+    // the events we want from epoll, derived from the connection state
+    static uint32_t want_events(Conn *conn) {
+        return (conn->state == STATE_REQ) ? EPOLLIN : EPOLLOUT;
+    }
+
+    void conn_watch(Conn *conn) {
+        struct epoll_event ev = {};
+        ev.events = want_events(conn);
+        ev.data.fd = conn->fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev)) {
+            die("epoll_ctl(ADD)");
+        }
+        conn->events = ev.events;
+    }
+
+    // only modify the registration when the state flips between REQ and RES
+    void conn_rewatch(Conn *conn) {
+        uint32_t want = want_events(conn);
+        if (want == conn->events) {
+            return;
+        }
+        struct epoll_event ev = {};
+        ev.events = want;
+        ev.data.fd = conn->fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev)) {
+            die("epoll_ctl(MOD)");
+        }
+        conn->events = want;
+    }
+
+    void conn_done(std::vector<Conn *> &fd2conn, Conn *conn) {
+        fd2conn[conn->fd] = nullptr;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, nullptr);
+        close(conn->fd);
+        delete conn;
+    }
+
     int32_t accept_new_conn(std::vector<Conn*> &fd2conn, int fd) {
         // accept in <socket.h>
         struct sockaddr_in client_addr = {};
@@ -68,6 +110,7 @@ protected:
         conn->wbuf_sent = 0;
 
         conn_put(fd2conn, conn);
+        conn_watch(conn);
         return 0;
     }
 
@@ -205,6 +248,12 @@ protected:
     }
 
 public:
+    ~EventLoopServer() {
+        if (epfd >= 0) {
+            close(epfd);
+        }
+    }
+
     int work() override {
         curFd = socket(AF_INET, SOCK_STREAM, 0);
         if (curFd < 0) {
@@ -236,55 +285,51 @@ public:
 
         fd_set_nb(curFd);
 
-        std::vector<struct pollfd> poll_args;
-
-        while (true) {
-            // prepare the arguments of the poll()
-            poll_args.clear();
-
-            // for convenience, the listening fd is put in the first position
-            struct pollfd pfd = {curFd, POLLIN, 0};
-            poll_args.push_back(pfd);
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0) {
+            die("epoll_create1()");
+        }
+        struct epoll_event lev = {};
+        lev.events = EPOLLIN;
+        lev.data.fd = curFd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, curFd, &lev)) {
+            die("epoll_ctl(ADD)");
+        }
 
-            // connection fds
-            for (auto conn: fd2conn) {
-                if (!conn) {
-                    continue;
-                }
-                pfd = {};
-                pfd.fd = conn->fd;
-                pfd.events = (conn->state == STATE_REQ) ? POLLIN : POLLOUT;
-                pfd.events |= POLLERR;
-                poll_args.push_back(pfd);
-            }
+        std::vector<struct epoll_event> events(K_MAX_EVENTS);
 
-            // poll for active fds
+        while (true) {
+            // wait for active fds, only ready ones are returned
             // the timeout argument doesn't matter here
-            // TODO(Tianyi): Change it into epoll
-            int rv = poll(poll_args.data(), static_cast<nfds_t>(poll_args.size()), 1000);
+            int rv = epoll_wait(epfd, events.data(), K_MAX_EVENTS, 1000);
+            if (rv < 0 && errno == EINTR) {
+                continue;
+            }
             if (rv < 0) {
-                die("poll");
+                die("epoll_wait");
             }
 
             // process active connections
-            // from index 1 (index 0 is the listening fd)
-            auto len_poll_args = poll_args.size();
-            for (auto i = 1; i < len_poll_args; ++i) {
-                if (poll_args[i].revents) {
-                    auto conn = fd2conn[poll_args[i].fd];
-                    connection_io(conn);
-                    if (conn->state == STATE_END) {
-                        // client closed (normally or sth bad happened)
-                        // close this connection
-                        fd2conn[conn->fd] = nullptr;
-                        close(conn->fd);
-                        delete(conn);
-                    }
+            bool listen_ready = false;
+            for (int i = 0; i < rv; ++i) {
+                int cfd = events[i].data.fd;
+                if (cfd == curFd) {
+                    listen_ready = true;
+                    continue;
+                }
+                auto conn = fd2conn[cfd];
+                connection_io(conn);
+                if (conn->state == STATE_END) {
+                    // client closed (normally or sth bad happened)
+                    // close this connection
+                    conn_done(fd2conn, conn);
+                } else {
+                    conn_rewatch(conn);
                 }
             }
 
             // try to accept a new connection if the listening fd is active
-            if (poll_args[0].revents) {
+            if (listen_ready) {
                 accept_new_conn(fd2conn, curFd);
             }
         }
@@ -26,6 +26,8 @@ const int K_MAX_MSG = 4096;
 struct Conn {
     int fd = -1;
     EVENT_STATE state = STATE_REQ;
+    // events currently registered in epoll
+    uint32_t events = 0;
 
     // buffer for reading
     size_t rbuf_size = 0;